@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+import asyncio
+import statistics
+import struct
+import time
+from argparse import ArgumentParser
+from bleak import BleakScanner, BleakClient
+
+SERVICE_UUID = "00001000-7858-48fb-b797-8613e960da6a"
+SERIAL_DATA_UUID = "00002001-7858-48fb-b797-8613e960da6a"
+BENCHMARK_UUID = "00002012-7858-48fb-b797-8613e960da6a"
+
+MODE_OFF = 0
+MODE_ECHO = 1
+MODE_SYNTHESIZE = 2
+
+result_event = asyncio.Event()
+result = None
+
+serial_notifications = 0
+serial_bytes = 0
+echo_queue = asyncio.Queue()
+
+
+def parse_result(data):
+    mode, notifications, byte_count, elapsed, interval, round_trip = struct.unpack("<BIIIHI", data)
+    return {
+        "mode": mode,
+        "notifications": notifications,
+        "bytes": byte_count,
+        "elapsed_ms": elapsed,
+        "interval_ms": interval * 1.25,
+        "round_trip_us": round_trip,
+    }
+
+
+def benchmark_handler(sender, data):
+    global result
+
+    result = parse_result(data)
+    result_event.set()
+
+
+def serial_handler(sender, data):
+    global serial_notifications
+    global serial_bytes
+
+    serial_notifications += 1
+    serial_bytes += len(data)
+    echo_queue.put_nowait((time.perf_counter(), bytes(data)))
+
+
+def print_result(device_result, host_elapsed):
+    elapsed = device_result["elapsed_ms"] / 1000
+    interval = device_result["interval_ms"]
+
+    print("device: {0} notifications, {1} bytes in {2:.3f}s".format(
+        device_result["notifications"], device_result["bytes"], elapsed))
+    print("host:   {0} notifications, {1} bytes in {2:.3f}s".format(
+        serial_notifications, serial_bytes, host_elapsed))
+
+    if elapsed > 0:
+        print("throughput: {0:.0f} B/s, {1:.1f} notifications/s".format(
+            device_result["bytes"] / elapsed, device_result["notifications"] / elapsed))
+
+    if elapsed > 0 and interval > 0:
+        events = (elapsed * 1000) / interval
+        print("connection interval: {0:.2f}ms, {1:.2f} notifications per connection event".format(
+            interval, device_result["notifications"] / events))
+
+    print("device round trip p50: {0}us".format(device_result["round_trip_us"]))
+
+
+async def run_echo(client, options):
+    # One frame in flight at a time, so each notification is the answer to the last write.
+    await client.write_gatt_char(BENCHMARK_UUID, struct.pack("<BHHI", MODE_ECHO, options.size, 0, options.count), True)
+
+    round_trips = []
+    started = time.perf_counter()
+    for sequence in range(options.count):
+        payload = "b{0:0{1}d}".format(sequence, max(options.size - 2, 1))[:options.size - 1].encode() + b"\n"
+
+        sent = time.perf_counter()
+        await client.write_gatt_char(SERIAL_DATA_UUID, payload, False)
+
+        while True:
+            received, data = await asyncio.wait_for(echo_queue.get(), 5.0)
+            if data == payload:
+                break
+
+        round_trips.append((received - sent) * 1000)
+
+        if options.rate > 0:
+            await asyncio.sleep(max(0, (1 / options.rate) - (time.perf_counter() - sent)))
+
+    host_elapsed = time.perf_counter() - started
+
+    await client.write_gatt_char(BENCHMARK_UUID, struct.pack("<B", MODE_OFF), True)
+    await asyncio.wait_for(result_event.wait(), 5.0)
+
+    print_result(result, host_elapsed)
+
+    round_trips.sort()
+    print("host round trip: p50 {0:.1f}ms, p99 {1:.1f}ms, max {2:.1f}ms, mean {3:.1f}ms".format(
+        round_trips[len(round_trips) // 2],
+        round_trips[min(len(round_trips) - 1, (len(round_trips) * 99) // 100)],
+        round_trips[-1],
+        statistics.mean(round_trips)))
+
+
+async def run_synthesize(client, options):
+    started = time.perf_counter()
+    await client.write_gatt_char(BENCHMARK_UUID, struct.pack("<BHHI", MODE_SYNTHESIZE, options.size, options.rate, options.count), True)
+
+    # The device notifies the result once it has sent every frame.
+    await asyncio.wait_for(result_event.wait(), options.timeout)
+    host_elapsed = time.perf_counter() - started
+
+    print_result(result, host_elapsed)
+
+    expected = options.size * options.count
+    if serial_bytes != expected:
+        print("WARNING: received {0} of {1} expected bytes".format(serial_bytes, expected))
+
+
+async def main():
+    parser = ArgumentParser(description="measure bridge throughput and latency using its loopback benchmark")
+    parser.add_argument(
+        "mode",
+        choices=["echo", "synthesize"],
+        help="echo: round trip writes through the notify path, synthesize: device generated frames",
+    )
+    parser.add_argument("-s", "--size", type=int, default=16, help="frame size in bytes, including the newline")
+    parser.add_argument("-r", "--rate", type=int, default=0, help="frames per second, 0 for as fast as possible")
+    parser.add_argument("-c", "--count", type=int, default=1000, help="number of frames")
+    parser.add_argument("-t", "--timeout", type=float, default=120.0, help="seconds to wait for a synthesize run")
+    options = parser.parse_args()
+
+    if options.size < 2 or options.size > 512:
+        parser.error("frame size must be between 2 and 512")
+
+    scanner = BleakScanner(service_uuids=[SERVICE_UUID])
+    device = await scanner.find_device_by_filter(
+        lambda d, ad: d.name and SERVICE_UUID in ad.service_uuids, 60.0
+    )
+    print(device)
+
+    if device is None:
+        return
+
+    async with BleakClient(device, timeout=30.0) as client:
+        print("connected, mtu {0}".format(client.mtu_size))
+
+        await client.start_notify(BENCHMARK_UUID, benchmark_handler)
+        await client.start_notify(SERIAL_DATA_UUID, serial_handler)
+
+        if options.mode == "echo":
+            await run_echo(client, options)
+        else:
+            await run_synthesize(client, options)
+
+
+asyncio.run(main())
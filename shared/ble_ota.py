@@ -4,23 +4,35 @@ import ecdsa
 import hashlib
 import io
 import struct
+import zlib
 from argparse import ArgumentParser
 from bleak import BleakScanner, BleakClient
 from ecdsa.util import sigencode_der
+from ota_delta import make_patch
 
 SERVICE_UUID = "00001000-7858-48fb-b797-8613e960da6a"
 CHAR_UUID = "00002009-7858-48fb-b797-8613e960da6a"
+LINK_INFO_UUID = "00002013-7858-48fb-b797-8613e960da6a"
 
 event = asyncio.Event()
 aborted = False
 remote_bytes_written = 0
 
+# Protocol v2 flow control, the device grants chunk writes as its flash writer catches up.
+credits = 0
+credits_event = asyncio.Event()
+
 def notification_handler(sender, data):
     global event
     global aborted
     global remote_bytes_written
+    global credits
+
+    progress, succeeded = struct.unpack("<IB", data[:5])
 
-    progress, succeeded = struct.unpack("<IB", data)
+    if len(data) >= 7:
+        credits += struct.unpack("<H", data[5:7])[0]
+        credits_event.set()
 
     if progress != 0xFFFFFFFF:
         #print("remote progress: {0}".format(progress))
@@ -34,11 +46,13 @@ def notification_handler(sender, data):
         aborted = True
 
     event.set()
+    credits_event.set()
 
 async def main():
     global event
     global aborted
     global remote_bytes_written
+    global credits
 
     parser = ArgumentParser(description="sign and upload an ota image over ble")
     parser.add_argument(
@@ -48,6 +62,18 @@ async def main():
         help="hex-encoded ecdsa p-256 private key",
         required=True,
     )
+    parser.add_argument(
+        "-c",
+        "--compress",
+        action="store_true",
+        help="send the image deflate compressed, needs ota protocol v3 firmware",
+    )
+    parser.add_argument(
+        "-d",
+        "--delta-from",
+        metavar="running",
+        help="send a patch against this firmware.bin, which must be the one the device is running, needs ota protocol v4 firmware",
+    )
     parser.add_argument(
         "firmware",
         help="path to the firmware.bin to upload",
@@ -59,7 +85,32 @@ async def main():
         private_key, ecdsa.NIST256p, hashlib.sha256
     )
 
-    with open(options.firmware, mode="rb") as file:
+    with open(options.firmware, mode="rb") as firmware:
+        image = firmware.read()
+
+    # The signature is always over the image as it ends up in flash.
+    hash = hashlib.sha256(image).digest()
+
+    image_format = 1
+    payload = image
+    required_version = 1
+    if options.delta_from:
+        with open(options.delta_from, mode="rb") as running:
+            payload = make_patch(running.read(), image)
+        image_format = 3
+        required_version = 4
+        print("{0} byte patch for a {1} byte image".format(len(payload), len(image)))
+
+    if options.compress:
+        # Raw deflate with a 4 KiB window, which is all the device keeps around while inflating.
+        compressor = zlib.compressobj(9, zlib.DEFLATED, -12)
+        compressed = compressor.compress(payload) + compressor.flush()
+        print("compressed {0} bytes to {1} ({2:.1f}%)".format(len(payload), len(compressed), (len(compressed) / len(payload)) * 100))
+        payload = compressed
+        image_format += 1
+        required_version = max(required_version, 3)
+
+    with io.BytesIO(payload) as file:
         scanner = BleakScanner(service_uuids=[SERVICE_UUID])
         device = await scanner.find_device_by_filter(
             lambda d, ad: d.name and SERVICE_UUID in ad.service_uuids, 60.0
@@ -71,13 +122,28 @@ async def main():
 
         async with BleakClient(device, timeout=30.0) as client:
             print("connected")
+
+            # Older firmware doesn't have the link info characteristic.
+            try:
+                link_info = await client.read_gatt_char(LINK_INFO_UUID)
+                mtu, tx_length, rx_length, tx_phy, rx_phy, interval = struct.unpack("<HHHBBH", link_info)
+                print("link: mtu {0}, data length tx {1} rx {2}, phy tx {3}M rx {4}M, interval {5:.2f}ms".format(
+                    mtu, tx_length, rx_length, tx_phy, rx_phy, interval * 1.25))
+            except Exception:
+                pass
+            # The first byte of the read value is the OTA protocol version, reading it also triggers pairing.
+            ota_info = await client.read_gatt_char(CHAR_UUID)
+            protocol_version = ota_info[0] if ota_info else 1
+
             await client.start_notify(CHAR_UUID, notification_handler)
 
-            print("authorized, starting update")
+            print("authorized, starting update (protocol v{0})".format(protocol_version))
+
+            if protocol_version < required_version:
+                print("device firmware doesn't support this update format, it needs ota protocol v{0}".format(required_version))
+                return
 
-            file.seek(0, io.SEEK_END)
-            size = file.tell()
-            file.seek(0, io.SEEK_SET)
+            size = len(payload)
 
             # 1029840 bytes
             # True = 8m13.095s
@@ -98,19 +164,47 @@ async def main():
             # 11 (12 writes to a batch) is a multiple of both 4 (iOS) and 6 (Android) packets per interval
             max_unconfirmed_writes = 11
 
-            await client.write_gatt_char(CHAR_UUID, struct.pack("<BBI", 1, 1, size))
+            # 3 bytes GATT overhead, 1 byte for our packet type header
+            chunk_size = client.mtu_size - 3 - 1
 
-            sha256 = hashlib.sha256()
+            windowed = protocol_version >= 2
+            resumable = protocol_version >= 5 and image_format == 1
+            if resumable:
+                # The hash identifies the session, running this again after a dropped link picks up where it left off.
+                await client.write_gatt_char(CHAR_UUID, struct.pack("<BBIBH", 1, image_format, size, 5, chunk_size) + hash)
+            elif windowed:
+                await client.write_gatt_char(CHAR_UUID, struct.pack("<BBIBH", 1, image_format, size, 2, chunk_size))
+            else:
+                await client.write_gatt_char(CHAR_UUID, struct.pack("<BBI", 1, image_format, size))
 
             done = 0
+            if resumable:
+                # The first status says where the device wants the image from.
+                while credits == 0 and not aborted:
+                    credits_event.clear()
+                    await credits_event.wait()
+
+                done = remote_bytes_written
+                if done > 0:
+                    print("resuming from {0} / {1} ({2:.2f}%)".format(done, size, (done / size) * 100))
+                file.seek(done)
+
             unconfirmed_writes = 0
-            # 3 bytes GATT overhead, 1 byte for our packet type header
-            chunk_size = client.mtu_size - 3 - 1
             for chunk in iter(lambda: file.read(chunk_size), b""):
+                if windowed:
+                    while credits == 0 and not aborted:
+                        credits_event.clear()
+                        await credits_event.wait()
+
                 if aborted:
                     return
 
-                confirm_this_write = unconfirmed_writes >= max_unconfirmed_writes
+                if windowed:
+                    # The device has room for it, so there's never a reason to wait for a response.
+                    credits -= 1
+                    confirm_this_write = False
+                else:
+                    confirm_this_write = unconfirmed_writes >= max_unconfirmed_writes
 
                 await client.write_gatt_char(
                     CHAR_UUID, struct.pack("<B", 2) + chunk, confirm_this_write
@@ -123,9 +217,6 @@ async def main():
                 else:
                     unconfirmed_writes = 0
 
-                sha256.update(chunk)
-
-            hash = sha256.digest()
             print("hash: {0}".format(hash.hex()))
 
             signature = signing_key.sign_digest_deterministic(
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+import hashlib
+import struct
+from argparse import ArgumentParser
+
+# See src/ota_patch.h for the format.
+MAGIC = b"X1DP"
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# Shortest run of the source worth a copy op, which costs 9 bytes.
+BLOCK_SIZE = 32
+
+
+def match_length(source, source_offset, target, target_offset):
+    length = 0
+    limit = min(len(source) - source_offset, len(target) - target_offset)
+
+    # Compare in big steps first, Python is slow byte at a time.
+    step = 256
+    while length + step <= limit and source[source_offset + length:source_offset + length + step] == target[target_offset + length:target_offset + length + step]:
+        length += step
+
+    while length < limit and source[source_offset + length] == target[target_offset + length]:
+        length += 1
+
+    return length
+
+
+def make_patch(source, target):
+    index = {}
+    for offset in range(0, len(source) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        index.setdefault(source[offset:offset + BLOCK_SIZE], offset)
+
+    ops = bytearray()
+    literal_start = 0
+    position = 0
+
+    def flush_literal(end):
+        if end > literal_start:
+            ops.extend(struct.pack("<BI", OP_INSERT, end - literal_start))
+            ops.extend(target[literal_start:end])
+
+    while position + BLOCK_SIZE <= len(target):
+        source_offset = index.get(target[position:position + BLOCK_SIZE])
+        if source_offset is None:
+            position += 1
+            continue
+
+        # Grow the match back into the pending literal, then forwards as far as it goes.
+        start = position
+        while start > literal_start and source_offset > 0 and source[source_offset - 1] == target[start - 1]:
+            start -= 1
+            source_offset -= 1
+
+        length = match_length(source, source_offset, target, start)
+
+        flush_literal(start)
+        ops.extend(struct.pack("<BII", OP_COPY, source_offset, length))
+
+        position = start + length
+        literal_start = position
+
+    flush_literal(len(target))
+
+    header = MAGIC + struct.pack("<I", len(source)) + hashlib.sha256(source).digest() + struct.pack("<I", len(target))
+    return bytes(header + ops)
+
+
+def apply_patch(source, patch):
+    if patch[:4] != MAGIC:
+        raise ValueError("not a patch")
+
+    source_size, = struct.unpack_from("<I", patch, 4)
+    source_hash = patch[8:40]
+    target_size, = struct.unpack_from("<I", patch, 40)
+
+    if source_size != len(source) or hashlib.sha256(source).digest() != source_hash:
+        raise ValueError("patch was made against a different source")
+
+    target = bytearray()
+    position = 44
+    while position < len(patch):
+        op = patch[position]
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", patch, position + 1)
+            target.extend(source[offset:offset + length])
+            position += 9
+        elif op == OP_INSERT:
+            length, = struct.unpack_from("<I", patch, position + 1)
+            target.extend(patch[position + 5:position + 5 + length])
+            position += 5 + length
+        else:
+            raise ValueError("unknown op {0}".format(op))
+
+    if len(target) != target_size:
+        raise ValueError("patch produced the wrong size")
+
+    return bytes(target)
+
+
+def main():
+    parser = ArgumentParser(description="create a delta ota patch between two firmware images")
+    parser.add_argument("source", help="path to the firmware.bin currently running on the device")
+    parser.add_argument("target", help="path to the new firmware.bin")
+    parser.add_argument("patch", help="path to write the patch to")
+    options = parser.parse_args()
+
+    with open(options.source, mode="rb") as file:
+        source = file.read()
+
+    with open(options.target, mode="rb") as file:
+        target = file.read()
+
+    patch = make_patch(source, target)
+    if apply_patch(source, patch) != target:
+        raise RuntimeError("patch does not reproduce the target")
+
+    with open(options.patch, mode="wb") as file:
+        file.write(patch)
+
+    print("{0} byte patch for a {1} byte image ({2:.1f}%)".format(len(patch), len(target), (len(patch) / len(target)) * 100))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,151 @@
+#include "battery.h"
+
+#include "defaults.h"
+#include "log.h"
+
+#include <Arduino.h>
+
+#include <algorithm>
+#include <array>
+#include <iterator>
+
+// Each reading averages a few back to back conversions to take out ADC noise. The median
+// of the last few readings then throws away any that landed in a TX burst (we've no view
+// of the controller's TX schedule from here, so they're spread out in time instead), and
+// an EMA over the medians smooths what's left.
+static constexpr size_t CONVERSIONS_PER_READING = 8;
+static constexpr size_t MEDIAN_WINDOW = 5;
+// Each new median moves the filtered value 1 / (1 << EMA_SHIFT) of the way.
+static constexpr int32_t EMA_SHIFT = 2;
+// The filtered value is kept with this many fractional bits so small steps aren't lost.
+static constexpr int32_t FILTER_FRACTION_BITS = 4;
+
+// Resting voltage against remaining charge for a single cell LiPo, highest first.
+// 4234 (mostly 4232) appears to be our actual max
+// 3218 seems to be the minimum seen when re-connecting usb after death
+// seeing as low as 3016 via ble after disconnecting again
+// got stuck at 3.9v charge after discharge test - needed a cold reboot
+struct DischargePoint {
+    uint16_t millivolts;
+    uint8_t level;
+};
+
+static constexpr DischargePoint DISCHARGE_CURVE[] = {
+    { 4200, 100 },
+    { 4150, 95 },
+    { 4110, 90 },
+    { 4080, 85 },
+    { 4020, 80 },
+    { 3980, 75 },
+    { 3950, 70 },
+    { 3910, 65 },
+    { 3870, 60 },
+    { 3850, 55 },
+    { 3840, 50 },
+    { 3820, 45 },
+    { 3800, 40 },
+    { 3790, 35 },
+    { 3770, 30 },
+    { 3750, 25 },
+    { 3730, 20 },
+    { 3710, 15 },
+    { 3690, 10 },
+    { 3610, 5 },
+    { 3200, 0 },
+};
+
+static std::array<uint32_t, MEDIAN_WINDOW> readings = {};
+static size_t reading_index = 0;
+static int32_t filtered = 0;
+static bool low = false;
+static uint8_t level = 0;
+
+static uint32_t takeReading() {
+    uint32_t total = 0;
+    for (size_t i = 0; i < CONVERSIONS_PER_READING; ++i) {
+        total += analogReadMilliVolts(A13);
+    }
+
+    // The divider halves the battery voltage.
+    return (total * 2) / CONVERSIONS_PER_READING;
+}
+
+static uint32_t getMedian() {
+    std::array<uint32_t, MEDIAN_WINDOW> sorted = readings;
+    std::nth_element(sorted.begin(), sorted.begin() + (MEDIAN_WINDOW / 2), sorted.end());
+    return sorted[MEDIAN_WINDOW / 2];
+}
+
+static uint8_t getLevelForVoltage(uint32_t millivolts) {
+    if (millivolts >= DISCHARGE_CURVE[0].millivolts) {
+        return DISCHARGE_CURVE[0].level;
+    }
+
+    for (size_t i = 1; i < std::size(DISCHARGE_CURVE); ++i) {
+        const DischargePoint &upper = DISCHARGE_CURVE[i - 1];
+        const DischargePoint &lower = DISCHARGE_CURVE[i];
+        if (millivolts < lower.millivolts) {
+            continue;
+        }
+
+        // Linear between the points, rounded to the nearest percent.
+        uint32_t span = upper.millivolts - lower.millivolts;
+        uint32_t offset = millivolts - lower.millivolts;
+        return lower.level + (((upper.level - lower.level) * offset) + (span / 2)) / span;
+    }
+
+    return 0;
+}
+
+void Battery::init() {
+    for (auto &reading : readings) {
+        reading = takeReading();
+        delay(2);
+    }
+
+    filtered = getMedian() << FILTER_FRACTION_BITS;
+    level = getLevelForVoltage(getMillivolts());
+    low = getMillivolts() < BATTERY_CUTOFF_VOLTAGE;
+
+    Log::info<LogCategory::Power>("battery: %dmV %d%%\n", getMillivolts(), level);
+}
+
+uint8_t Battery::update() {
+    readings[reading_index] = takeReading();
+    reading_index = (reading_index + 1) % MEDIAN_WINDOW;
+
+    int32_t median = getMedian() << FILTER_FRACTION_BITS;
+    filtered += (median - filtered) >> EMA_SHIFT;
+
+    uint32_t millivolts = getMillivolts();
+    uint8_t new_level = getLevelForVoltage(millivolts);
+    if (new_level != level) {
+        Log::info<LogCategory::Power>("battery: %dmV %d%%\n", millivolts, new_level);
+        level = new_level;
+    }
+
+    // Latched, we go to sleep once it's set.
+    // TODO: Tune the cutoff values.
+    if (!low && millivolts < BATTERY_CUTOFF_VOLTAGE) {
+        Log::warning<LogCategory::Power>("battery dropped below cutoff (%dmV)\n", millivolts);
+        low = true;
+    }
+
+    return level;
+}
+
+bool Battery::canStart() {
+    return getMillivolts() >= (BATTERY_CUTOFF_VOLTAGE + BATTERY_CUTOFF_HYSTERESIS);
+}
+
+bool Battery::isLow() {
+    return low;
+}
+
+uint32_t Battery::getMillivolts() {
+    return filtered >> FILTER_FRACTION_BITS;
+}
+
+uint8_t Battery::getLevel() {
+    return level;
+}
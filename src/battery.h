@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+// Battery voltage from the divider on A13, filtered so that the sag during radio TX
+// bursts neither moves the reported level nor trips the cutoff.
+class Battery {
+public:
+    // Fills the filter from a quick burst of readings, so the first level is a real one.
+    static void init();
+    // Takes another reading, every BATTERY_READING_INTERVAL seconds. Returns the new level.
+    static uint8_t update();
+
+    // Only true when the battery is the hysteresis above the cutoff, for deciding to boot.
+    static bool canStart();
+    // True once the filtered voltage has dropped below the cutoff.
+    static bool isLow();
+
+    static uint32_t getMillivolts();
+    static uint8_t getLevel();
+};
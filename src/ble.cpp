@@ -4,101 +4,536 @@
 #include "bluetooth.h"
 #include "defaults.h"
 #include "config.h"
+#include "config_blob.h"
+#include "diagnostics.h"
+#include "envelope.h"
+#include "framer.h"
+#include "led.h"
+#include "ota.h"
+#include "power.h"
+#include "trace.h"
 
 #include <BLEDevice.h>
 #include <BLE2902.h>
 #include <BLE2904.h>
 
-#include <esp_sleep.h>
-#include <esp_ota_ops.h>
 #include <esp_gatt_common_api.h>
-#include <mbedtls/sha256.h>
-#include <mbedtls/ecdsa.h>
-#include <mbedtls/error.h>
-
-static void gracefulCleanup() {
-    Bluetooth::deinit();
-    Ble::deinit();
-    vTaskDelay((2 * 1000) / portTICK_PERIOD_MS);
+#include <esp_timer.h>
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+static std::vector<BLE2902 *> client_config_descriptors;
+
+// One entry per connected client, looked up by conn_id. The BLE2902 descriptors are shared by
+// every peer, so which notifications each client has enabled is tracked here instead, as a bit
+// per entry in client_config_descriptors.
+struct BleConnection {
+    bool in_use;
+    uint16_t conn_id;
+    std::array<uint8_t, 6> address;
+    uint16_t mtu;
+    uint32_t subscriptions;
+    int64_t last_activity_time;
+
+    // Link layer state, see X1_GATT_UUID_LINK_INFO. The interval is in 1.25ms units.
+    uint16_t connection_interval;
+    uint16_t tx_data_length;
+    uint16_t rx_data_length;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    // The completion event for esp_ble_gap_set_pkt_data_len doesn't say which peer it was for,
+    // but they come back in the order they were asked for. 0 when there's nothing outstanding.
+    uint32_t data_length_request;
+
+    // Whether we've asked for the active connection parameters, and when serial or OTA data last went over it.
+    bool traffic_active;
+    int64_t last_traffic_time;
+};
+
+static std::array<BleConnection, BLE_MAX_CONNECTIONS> connections = {};
+static size_t connection_count = 0;
+static std::mutex connections_mutex;
+static esp_gatt_if_t server_gatts_if = ESP_GATT_IF_NONE;
+static esp_timer_handle_t client_idle_timer = nullptr;
+
+// Callers must hold connections_mutex.
+static BleConnection *findConnection(uint16_t conn_id) {
+    for (auto &connection : connections) {
+        if (connection.in_use && connection.conn_id == conn_id) {
+            return &connection;
+        }
+    }
+
+    return nullptr;
 }
 
-static void gracefulSleep() {
-    xTaskCreatePinnedToCore([](void *) {
-        vTaskDelay((1 * 1000) / portTICK_PERIOD_MS);
+// Callers must hold connections_mutex.
+static BleConnection *findConnection(const uint8_t *address) {
+    for (auto &connection : connections) {
+        if (connection.in_use && std::equal(connection.address.begin(), connection.address.end(), address)) {
+            return &connection;
+        }
+    }
 
-        gracefulCleanup();
+    return nullptr;
+}
 
-        Log::print("cleanup complete, sleeping\n");
-        esp_deep_sleep_start();
-    }, "sleep", CONFIG_ESP_MAIN_TASK_STACK_SIZE, nullptr, 1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+static uint16_t getConnectionMtu(uint16_t conn_id) {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    BleConnection *connection = findConnection(conn_id);
+    return connection ? connection->mtu : ESP_GATT_DEF_BLE_MTU_SIZE;
 }
 
-static void gracefulRestart() {
-    xTaskCreatePinnedToCore([](void *) {
-        vTaskDelay((1 * 1000) / portTICK_PERIOD_MS);
+// The smallest MTU of any connected client, for anything that needs to fit in every peer's notifications.
+static uint16_t getMinimumMtu() {
+    std::lock_guard<std::mutex> lock(connections_mutex);
 
-        gracefulCleanup();
+    uint16_t mtu = ESP_GATT_MAX_MTU_SIZE;
+    bool any = false;
+    for (const auto &connection : connections) {
+        if (connection.in_use) {
+            mtu = std::min(mtu, connection.mtu);
+            any = true;
+        }
+    }
 
-        Log::print("cleanup complete, restarting\n");
-        esp_restart();
-    }, "restart", CONFIG_ESP_MAIN_TASK_STACK_SIZE, nullptr, 1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+    return any ? mtu : ESP_GATT_DEF_BLE_MTU_SIZE;
 }
 
-static std::optional<std::array<uint8_t, 6>> connected_client = std::nullopt;
-static uint16_t current_mtu = 0;
-static time_t last_activity_time = 0;
+static void noteTrafficActivity(uint16_t conn_id);
+
+// Sends the characteristic's current value to each client that has enabled its notifications,
+// cut short to fit their MTU. This replaces BLECharacteristic::notify, which goes by the shared
+// BLE2902 and so would notify every peer as soon as one of them subscribed. Serial data counts
+// as traffic on each connection it's sent to.
+static void notifySubscribers(BLECharacteristic *characteristic, bool traffic = false) {
+    BLEDescriptor *descriptor = characteristic->getDescriptorByUUID(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_CLIENT_CONFIG));
+    auto it = std::find(client_config_descriptors.begin(), client_config_descriptors.end(), descriptor);
+    if (it == client_config_descriptors.end()) {
+        return;
+    }
+
+    uint32_t subscription = 1u << (it - client_config_descriptors.begin());
 
-static std::vector<BLE2902 *> client_config_descriptors;
+    // Copied out so the mutex isn't held while the stack queues the notifications.
+    std::array<std::pair<uint16_t, uint16_t>, BLE_MAX_CONNECTIONS> targets;
+    size_t target_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        for (const auto &connection : connections) {
+            if (connection.in_use && (connection.subscriptions & subscription) != 0) {
+                targets[target_count++] = { connection.conn_id, connection.mtu };
+            }
+        }
+    }
+
+    uint8_t *data = characteristic->getData();
+    size_t length = characteristic->getLength();
+    for (size_t i = 0; i < target_count; ++i) {
+        auto [conn_id, mtu] = targets[i];
+        size_t send_length = std::min<size_t>(length, mtu - 3);
+
+        esp_err_t err = esp_ble_gatts_send_indicate(server_gatts_if, conn_id, characteristic->getHandle(), send_length, data, false);
+        if (err != ESP_OK) {
+            Log::warning<LogCategory::Ble>("esp_ble_gatts_send_indicate failed: %s\n", esp_err_to_name(err));
+        }
+
+        if (traffic) {
+            noteTrafficActivity(conn_id);
+        }
+    }
+}
+
+// Writes to a BLE2902 still land in the shared descriptor, we just keep our own copy per client.
+static void updateSubscriptions(uint16_t conn_id, uint16_t handle, const uint8_t *value, size_t length) {
+    if (length != 2) {
+        return;
+    }
+
+    for (size_t i = 0; i < client_config_descriptors.size(); ++i) {
+        if (client_config_descriptors[i]->getHandle() != handle) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        BleConnection *connection = findConnection(conn_id);
+        if (!connection) {
+            return;
+        }
+
+        if ((value[0] & 0x01) != 0) {
+            connection->subscriptions |= (1u << i);
+        } else {
+            connection->subscriptions &= ~(1u << i);
+        }
+
+        return;
+    }
+}
+
+static void noteConnectionActivity(uint16_t conn_id) {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    BleConnection *connection = findConnection(conn_id);
+    if (connection) {
+        connection->last_activity_time = esp_timer_get_time();
+    }
+}
+
+static void onClientIdleTimer(void *) {
+    // Activity doesn't touch the timer, so check how long each client has actually been quiet.
+    int64_t now = esp_timer_get_time();
+    int64_t timeout = Config::getConnectedIdleTimeout() * 1000000ll;
+    int64_t next = timeout;
+
+    std::array<std::array<uint8_t, 6>, BLE_MAX_CONNECTIONS> idle_clients;
+    size_t idle_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        if (connection_count == 0) {
+            return;
+        }
+
+        for (auto &connection : connections) {
+            if (!connection.in_use) {
+                continue;
+            }
+
+            int64_t idle_time = now - connection.last_activity_time;
+            if (idle_time < timeout) {
+                next = std::min(next, timeout - idle_time);
+                continue;
+            }
+
+            idle_clients[idle_count++] = connection.address;
+
+            // The disconnect removes the entry, this only matters if it never comes.
+            connection.last_activity_time = now;
+        }
+    }
+
+    // TODO: Tune this. Currently set so our battery monitor keeps
+    //       the connection alive if notifications are enabled.
+    for (size_t i = 0; i < idle_count; ++i) {
+        Log::info<LogCategory::Ble>("disconnecting client due to idle timeout\n");
+        esp_ble_gap_disconnect(idle_clients[i].data());
+    }
+
+    esp_timer_start_once(client_idle_timer, next);
+}
+
+// Looks at every client's idle time again, after a connect or the timeout being changed.
+static void armClientIdleTimer() {
+    esp_timer_stop(client_idle_timer);
+    esp_timer_start_once(client_idle_timer, 0);
+}
+
+// SPP -> BLE serial path, filled by the BT stack and drained by serial_notify_task.
+// The benchmark and the mock responses inject into it as well, hence the mutex on the producer side.
+static LineFramer<1024> serial_rx_framer;
+static std::mutex serial_rx_mutex;
+static TaskHandle_t serial_notify_task = nullptr;
+
+// Loopback benchmark, see X1_GATT_UUID_BENCHMARK.
+enum class BenchmarkMode : uint8_t {
+    Off = 0,
+    Echo = 1,
+    Synthesize = 2,
+};
+
+struct BenchmarkState {
+    std::atomic<BenchmarkMode> mode;
+    // The client that started it, whose connection interval goes in the result.
+    uint16_t conn_id;
+    uint16_t frame_size;
+    uint16_t rate;
+    uint32_t frame_count;
+    TickType_t started;
+    TickType_t finished;
+    std::atomic<uint32_t> notifications;
+    std::atomic<uint32_t> bytes;
+};
+
+static BenchmarkState benchmark = {};
+static TaskHandle_t benchmark_task = nullptr;
+static BLECharacteristic *benchmark_characteristic = nullptr;
+static constexpr size_t BENCHMARK_MAX_FRAME_SIZE = 512;
+
+// Link layer payload sizes (Data Length Extension) and PHYs (1 = 1M, 2 = 2M), see X1_GATT_UUID_LINK_INFO.
+// The ESP32 is a Bluetooth 4.2 controller, so the PHY only changes on chips with the BLE 5.0 features.
+static constexpr uint16_t DEFAULT_LINK_DATA_LENGTH = 27;
+static constexpr uint16_t MAX_LINK_DATA_LENGTH = 251;
+static uint32_t next_data_length_request = 1;
+
+// We ask for a short connection interval while serial or OTA data is flowing over a connection,
+// and a long one with some slave latency once it's been quiet for BLE_CONNECTION_IDLE_DELAY.
+// Intervals are in 1.25ms units, the supervision timeout in 10ms units.
+static constexpr esp_ble_conn_update_params_t ACTIVE_CONNECTION_PARAMS = { {}, 6, 12, 0, 400 };
+static constexpr esp_ble_conn_update_params_t IDLE_CONNECTION_PARAMS = { {}, 40, 80, 4, 600 };
+// One timer for every connection, it's running whenever any of them is active. Guarded by connections_mutex.
+static esp_timer_handle_t connection_idle_timer = nullptr;
+static bool connection_idle_timer_armed = false;
+
+static void requestConnectionParams(const std::array<uint8_t, 6> &address, bool active) {
+    Log::debug<LogCategory::Ble>("requesting %s connection parameters\n", active ? "active" : "idle");
+
+    esp_ble_conn_update_params_t params = active ? ACTIVE_CONNECTION_PARAMS : IDLE_CONNECTION_PARAMS;
+    std::copy(address.begin(), address.end(), params.bda);
+
+    esp_err_t err = esp_ble_gap_update_conn_params(&params);
+    if (err != ESP_OK) {
+        Log::warning<LogCategory::Ble>("esp_ble_gap_update_conn_params failed: %s\n", esp_err_to_name(err));
+    }
+}
+
+// Called for serial and OTA traffic on a connection, cheap enough to call on every packet.
+static void noteTrafficActivity(uint16_t conn_id) {
+    std::array<uint8_t, 6> address;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        BleConnection *connection = findConnection(conn_id);
+        if (!connection) {
+            return;
+        }
+
+        connection->last_traffic_time = esp_timer_get_time();
+        if (connection->traffic_active) {
+            return;
+        }
+
+        connection->traffic_active = true;
+        address = connection->address;
+
+        // Any connection that's already active goes idle before this one can, so a running
+        // timer will get to this one in time.
+        if (!connection_idle_timer_armed) {
+            connection_idle_timer_armed = true;
+            esp_timer_start_once(connection_idle_timer, BLE_CONNECTION_IDLE_DELAY * 1000000ull);
+        }
+    }
+
+    requestConnectionParams(address, true);
+}
+
+static void onConnectionIdleTimer(void *) {
+    // Rather than restarting the timer on every packet, check how long each connection has actually been quiet.
+    int64_t now = esp_timer_get_time();
+    int64_t idle_delay = BLE_CONNECTION_IDLE_DELAY * 1000000ll;
+
+    std::array<std::array<uint8_t, 6>, BLE_MAX_CONNECTIONS> idle_clients;
+    size_t idle_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+
+        int64_t next = 0;
+        for (auto &connection : connections) {
+            if (!connection.in_use || !connection.traffic_active) {
+                continue;
+            }
+
+            int64_t idle_time = now - connection.last_traffic_time;
+            if (idle_time < idle_delay) {
+                next = (next == 0) ? (idle_delay - idle_time) : std::min(next, idle_delay - idle_time);
+                continue;
+            }
+
+            connection.traffic_active = false;
+            idle_clients[idle_count++] = connection.address;
+        }
+
+        connection_idle_timer_armed = next > 0;
+        if (connection_idle_timer_armed) {
+            esp_timer_start_once(connection_idle_timer, next);
+        }
+    }
+
+    for (size_t i = 0; i < idle_count; ++i) {
+        requestConnectionParams(idle_clients[i], false);
+    }
+}
+
+// Queues data as if it had arrived from the SPP link, returns how much fitted.
+static size_t receiveSerialData(const uint8_t *data, size_t length) {
+    size_t written;
+    {
+        std::lock_guard<std::mutex> lock(serial_rx_mutex);
+        written = serial_rx_framer.push(data, length);
+    }
+
+    xTaskNotifyGive(serial_notify_task);
+
+    return written;
+}
+
+// Opt-in serial behaviours set by the client, see X1_GATT_UUID_SERIAL_MODE.
+static constexpr uint8_t SERIAL_MODE_BATCH_NOTIFY = 0x01;
+static constexpr uint8_t SERIAL_MODE_COALESCE_WRITES = 0x02;
+static constexpr uint8_t SERIAL_MODE_ENVELOPE = 0x04;
+// Written from the GATT callbacks and read by the serial notify task, which takes one copy of
+// each per pass so a change can't land part way through a batch.
+static std::atomic<uint8_t> serial_mode = 0;
+static std::atomic<uint8_t> serial_batch_deadline = DEFAULT_SERIAL_BATCH_DEADLINE;
+
+// Envelope mode, see envelope.h. The sequence is only touched by the serial notify task once
+// the mode is on, the rest is set from the GATT and BT stack callbacks. The last write's
+// sequence is checked and updated together, so it has a mutex rather than being atomic.
+static std::atomic<uint16_t> envelope_sequence = 0;
+static std::atomic<uint16_t> envelope_ack = 0;
+static std::optional<uint16_t> last_write_sequence = std::nullopt;
+static std::mutex last_write_sequence_mutex;
+static std::atomic<bool> serial_rx_dropped = false;
+static std::atomic<bool> serial_tx_dropped = false;
+
+static void resetEnvelopeState() {
+    envelope_sequence = 0;
+    envelope_ack = 0;
+    {
+        std::lock_guard<std::mutex> lock(last_write_sequence_mutex);
+        last_write_sequence = std::nullopt;
+    }
+    serial_rx_dropped = false;
+    serial_tx_dropped = false;
+}
+
+// Writing 0x01 to X1_GATT_UUID_BT_SCAN starts a scan with one device per notification, 0x02 packs
+// as many records as fit, each u8 address[6] + i8 rssi + u8 name length + name.
+static constexpr uint8_t SCAN_MODE_BATCHED = 0x02;
+static constexpr size_t SCAN_RECORD_HEADER_SIZE = 6 + 1 + 1;
 
 // Battery Service
 static BLECharacteristic *battery_level = nullptr;
 
 // Bridge Service
 static BLECharacteristic *battery_voltage = nullptr;
+static BLECharacteristic *bluetooth_connect = nullptr;
 
-// TODO: There is a fair amount of complexity around supporting multiple connections.
-//       We don't currently need that, but it does need validating that we're being sane.
-//
-//       Current expectation:
-//           BLEServer stops advertising when a client connects. If we wanted multiple
-//           we'd need to re-start advertising onConnect. We currently re-start in
-//           onDisconnect instead - need to ensure no one can sneak by that and connect
-//           anyway.
+static void connectToSavedDevice();
+
+// Up to BLE_MAX_CONNECTIONS clients can be connected at once. BLEServer stops advertising when
+// a client connects, so we start it again while there's room for another, and once there's room
+// again after a disconnect.
 //
-//       Known pain points:
-//           BLE2902's state needs to be per-connection - or the enabled state for
-//           notifications will be shared by all peers. notify() checks its presence
-//           and value before looping the clients, so we'd need to modify BLECharacteristic
-//           to implement it properly.
+// Notification state, the MTU, the link info, the connection parameters, and the idle timeout
+// are per connection. The serial mode and the benchmark are still shared, and go back to their
+// defaults when the last client disconnects.
 static class MyBleServerCallbacks: public BLEServerCallbacks {
     virtual void onConnect(BLEServer *server, esp_ble_gatts_cb_param_t *param) override {
-        Log::print("ble client connected\n");
+        size_t count = 0;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            auto it = std::find_if(connections.begin(), connections.end(), [](const BleConnection &connection) {
+                return !connection.in_use;
+            });
+
+            if (it != connections.end()) {
+                it->in_use = true;
+                it->conn_id = param->connect.conn_id;
+                std::copy(param->connect.remote_bda, param->connect.remote_bda + 6, it->address.begin());
+                it->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+                it->subscriptions = 0;
+                it->last_activity_time = esp_timer_get_time();
+                it->connection_interval = param->connect.conn_params.interval;
+                it->tx_data_length = DEFAULT_LINK_DATA_LENGTH;
+                it->rx_data_length = DEFAULT_LINK_DATA_LENGTH;
+                it->tx_phy = 1;
+                it->rx_phy = 1;
+                it->data_length_request = next_data_length_request++;
+                it->traffic_active = false;
+                it->last_traffic_time = 0;
+                count = ++connection_count;
+            }
+        }
+
+        // We stop advertising at the limit, but one could still sneak in before that takes effect.
+        if (count == 0) {
+            Log::warning<LogCategory::Ble>("ble client connected with no free connections, disconnecting\n");
+            esp_ble_gap_disconnect(param->connect.remote_bda);
+            return;
+        }
+
+        Log::info<LogCategory::Ble>("ble client connected (%d/%d)\n", count, BLE_MAX_CONNECTIONS);
+
+        Log::setOutputLimit(getMinimumMtu() - 3);
 
-        assert(!connected_client.has_value());
+        Power::setClientConnected(true);
+        Led::setBleConnected(true);
+        armClientIdleTimer();
 
-        std::array<uint8_t, 6> address;
-        std::copy(param->connect.remote_bda, param->connect.remote_bda + 6, address.begin());
-        connected_client = std::make_optional(address);
+        // Discovery and provisioning happen straight after connecting, so start off fast.
+        noteTrafficActivity(param->connect.conn_id);
+
+        // Ask for the largest link layer packets so a full MTU write doesn't get fragmented.
+        esp_err_t err = esp_ble_gap_set_pkt_data_len(param->connect.remote_bda, MAX_LINK_DATA_LENGTH);
+        if (err != ESP_OK) {
+            Log::warning<LogCategory::Ble>("esp_ble_gap_set_pkt_data_len failed: %s\n", esp_err_to_name(err));
+        }
 
-        current_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+        err = esp_ble_gap_set_prefered_phy(param->connect.remote_bda, 0,
+            ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+        if (err != ESP_OK) {
+            Log::warning<LogCategory::Ble>("esp_ble_gap_set_prefered_phy failed: %s\n", esp_err_to_name(err));
+        }
+#endif
 
-        last_activity_time = time(nullptr);
-        Log::printf("client connect time: %d\n", last_activity_time);
+        if (count < BLE_MAX_CONNECTIONS) {
+            server->getAdvertising()->start();
+        }
     }
 
-    void onDisconnect(BLEServer *server) override {
-        connected_client = std::nullopt;
+    void onDisconnect(BLEServer *server, esp_ble_gatts_cb_param_t *param) override {
+        size_t count;
+        bool was_full;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            BleConnection *connection = findConnection(param->disconnect.conn_id);
+            if (!connection) {
+                // One we turned away in onConnect.
+                return;
+            }
 
-        // Reset the notifications / indications preference.
+            was_full = connection_count == BLE_MAX_CONNECTIONS;
+            connection->in_use = false;
+            count = --connection_count;
+        }
+
+        Log::info<LogCategory::Ble>("ble client disconnected (%d/%d)\n", count, BLE_MAX_CONNECTIONS);
+
+        if (count > 0) {
+            Log::setOutputLimit(getMinimumMtu() - 3);
+
+            if (was_full) {
+                server->getAdvertising()->start();
+            }
+
+            return;
+        }
+
+        // Serial modes are opted in to per connection, so the next client gets the defaults.
+        serial_mode = 0;
+        serial_batch_deadline = DEFAULT_SERIAL_BATCH_DEADLINE;
+        Bluetooth::setWriteCoalescing(false);
+        resetEnvelopeState();
+
+        benchmark.mode = BenchmarkMode::Off;
+
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            esp_timer_stop(connection_idle_timer);
+            connection_idle_timer_armed = false;
+        }
+
+        esp_timer_stop(client_idle_timer);
+
+        // Reset the notifications / indications preference, so reads of it start from nothing.
         for (auto client_config : client_config_descriptors) {
             client_config->setNotifications(false);
             client_config->setIndications(false);
         }
 
-        Log::print("ble client disconnected\n");
-
-        last_activity_time = time(nullptr);
-        Log::printf("client disconnect time: %d\n", last_activity_time);
+        Power::setClientConnected(false);
+        Led::setBleConnected(false);
 
         // We have to restart advertising each time a client disconnects.
         server->getAdvertising()->start();
@@ -106,7 +541,17 @@ static class MyBleServerCallbacks: public BLEServerCallbacks {
 } ble_server_callbacks;
 
 void Ble::init(const std::string &name, uint32_t pin_code) {
-    last_activity_time = time(nullptr);
+    esp_timer_create_args_t idle_timer_args = {};
+    idle_timer_args.callback = onConnectionIdleTimer;
+    idle_timer_args.dispatch_method = ESP_TIMER_TASK;
+    idle_timer_args.name = "bleConnIdle";
+    esp_timer_create(&idle_timer_args, &connection_idle_timer);
+
+    esp_timer_create_args_t client_idle_timer_args = {};
+    client_idle_timer_args.callback = onClientIdleTimer;
+    client_idle_timer_args.dispatch_method = ESP_TIMER_TASK;
+    client_idle_timer_args.name = "bleClientIdle";
+    esp_timer_create(&client_idle_timer_args, &client_idle_timer);
 
     BLEDevice::init(name);
     // BLEDevice::setPower(ESP_PWR_LVL_P9);
@@ -115,19 +560,74 @@ void Ble::init(const std::string &name, uint32_t pin_code) {
     // We use this as setSecurityCallbacks appears to opt in to a bunch of behaviour we don't want.
     // TODO: It's possible all the extra bits are events that are never called with our config though.
     BLEDevice::setCustomGapHandler([](esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+        if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT) {
+            uint16_t interval = param->update_conn_params.conn_int;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                BleConnection *connection = findConnection(param->update_conn_params.bda);
+                if (connection) {
+                    connection->connection_interval = interval;
+                }
+            }
+
+            Log::debug<LogCategory::Ble>("ble connection interval now %d.%02dms\n", (interval * 125) / 100, (interval * 125) % 100);
+            return;
+        }
+
+        if (event == ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT) {
+            auto ev_param = param->pkt_data_lenth_cmpl;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                BleConnection *oldest = nullptr;
+                for (auto &connection : connections) {
+                    if (connection.in_use && connection.data_length_request != 0 && (!oldest || connection.data_length_request < oldest->data_length_request)) {
+                        oldest = &connection;
+                    }
+                }
+
+                if (oldest) {
+                    oldest->data_length_request = 0;
+                    if (ev_param.status == ESP_BT_STATUS_SUCCESS) {
+                        oldest->tx_data_length = ev_param.params.tx_len;
+                        oldest->rx_data_length = ev_param.params.rx_len;
+                    }
+                }
+            }
+
+            Log::info<LogCategory::Ble>("ble data length tx %d rx %d (status %d)\n", ev_param.params.tx_len, ev_param.params.rx_len, ev_param.status);
+            return;
+        }
+
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+        if (event == ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT) {
+            auto ev_param = param->phy_update;
+            if (ev_param.status == ESP_BT_STATUS_SUCCESS) {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                BleConnection *connection = findConnection(ev_param.bda);
+                if (connection) {
+                    connection->tx_phy = ev_param.tx_phy;
+                    connection->rx_phy = ev_param.rx_phy;
+                }
+            }
+
+            Log::info<LogCategory::Ble>("ble phy tx %dM rx %dM (status %d)\n", ev_param.tx_phy, ev_param.rx_phy, ev_param.status);
+            return;
+        }
+#endif
+
         if (event != ESP_GAP_BLE_AUTH_CMPL_EVT) {
             return;
         }
 
         auto ev_param = param->ble_security.auth_cmpl;
         if (ev_param.success) {
-            Log::print("ble connection authorized\n");
+            Log::info<LogCategory::Ble>("ble connection authorized\n");
             return;
         }
 
         // 81 bad pin
         // 85 cancel
-        Log::printf("ble connection auth failed, reason: %d\n", ev_param.fail_reason);
+        Log::warning<LogCategory::Ble>("ble connection auth failed, reason: %d\n", ev_param.fail_reason);
 
         // TODO: Can / should we kick off the peer?
         //       Apparently we can, lets try this.
@@ -135,62 +635,51 @@ void Ble::init(const std::string &name, uint32_t pin_code) {
     });
 
     BLEDevice::setCustomGattsHandler([](esp_gatts_cb_event_t event, esp_gatt_if_t gatt_if, esp_ble_gatts_cb_param_t *param) {
-        // We can crash if we try to notify from inside here, we also don't want the log updating the activity time.
-        auto suspender = Log::suspendOutputCallback();
-
-        // Log::printf("gatt event: %d, %d\n", event, gatt_if);
+        // Log::debug<LogCategory::Ble>("gatt event: %d, %d\n", event, gatt_if);
 
         // The BLEDevice library doesn't handle this, and it keeps catching us out.
         if (event == ESP_GATTS_ADD_CHAR_EVT && param->add_char.status != ESP_GATT_OK) {
-            Log::printf("!!! ESP_GATTS_ADD_CHAR_EVT failed (%02x), check handle count !!!\n", param->add_char.status);
+            Log::error<LogCategory::Ble>("!!! ESP_GATTS_ADD_CHAR_EVT failed (%02x), check handle count !!!\n", param->add_char.status);
         } else if (event == ESP_GATTS_ADD_CHAR_DESCR_EVT && param->add_char_descr.status != ESP_GATT_OK) {
-            Log::printf("!!! ESP_GATTS_ADD_CHAR_DESCR_EVT failed (%02x), check handle count !!!\n", param->add_char_descr.status);
+            Log::error<LogCategory::Ble>("!!! ESP_GATTS_ADD_CHAR_DESCR_EVT failed (%02x), check handle count !!!\n", param->add_char_descr.status);
+        }
+
+        if (event == ESP_GATTS_CONNECT_EVT) {
+            server_gatts_if = gatt_if;
         }
 
         if (event == ESP_GATTS_MTU_EVT) {
-            Log::printf("ble client mtu updated from %d to %d\n", current_mtu, param->mtu.mtu);
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                BleConnection *connection = findConnection(param->mtu.conn_id);
+                if (connection) {
+                    Log::info<LogCategory::Ble>("ble client mtu updated from %d to %d\n", connection->mtu, param->mtu.mtu);
+                    connection->mtu = param->mtu.mtu;
+                }
+            }
 
-            current_mtu = param->mtu.mtu;
+            Log::setOutputLimit(getMinimumMtu() - 3);
+        }
+
+        if (event == ESP_GATTS_WRITE_EVT && !param->write.is_prep) {
+            updateSubscriptions(param->write.conn_id, param->write.handle, param->write.value, param->write.len);
         }
 
         // ESP_GATTS_CONF_EVT is fired when our notifications are confirmed.
         if (event == ESP_GATTS_READ_EVT || event == ESP_GATTS_WRITE_EVT || event == ESP_GATTS_EXEC_WRITE_EVT || event == ESP_GATTS_CONF_EVT) {
-            last_activity_time = time(nullptr);
-
-            // Log::printf("updated client last activity time: %d (reason: %d)\n", last_activity_time, event);
+            Power::noteActivity();
         }
-    });
-
-    xTaskCreatePinnedToCore([](void *parameters) {
-        for (;;) {
-            time_t now = time(nullptr);
-            time_t idle_time = now - last_activity_time;
-
-            {
-                // We don't want the log updating the activity time.
-                // auto suspender = Log::suspendOutputCallback();
-                // Log::printf("client idle time: %d\n", idle_time);
-            }
-
-            if (connected_client) {
-                // TODO: Tune this. Currently set so our battery monitor keeps
-                //       the connection alive if notifications are enabled.
-                if (idle_time >= Config::getConnectedIdleTimeout()) {
-                    Log::print("disconnecting client due to idle timeout\n");
-                    esp_ble_gap_disconnect(connected_client->data());
-                    last_activity_time = now;
-                }
-            } else {
-                if (idle_time >= Config::getDisconnectedIdleTimeout()) {
-                    Log::print("going to sleep due to idle timeout\n");
-                    gracefulCleanup();
-                    esp_deep_sleep_start();
-                }
-            }
 
-            vTaskDelay((30 * 1000) / portTICK_PERIOD_MS);
+        if (event == ESP_GATTS_READ_EVT) {
+            noteConnectionActivity(param->read.conn_id);
+        } else if (event == ESP_GATTS_WRITE_EVT) {
+            noteConnectionActivity(param->write.conn_id);
+        } else if (event == ESP_GATTS_EXEC_WRITE_EVT) {
+            noteConnectionActivity(param->exec_write.conn_id);
+        } else if (event == ESP_GATTS_CONF_EVT) {
+            noteConnectionActivity(param->conf.conn_id);
         }
-    }, "bleTimeout", CONFIG_ARDUINO_LOOP_STACK_SIZE, nullptr, 1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+    });
 
     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_STATIC_PASSKEY, &pin_code, sizeof(pin_code));
 
@@ -210,12 +699,12 @@ void Ble::init(const std::string &name, uint32_t pin_code) {
     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(init_key));
 
     int bonded_count = esp_ble_get_bond_device_num();
-    Log::printf("have %d bonded ble devices\n", bonded_count);
+    Log::info<LogCategory::Ble>("have %d bonded ble devices\n", bonded_count);
 
     std::vector<esp_ble_bond_dev_t> bonded_devices(bonded_count);
     esp_ble_get_bond_device_list(&bonded_count, bonded_devices.data());
     for (const auto &device : bonded_devices) {
-        Log::printf("  %02X:%02X:%02X:%02X:%02X:%02X\n",
+        Log::info<LogCategory::Ble>("  %02X:%02X:%02X:%02X:%02X:%02X\n",
             device.bd_addr[0], device.bd_addr[1], device.bd_addr[2],
             device.bd_addr[3], device.bd_addr[4], device.bd_addr[5]);
     }
@@ -235,8 +724,18 @@ void Ble::deinit() {
     BLEDevice::deinit();
 }
 
+void Ble::startAutoConnect() {
+    if (!Config::getAutoConnect() || !Config::getBtAddress() || !bluetooth_connect) {
+        return;
+    }
+
+    Log::info<LogCategory::Bluetooth>("auto connecting to saved device\n");
+    connectToSavedDevice();
+}
+
 bool Ble::isClientConnected() {
-    return connected_client.has_value();
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    return connection_count > 0;
 }
 
 void Ble::updateBatteryLevel(uint8_t level, uint32_t millivolts) {
@@ -244,9 +743,12 @@ void Ble::updateBatteryLevel(uint8_t level, uint32_t millivolts) {
         battery_voltage->setValue(millivolts);
     }
 
-    if (battery_level) {
+    // The voltage is read only, but the level is notified, so only send it when it changes.
+    static std::optional<uint8_t> last_level = std::nullopt;
+    if (battery_level && last_level != level) {
         battery_level->setValue(&level, sizeof(uint8_t));
-        battery_level->notify();
+        notifySubscribers(battery_level);
+        last_level = level;
     }
 }
 
@@ -270,22 +772,29 @@ void Ble::initBridgeService(BLEServer *server) {
     // Enough handles need to be allocated for the characteristics and their descriptions.
     // If there aren't enough, things will start disappearing when querying the service.
     // Need approximately (2 * number of characteristics) + number of descriptors.
-    BLEService *service = server->createService(BLEUUID(X1_GATT_UUID_BRIDGE_SVC), 60);
+    BLEService *service = server->createService(BLEUUID(X1_GATT_UUID_BRIDGE_SVC), 84);
 
     createSerialDataCharacteristic(service);
+    createSerialModeCharacteristic(service);
+    createSerialFlowCharacteristic(service);
     createBluetoothScanCharacteristic(service);
-    createBluetoothConnectCharacteristic(service);
+    bluetooth_connect = createBluetoothConnectCharacteristic(service);
     createConfigNameCharacteristic(service);
     createConfigPinCodeCharacteristic(service);
     createConfigBluetoothAddressCharacteristic(service);
     createConfigConnectedIdleTimeoutCharacteristic(service);
     createConfigDisconnectedIdleTimeoutCharacteristic(service);
+    createConfigBlobCharacteristic(service);
     battery_voltage = createBatteryVoltageCharacteristic(service);
     createDebugLogCharacteristic(service);
     createRestartCharacteristic(service);
     createSleepCharacteristic(service);
     createOtaUpdateCharacteristic(service);
     createMtuInfoCharacteristic(service);
+    createLinkInfoCharacteristic(service);
+    createStatsCharacteristic(service);
+    createBenchmarkCharacteristic(service);
+    createDiagnosticsCharacteristic(service);
 
     service->start();
 }
@@ -293,55 +802,85 @@ void Ble::initBridgeService(BLEServer *server) {
 BLECharacteristic *Ble::createSerialDataCharacteristic(BLEService *service) {
     class Callbacks: public BLECharacteristicCallbacks {
         void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            Trace::mark(TraceHop::BleWrite);
+            noteTrafficActivity(param->write.conn_id);
+
             uint8_t *data = characteristic->getData();
             size_t length = characteristic->getLength();
 
-            Log::print("ble serial data written:");
-            for (size_t i = 0; i < length; ++i) {
-                Log::printf(" %02X", data[i]);
+            Log::hexdump<LogLevel::Debug, LogCategory::Serial>(data, length, "ble serial data written:");
+
+            // Writes are acked in the next envelope we notify once they've been accepted.
+            std::optional<uint16_t> sequence = std::nullopt;
+            if ((serial_mode & SERIAL_MODE_ENVELOPE) != 0) {
+                auto header = EnvelopeHeader::decode(data, length);
+                if (!header) {
+                    Log::warning<LogCategory::Serial>("malformed %d byte envelope, dropped\n", length);
+                    serial_tx_dropped = true;
+                    return;
+                }
+
+                std::optional<uint16_t> previous_sequence;
+                {
+                    std::lock_guard<std::mutex> lock(last_write_sequence_mutex);
+                    previous_sequence = std::exchange(last_write_sequence, header->sequence);
+                }
+
+                if (previous_sequence && header->sequence != (uint16_t)(*previous_sequence + 1)) {
+                    Log::warning<LogCategory::Serial>("envelope sequence jumped from %d to %d\n", *previous_sequence, header->sequence);
+                    serial_tx_dropped = true;
+                }
+
+                sequence = header->sequence;
+
+                data += EnvelopeHeader::SIZE;
+                length = header->length;
+            }
+
+            if (benchmark.mode == BenchmarkMode::Echo) {
+                if (sequence) {
+                    envelope_ack = *sequence;
+                }
+
+                receiveSerialData(data, length);
+                return;
             }
-            Log::print("\n");
 
             if (Bluetooth::isConnected()) {
                 // TODO: Should we validate anything about the data before passing it on? Probably a good idea.
-                Bluetooth::write(std::vector(data, data + length));
+                if (!Bluetooth::write(data, length)) {
+                    Log::warning<LogCategory::Serial>("serial tx queue full, dropped %d byte write\n", length);
+                    serial_tx_dropped = true;
+                } else if (sequence) {
+                    envelope_ack = *sequence;
+                }
 
                 return;
             }
 
-            // Mock tests.
+            if (sequence) {
+                envelope_ack = *sequence;
+            }
 
-            Log::print("device not connected, handling mock commands\n");
+            // Mock tests, the responses are fed through the receive path the same as real ones.
+
+            Log::info<LogCategory::Serial>("device not connected, handling mock commands\n");
 
             if (length == 3 && data[0] == 'G' && data[1] == 's' && data[2] == '\n') {
-                characteristic->setValue("WARNING: test response\n");
-                characteristic->notify();
+                static const char warning[] = "WARNING: test response\n";
+                receiveSerialData(reinterpret_cast<const uint8_t *>(warning), sizeof(warning) - 1);
 
                 uint8_t response[] = { 's', 20, '\n' };
-
-                Log::printf("got %d byte response:", sizeof(response));
-                Log::printf(" %02X", response[0]);
-                Log::printf(" %02X", response[1]);
-                Log::printf(" %02X", response[2]);
-                Log::print("\n");
-
-                Log::printf("got %d byte command:", sizeof(response));
-                Log::printf(" %02X", response[0]);
-                Log::printf(" %02X", response[1]);
-                Log::printf(" %02X", response[2]);
-                Log::print("\n");
-
-                characteristic->setValue(response, sizeof(response));
-                characteristic->notify();
+                receiveSerialData(response, sizeof(response));
 
                 return;
             }
 
             if (length == 3 && data[0] == 'E' && data[1] == '+' && data[2] == '\n') {
-                characteristic->setValue("WARNING: test response\n");
-                characteristic->notify();
+                static const char warning[] = "WARNING: test response\n";
+                receiveSerialData(reinterpret_cast<const uint8_t *>(warning), sizeof(warning) - 1);
 
-                std::vector<std::array<uint8_t, 3>> responses = {
+                static const uint8_t responses[][3] = {
                     { 'u', 0x00, '\n' },
                     { 'm', 0x0E, '\n' },
                     { 't', 0x00, '\n' },
@@ -358,24 +897,7 @@ BLECharacteristic *Ble::createSerialDataCharacteristic(BLEService *service) {
                     { '4', 0x10, '\n' },
                 };
 
-                Log::printf("got %d byte response:", responses.size() * 3);
-                for (auto &response : responses) {
-                    Log::printf(" %02X", response[0]);
-                    Log::printf(" %02X", response[1]);
-                    Log::printf(" %02X", response[2]);
-                }
-                Log::print("\n");
-
-                for (auto &response : responses) {
-                    Log::printf("got %d byte command:", response.size());
-                    Log::printf(" %02X", response[0]);
-                    Log::printf(" %02X", response[1]);
-                    Log::printf(" %02X", response[2]);
-                    Log::print("\n");
-
-                    characteristic->setValue(response.data(), response.size());
-                    characteristic->notify();
-                }
+                receiveSerialData(responses[0], sizeof(responses));
 
                 return;
             }
@@ -396,33 +918,223 @@ BLECharacteristic *Ble::createSerialDataCharacteristic(BLEService *service) {
     client_config_descriptors.push_back(configuration_descriptor);
     characteristic->addDescriptor(configuration_descriptor);
 
-    Bluetooth::setDataCallback([=](const std::vector<uint8_t> &data) {
-        Log::printf("got %d byte response:", data.size());
-        for (uint8_t byte : data) {
-            Log::printf(" %02X", byte);
+    xTaskCreatePinnedToCore([](void *parameters) {
+        BLECharacteristic *characteristic = static_cast<BLECharacteristic *>(parameters);
+
+        uint8_t batch[ESP_GATT_MAX_MTU_SIZE - 3];
+        size_t batch_length = 0;
+        TickType_t batch_started = 0;
+
+        // Static to keep it off the task's stack.
+        static EnvelopePacker<ESP_GATT_MAX_MTU_SIZE - 3> packer;
+
+        auto notify = [=](const uint8_t *data, size_t length) {
+            characteristic->setValue(const_cast<uint8_t *>(data), length);
+            notifySubscribers(characteristic, true);
+            Trace::mark(TraceHop::Notified);
+
+            if (benchmark.mode != BenchmarkMode::Off) {
+                benchmark.notifications.fetch_add(1, std::memory_order_relaxed);
+                benchmark.bytes.fetch_add(length, std::memory_order_relaxed);
+            }
+        };
+
+        auto flush = [&]() {
+            if (batch_length == 0) {
+                return;
+            }
+
+            notify(batch, batch_length);
+            batch_length = 0;
+        };
+
+        auto flush_envelope = [&]() {
+            if (packer.empty()) {
+                return;
+            }
+
+            uint8_t flags = 0;
+            if (serial_rx_dropped.exchange(false)) {
+                flags |= EnvelopeHeader::FLAG_RX_DROPPED;
+            }
+
+            if (serial_tx_dropped.exchange(false)) {
+                flags |= EnvelopeHeader::FLAG_TX_DROPPED;
+            }
+
+            packer.finish(envelope_sequence.fetch_add(1), envelope_ack.load(), flags, (uint32_t)esp_timer_get_time(), notify);
+        };
+
+        for (;;) {
+            TickType_t batch_deadline = pdMS_TO_TICKS(serial_batch_deadline.load());
+
+            TickType_t wait = portMAX_DELAY;
+            if (batch_length > 0 || !packer.empty()) {
+                TickType_t elapsed = xTaskGetTickCount() - batch_started;
+                wait = (elapsed < batch_deadline) ? (batch_deadline - elapsed) : 0;
+            }
+
+            ulTaskNotifyTake(pdTRUE, wait);
+
+            uint8_t mode = serial_mode.load();
+            bool batching = (mode & SERIAL_MODE_BATCH_NOTIFY) != 0;
+            bool enveloped = (mode & SERIAL_MODE_ENVELOPE) != 0;
+            size_t batch_limit = std::min<size_t>(getMinimumMtu() - 3, sizeof(batch));
+            packer.setLimit(batch_limit);
+
+            serial_rx_framer.drain([&](const uint8_t *frame, size_t length) {
+                Trace::mark(TraceHop::Framed);
+
+                Log::hexdump<LogLevel::Debug, LogCategory::Serial>(frame, length, "got %d byte command:", length);
+
+                if (enveloped) {
+                    // Anything batched before the mode changed goes out first.
+                    flush();
+
+                    size_t offset = 0;
+                    do {
+                        if (packer.empty()) {
+                            batch_started = xTaskGetTickCount();
+                        }
+
+                        offset += packer.append(frame + offset, length - offset);
+                        if (offset < length || packer.full()) {
+                            flush_envelope();
+                        }
+                    } while (offset < length);
+
+                    return;
+                }
+
+                flush_envelope();
+
+                if (!batching || length > batch_limit) {
+                    flush();
+                    notify(frame, length);
+                    return;
+                }
+
+                // We only ever send whole commands, so clients can carry on splitting on newlines.
+                if ((batch_length + length) > batch_limit) {
+                    flush();
+                }
+
+                if (batch_length == 0) {
+                    batch_started = xTaskGetTickCount();
+                }
+
+                std::copy(frame, frame + length, batch + batch_length);
+                batch_length += length;
+
+                if (batch_length == batch_limit) {
+                    flush();
+                }
+            });
+
+            if (!batching || (xTaskGetTickCount() - batch_started) >= batch_deadline) {
+                flush();
+                flush_envelope();
+            }
         }
-        Log::print("\n");
+    }, "serialNotify", 4096, characteristic, 2, &serial_notify_task, CONFIG_ARDUINO_RUNNING_CORE);
 
-        static std::vector<uint8_t> buffer;
+    // SPP data arrives on the BT stack's task, we just copy it into the ring there and
+    // leave framing and notifying to our own task so the BT stack is never held up by BLE.
+    Bluetooth::setDataCallback([](const uint8_t *data, size_t length) {
+        Trace::mark(TraceHop::SppData);
 
-        for (uint8_t byte : data) {
-            buffer.push_back(byte);
+        Log::hexdump<LogLevel::Debug, LogCategory::Serial>(data, length, "got %d byte response:", length);
 
-            if (byte != 0x0A) {
-                continue;
+        size_t written = receiveSerialData(data, length);
+        if (written != length) {
+            Log::warning<LogCategory::Serial>("serial rx buffer full, dropped %d bytes\n", length - written);
+            serial_rx_dropped = true;
+        }
+    });
+
+    return characteristic;
+}
+
+BLECharacteristic *Ble::createSerialModeCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            uint8_t value[] = { serial_mode.load(), serial_batch_deadline.load() };
+            characteristic->setValue(value, sizeof(value));
+        }
+
+        void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            uint8_t *data = characteristic->getData();
+            size_t length = characteristic->getLength();
+
+            if (length < 1) {
+                return;
+            }
+
+            uint8_t mode = data[0];
+            if (length >= 2) {
+                serial_batch_deadline = data[1];
             }
 
-            Log::printf("got %d byte command:", buffer.size());
-            for (uint8_t byte : buffer) {
-                Log::printf(" %02X", byte);
+            // The sequences start over each time envelopes are turned on, before the notify task can see the new mode.
+            if ((mode & SERIAL_MODE_ENVELOPE) != 0 && (serial_mode & SERIAL_MODE_ENVELOPE) == 0) {
+                resetEnvelopeState();
             }
-            Log::print("\n");
 
-            characteristic->setValue(buffer.data(), buffer.size());
-            characteristic->notify();
+            serial_mode = mode;
+
+            Log::info<LogCategory::Serial>("serial mode changed to %02X (batch deadline %dms)\n", mode, serial_batch_deadline.load());
+
+            Bluetooth::setWriteCoalescing((mode & SERIAL_MODE_COALESCE_WRITES) != 0);
 
-            buffer.clear();
+            // Wake the notify task so it picks up the new deadline.
+            xTaskNotifyGive(serial_notify_task);
         }
+    };
+
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_SERIAL_MODE, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
+
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Serial Mode");
+    characteristic->addDescriptor(description_descriptor);
+
+    return characteristic;
+}
+
+BLECharacteristic *Ble::createSerialFlowCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            setFlowValue(characteristic, Bluetooth::isTxPaused(), Bluetooth::getTxSpace());
+        }
+
+    public:
+        static void setFlowValue(BLECharacteristic *characteristic, bool paused, size_t space) {
+            space = std::min<size_t>(space, UINT16_MAX);
+
+            uint8_t value[] = { paused, (uint8_t)(space & 0xFF), (uint8_t)((space >> 8) & 0xFF) };
+            characteristic->setValue(value, sizeof(value));
+        }
+    };
+
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_SERIAL_FLOW, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM);
+
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Serial Flow");
+    characteristic->addDescriptor(description_descriptor);
+
+    BLE2902 *configuration_descriptor = new BLE2902();
+    configuration_descriptor->setAccessPermissions(ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE_ENC_MITM);
+    client_config_descriptors.push_back(configuration_descriptor);
+    characteristic->addDescriptor(configuration_descriptor);
+
+    Bluetooth::setTxFlowCallback([=](bool paused, size_t space) {
+        Callbacks::setFlowValue(characteristic, paused, space);
+        notifySubscribers(characteristic);
     });
 
     return characteristic;
@@ -450,35 +1162,62 @@ BLECharacteristic *Ble::createBluetoothScanCharacteristic(BLEService *service) {
             }
 
             bool cancel_scan = (data[0] == 0);
-            Log::printf("ble client %s bt scan\n", cancel_scan ? "canceled" : "requested");
+            Log::info<LogCategory::Bluetooth>("ble client %s bt scan\n", cancel_scan ? "canceled" : "requested");
 
             if (cancel_scan) {
                 Bluetooth::cancelScan();
                 return;
             }
 
-            is_scanning = Bluetooth::scan([=](const AdvertisedDevice &advertisedDevice) {
-                const auto &name = advertisedDevice.name;
-                const auto &address = advertisedDevice.address;
-                Log::printf("new bt device: %s (%02X:%02X:%02X:%02X:%02X:%02X) %d\n",
-                    name.c_str(),
-                    address[0], address[1], address[2], address[3], address[4], address[5],
-                    advertisedDevice.rssi);
-
-                std::vector<uint8_t> value(address.size() + 1 + name.size());
-                auto after_address = std::copy(address.begin(), address.end(), value.begin());
-                *after_address = advertisedDevice.rssi;
-                std::copy(name.begin(), name.end(), after_address + 1);
-                characteristic->setValue(value.data(), value.size());
-                characteristic->notify();
+            bool batched = (data[0] == SCAN_MODE_BATCHED);
+
+            is_scanning = Bluetooth::scan([=](const std::vector<AdvertisedDevice> &devices) {
+                std::vector<uint8_t> value;
+                size_t limit = getMinimumMtu() - 3;
+
+                for (const auto &device : devices) {
+                    const auto &name = device.name;
+                    const auto &address = device.address;
+                    Log::info<LogCategory::Bluetooth>("bt device: %s (%02X:%02X:%02X:%02X:%02X:%02X) %d\n",
+                        name.c_str(),
+                        address[0], address[1], address[2], address[3], address[4], address[5],
+                        device.rssi);
+
+                    if (!batched) {
+                        value.assign(address.begin(), address.end());
+                        value.push_back(device.rssi);
+                        value.insert(value.end(), name.begin(), name.end());
+                        characteristic->setValue(value.data(), value.size());
+                        notifySubscribers(characteristic);
+                        continue;
+                    }
+
+                    // Names are cut short rather than a record being split across notifications.
+                    size_t name_length = std::min(name.size(), limit - SCAN_RECORD_HEADER_SIZE);
+                    if ((value.size() + SCAN_RECORD_HEADER_SIZE + name_length) > limit) {
+                        characteristic->setValue(value.data(), value.size());
+                        notifySubscribers(characteristic);
+                        value.clear();
+                    }
+
+                    value.insert(value.end(), address.begin(), address.end());
+                    value.push_back(device.rssi);
+                    value.push_back(name_length);
+                    value.insert(value.end(), name.begin(), name.begin() + name_length);
+                }
+
+                if (!value.empty() && batched) {
+                    characteristic->setValue(value.data(), value.size());
+                    notifySubscribers(characteristic);
+                }
             }, [=](bool canceled) {
-                Log::printf("bluetooth discovery %s\n", canceled ? "canceled" : "completed");
+                Log::info<LogCategory::Bluetooth>("bluetooth discovery %s\n", canceled ? "canceled" : "completed");
 
                 is_scanning = false;
 
                 std::array<uint8_t, 7> null_update = {};
                 characteristic->setValue(null_update.data(), null_update.size());
-                characteristic->notify();
+                notifySubscribers(characteristic);
             });
         }
 
@@ -503,6 +1242,41 @@ BLECharacteristic *Ble::createBluetoothScanCharacteristic(BLEService *service) {
     return characteristic;
 }
 
+// Connects to the configured BT address, with progress notified through X1_GATT_UUID_BT_CONNECT.
+static void connectToSavedDevice() {
+    BLECharacteristic *characteristic = bluetooth_connect;
+
+    const auto address_opt = Config::getBtAddress();
+    if (!address_opt) {
+        Log::warning<LogCategory::Bluetooth>("can not connect, address not set\n");
+
+        uint8_t value[] = { 0, 0, 0 };
+        characteristic->setValue(value, sizeof(value));
+        notifySubscribers(characteristic);
+
+        return;
+    }
+
+    const auto &address = *address_opt;
+    Log::info<LogCategory::Bluetooth>("connecting to %02X:%02X:%02X:%02X:%02X:%02X\n",
+        address[0], address[1], address[2], address[3], address[4], address[5]);
+
+    Bluetooth::connect(address, [=](bool connected) {
+        Log::info<LogCategory::Bluetooth>("connection state changed, now %s\n", connected ? "connected" : "disconnected");
+        Led::setSppConnected(connected);
+
+        uint8_t value[] = { connected, 0, 0 };
+        characteristic->setValue(value, sizeof(value));
+        notifySubscribers(characteristic);
+    }, [=](uint8_t attempt, uint8_t count) {
+        Log::info<LogCategory::Bluetooth>("starting connection attempt %d/%d\n", attempt, count);
+
+        uint8_t value[] = { 0, attempt, count };
+        characteristic->setValue(value, sizeof(value));
+        notifySubscribers(characteristic);
+    });
+}
+
 BLECharacteristic *Ble::createBluetoothConnectCharacteristic(BLEService *service) {
     class Callbacks: public BLECharacteristicCallbacks {
         void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
@@ -525,39 +1299,12 @@ BLECharacteristic *Ble::createBluetoothConnectCharacteristic(BLEService *service
             }
 
             if (data[0] == 0) {
-                Log::print("disconnecting from device\n");
+                Log::info<LogCategory::Bluetooth>("disconnecting from device\n");
                 Bluetooth::disconnect();
                 return;
             }
 
-            const auto address_opt = Config::getBtAddress();
-            if (!address_opt) {
-                Log::print("can not connect, address not set\n");
-
-                uint8_t value[] = { 0, 0, 0 };
-                characteristic->setValue(value, sizeof(value));
-                characteristic->notify();
-
-                return;
-            }
-
-            const auto &address = *address_opt;
-            Log::printf("connecting to %02X:%02X:%02X:%02X:%02X:%02X\n",
-                address[0], address[1], address[2], address[3], address[4], address[5]);
-
-            Bluetooth::connect(address, [=](bool connected) {
-                Log::printf("connection state changed, now %s\n", connected ? "connected" : "disconnected");
-
-                uint8_t value[] = { connected, 0, 0 };
-                characteristic->setValue(value, sizeof(value));
-                characteristic->notify();
-            }, [=](uint8_t attempt, uint8_t count) {
-                Log::printf("starting connection attempt %d/%d\n", attempt, count);
-
-                uint8_t value[] = { 0, attempt, count };
-                characteristic->setValue(value, sizeof(value));
-                characteristic->notify();
-            });
+            connectToSavedDevice();
         }
     };
 
@@ -589,7 +1336,7 @@ BLECharacteristic *Ble::createConfigNameCharacteristic(BLEService *service) {
             auto name = characteristic->getValue();
             Config::setName(name);
 
-            Log::printf("changed name to \"%s\"\n", name.c_str());
+            Log::info<LogCategory::Config>("changed name to \"%s\"\n", name.c_str());
         }
     };
 
@@ -621,19 +1368,19 @@ BLECharacteristic *Ble::createConfigPinCodeCharacteristic(BLEService *service) {
             size_t length = characteristic->getLength();
 
             if (length != 4) {
-                Log::printf("attempt to set pin code had wrong value length (%d != %d)\n", length, 4);
+                Log::warning<LogCategory::Config>("attempt to set pin code had wrong value length (%d != %d)\n", length, 4);
                 return;
             }
 
             uint32_t pin_code = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
             if (pin_code > 999999) {
-                Log::printf("attempt to set pin code out of bounds: %d\n", pin_code);
+                Log::warning<LogCategory::Config>("attempt to set pin code out of bounds: %d\n", pin_code);
                 return;
             }
 
             Config::setPinCode(pin_code);
 
-            Log::printf("changed pin code to %06d\n", pin_code);
+            Log::info<LogCategory::Config>("changed pin code to %06d\n", pin_code);
         }
     };
 
@@ -683,12 +1430,12 @@ BLECharacteristic *Ble::createConfigBluetoothAddressCharacteristic(BLEService *s
                 Config::setBtAddress(std::nullopt);
                 Config::setBtAddressName(std::nullopt);
 
-                Log::print("cleared bt addr\n");
+                Log::info<LogCategory::Config>("cleared bt addr\n");
                 return;
             }
 
             if (length < 6) {
-                Log::printf("attempt to set bt addr had wrong value length (%d < %d)\n", length, 6);
+                Log::warning<LogCategory::Config>("attempt to set bt addr had wrong value length (%d < %d)\n", length, 6);
                 return;
             }
 
@@ -700,7 +1447,7 @@ BLECharacteristic *Ble::createConfigBluetoothAddressCharacteristic(BLEService *s
             std::copy(data + address.size(), data + length, name.begin());
             Config::setBtAddressName(name);
 
-            Log::printf("changed bt addr to %02X:%02X:%02X:%02X:%02X:%02X (%s)\n",
+            Log::info<LogCategory::Config>("changed bt addr to %02X:%02X:%02X:%02X:%02X:%02X (%s)\n",
                 address[0], address[1], address[2], address[3], address[4], address[5],
                 name.c_str());
         }
@@ -744,15 +1491,16 @@ BLECharacteristic *Ble::createConfigConnectedIdleTimeoutCharacteristic(BLEServic
             size_t length = characteristic->getLength();
 
             if (length != 4) {
-                Log::printf("attempt to set connected idle timeout had wrong value length (%d != %d)\n", length, 4);
+                Log::warning<LogCategory::Config>("attempt to set connected idle timeout had wrong value length (%d != %d)\n", length, 4);
                 return;
             }
 
             uint32_t timeout = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
 
             Config::setConnectedIdleTimeout(timeout);
+            armClientIdleTimer();
 
-            Log::printf("changed connected idle timeout to %d\n", timeout);
+            Log::info<LogCategory::Config>("changed connected idle timeout to %d\n", timeout);
         }
     };
 
@@ -790,15 +1538,16 @@ BLECharacteristic *Ble::createConfigDisconnectedIdleTimeoutCharacteristic(BLESer
             size_t length = characteristic->getLength();
 
             if (length != 4) {
-                Log::printf("attempt to set disconnected idle timeout had wrong value length (%d != %d)\n", length, 4);
+                Log::warning<LogCategory::Config>("attempt to set disconnected idle timeout had wrong value length (%d != %d)\n", length, 4);
                 return;
             }
 
             uint32_t timeout = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
 
             Config::setDisconnectedIdleTimeout(timeout);
+            Power::updateIdleTimeout();
 
-            Log::printf("changed disconnected idle timeout to %d\n", timeout);
+            Log::info<LogCategory::Config>("changed disconnected idle timeout to %d\n", timeout);
         }
     };
 
@@ -823,6 +1572,109 @@ BLECharacteristic *Ble::createConfigDisconnectedIdleTimeoutCharacteristic(BLESer
     return characteristic;
 }
 
+BLECharacteristic *Ble::createConfigBlobCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            // The pin code is deliberately left out, it's write only like X1_GATT_UUID_CONFIG_PIN_CODE.
+            ConfigBlob blob;
+            blob.name = Config::getName();
+            blob.bt_address = Config::getBtAddress();
+            blob.clear_bt_address = !blob.bt_address;
+            blob.bt_address_name = Config::getBtAddressName();
+            blob.connected_idle_timeout = Config::getConnectedIdleTimeout();
+            blob.disconnected_idle_timeout = Config::getDisconnectedIdleTimeout();
+            blob.auto_connect = Config::getAutoConnect();
+
+            auto value = blob.encode();
+            characteristic->setValue(value.data(), value.size());
+        }
+
+        void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            uint8_t *data = characteristic->getData();
+            size_t length = characteristic->getLength();
+
+            auto blob = ConfigBlob::decode(data, length);
+            if (!blob) {
+                Log::warning<LogCategory::Config>("attempt to write invalid config blob (%d bytes)\n", length);
+                return;
+            }
+
+            if (blob->name) {
+                Config::setName(*blob->name);
+                Log::info<LogCategory::Config>("changed name to \"%s\"\n", blob->name->c_str());
+            }
+
+            if (blob->pin_code) {
+                Config::setPinCode(*blob->pin_code);
+                Log::info<LogCategory::Config>("changed pin code to %06d\n", *blob->pin_code);
+            }
+
+            if (blob->clear_bt_address) {
+                Config::setBtAddress(std::nullopt);
+                Config::setBtAddressName(std::nullopt);
+                Log::info<LogCategory::Config>("cleared bt addr\n");
+            } else if (blob->bt_address) {
+                const auto &address = *blob->bt_address;
+
+                // The saved name belongs to the old device, so it goes unless the blob names the new one.
+                if (Config::getBtAddress() != address && !blob->bt_address_name) {
+                    Config::setBtAddressName(std::nullopt);
+                }
+
+                Config::setBtAddress(address);
+                Log::info<LogCategory::Config>("changed bt addr to %02X:%02X:%02X:%02X:%02X:%02X\n",
+                    address[0], address[1], address[2], address[3], address[4], address[5]);
+            }
+
+            if (blob->bt_address_name && !blob->clear_bt_address) {
+                Config::setBtAddressName(*blob->bt_address_name);
+                Log::info<LogCategory::Config>("changed bt addr name to \"%s\"\n", blob->bt_address_name->c_str());
+            }
+
+            if (blob->connected_idle_timeout) {
+                Config::setConnectedIdleTimeout(*blob->connected_idle_timeout);
+                Log::info<LogCategory::Config>("changed connected idle timeout to %d\n", *blob->connected_idle_timeout);
+            }
+
+            if (blob->disconnected_idle_timeout) {
+                Config::setDisconnectedIdleTimeout(*blob->disconnected_idle_timeout);
+                Log::info<LogCategory::Config>("changed disconnected idle timeout to %d\n", *blob->disconnected_idle_timeout);
+            }
+
+            if (blob->connected_idle_timeout) {
+                armClientIdleTimer();
+            }
+
+            if (blob->disconnected_idle_timeout) {
+                Power::updateIdleTimeout();
+            }
+
+            if (blob->auto_connect) {
+                Config::setAutoConnect(*blob->auto_connect);
+                Log::info<LogCategory::Config>("changed auto connect to %d\n", *blob->auto_connect);
+            }
+
+            // Everything was validated up front, so commit it all together now rather than waiting for the debounce.
+            try {
+                Config::commit();
+            } catch (const std::exception &e) {
+                Log::error<LogCategory::Config>("config commit failed: %s\n", e.what());
+            }
+        }
+    };
+
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_CONFIG_BLOB, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
+
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Config");
+    characteristic->addDescriptor(description_descriptor);
+
+    return characteristic;
+}
+
 BLECharacteristic *Ble::createBatteryVoltageCharacteristic(BLEService *service) {
     BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_BATTERY_VOLTAGE, BLECharacteristic::PROPERTY_READ);
     characteristic->setAccessPermissions(ESP_GATT_PERM_READ);
@@ -845,8 +1697,32 @@ BLECharacteristic *Ble::createBatteryVoltageCharacteristic(BLEService *service)
 }
 
 BLECharacteristic *Ble::createDebugLogCharacteristic(BLEService *service) {
-    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_DEBUG_LOG, BLECharacteristic::PROPERTY_NOTIFY);
-    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM);
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            uint8_t *data = characteristic->getData();
+            size_t length = characteristic->getLength();
+
+            if (length != 2) {
+                Log::warning<LogCategory::General>("attempt to set log level had wrong value length (%d != %d)\n", length, 2);
+                return;
+            }
+
+            LogLevel level = static_cast<LogLevel>(std::min<uint8_t>(data[1], static_cast<uint8_t>(LogLevel::Verbose)));
+
+            // 0xFF applies the level to every category.
+            for (uint8_t category = 0; category < static_cast<uint8_t>(LogCategory::Count); ++category) {
+                if (data[0] == 0xFF || data[0] == category) {
+                    Log::setLevel(static_cast<LogCategory>(category), level);
+                }
+            }
+
+            Log::info<LogCategory::General>("log level for category %02X set to %d\n", data[0], data[1]);
+        }
+    };
+
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_DEBUG_LOG, BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
 
     BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
     description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
@@ -858,9 +1734,9 @@ BLECharacteristic *Ble::createDebugLogCharacteristic(BLEService *service) {
     client_config_descriptors.push_back(configuration_descriptor);
     characteristic->addDescriptor(configuration_descriptor);
 
-    Log::setOutputCallback([=](const std::string &message) {
-        characteristic->setValue(message);
-        characteristic->notify();
+    Log::setOutputCallback([=](const char *data, size_t length) {
+        characteristic->setValue(reinterpret_cast<uint8_t *>(const_cast<char *>(data)), length);
+        notifySubscribers(characteristic);
     });
 
     return characteristic;
@@ -873,15 +1749,15 @@ BLECharacteristic *Ble::createRestartCharacteristic(BLEService *service) {
             size_t length = characteristic->getLength();
 
             bool erase_config = (length >= 1) && data[0] != 0;
-            Log::printf("reboot request from ble client (%s config reset)\n", erase_config ? "with" : "without");
+            Log::info<LogCategory::Power>("reboot request from ble client (%s config reset)\n", erase_config ? "with" : "without");
 
             if (erase_config) {
                 Config::reset();
 
-                Log::print("config reset\n");
+                Log::info<LogCategory::Config>("config reset\n");
             }
 
-            gracefulRestart();
+            Power::restart();
         }
     };
 
@@ -903,9 +1779,9 @@ BLECharacteristic *Ble::createSleepCharacteristic(BLEService *service) {
             uint8_t *data = characteristic->getData();
             size_t length = characteristic->getLength();
 
-            Log::printf("sleep request from ble client\n");
+            Log::info<LogCategory::Power>("sleep request from ble client\n");
 
-            gracefulSleep();
+            Power::sleep();
         }
     };
 
@@ -921,69 +1797,72 @@ BLECharacteristic *Ble::createSleepCharacteristic(BLEService *service) {
     return characteristic;
 }
 
-BLECharacteristic *Ble::createOtaUpdateCharacteristic(BLEService *service) {
-#if defined OTA_PUBLIC_KEY_X && defined OTA_PUBLIC_KEY_Y
-    class Callbacks: public BLECharacteristicCallbacks {
-        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
-            // Clear out the value, in case we error.
-            characteristic->setValue(nullptr, 0);
-
-            char sig_error[256];
-
-            mbedtls_ecp_keypair sig_key;
-            mbedtls_ecp_keypair_init(&sig_key);
-
-            int sig_err = mbedtls_ecp_group_load(&sig_key.grp, MBEDTLS_ECP_DP_SECP256R1);
+// The protocol version the current update was started with, v1 clients expect the shorter status.
+static std::atomic<uint8_t> ota_protocol_version = 1;
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("mbedtls_ecp_group_load: %s (%d)\n", sig_error, sig_err);
-                return;
-            }
-
-            sig_err = mbedtls_ecp_point_read_string(&sig_key.Q, 16, QUOTE(OTA_PUBLIC_KEY_X), QUOTE(OTA_PUBLIC_KEY_Y));
+// Sends [u32 progress][u8 success], progress is 0xFFFFFFFF once the update has completed or failed.
+// Protocol v2 appends [u16 credits], the number of additional chunk writes the client may make.
+static void notifyOtaStatus(BLECharacteristic *characteristic, size_t progress, bool complete, bool success, uint16_t credits) {
+    if (!characteristic) {
+        return;
+    }
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("mbedtls_ecp_point_read_string: %s (%d)\n", sig_error, sig_err);
-                return;
-            }
+    uint32_t value_progress = complete ? 0xFFFFFFFF : progress;
+    uint8_t value[7] = {
+        (uint8_t)(value_progress & 0xFF),
+        (uint8_t)((value_progress >> 8) & 0xFF),
+        (uint8_t)((value_progress >> 16) & 0xFF),
+        (uint8_t)((value_progress >> 24) & 0xFF),
+        (uint8_t)(success ? 1 : 0),
+        (uint8_t)(credits & 0xFF),
+        (uint8_t)((credits >> 8) & 0xFF),
+    };
 
-            size_t length = 0;
-            uint8_t buffer[1 + 1 + 32 + 32];
-            buffer[0] = 0x01; // We add an extra byte before the public key with our "OTA protocol version".
-            sig_err = mbedtls_ecp_point_write_binary(&sig_key.grp, &sig_key.Q, MBEDTLS_ECP_PF_UNCOMPRESSED, &length, &buffer[1], sizeof(buffer) - 1);
+    characteristic->setValue(value, (ota_protocol_version >= 2) ? 7 : 5);
+    notifySubscribers(characteristic);
+}
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("mbedtls_ecp_point_write_binary: %s (%d)\n", sig_error, sig_err);
-                return;
-            }
+BLECharacteristic *Ble::createOtaUpdateCharacteristic(BLEService *service) {
+#if defined OTA_PUBLIC_KEY_X && defined OTA_PUBLIC_KEY_Y
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            // The key is encoded at build time, so there's nothing to go wrong here any more.
+            uint8_t buffer[1 + Ota::PUBLIC_KEY_SIZE];
+            buffer[0] = 0x05; // We add an extra byte before the public key with our "OTA protocol version".
+            memcpy(&buffer[1], Ota::getPublicKey(), Ota::PUBLIC_KEY_SIZE);
 
-            characteristic->setValue(buffer, length + 1);
+            characteristic->setValue(buffer, sizeof(buffer));
         }
 
         void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
             this->characteristic = characteristic;
+            noteTrafficActivity(param->write.conn_id);
 
             uint8_t *data = characteristic->getData();
             size_t length = characteristic->getLength();
 
             // uint8_t message type
             //   01: start
-            //      uint8_t format (always 1)
-            //      uint32_t total image size
+            //      uint8_t format (1 raw, 2 raw deflate with a window of at most 4 KiB,
+            //                      3 delta patch against the running image, 4 deflated delta patch)
+            //      uint32_t total image size, as sent
+            //      v2 and later only:
+            //        uint8_t protocol version (2 windowed, 3 adds format 2, 4 adds formats 3 and 4, 5 adds resume)
+            //        uint16_t max chunk size
+            //      v5 and later, optional:
+            //        uint8_t image id[32] (normally the image sha256), makes a raw image resumable
             //   02: chunk
             //      uint8_t data[]
             //   03: finish
             //      uint8_t signature[]
+            //
+            // A v2 client waits for the first status notification after start, and then
+            // only sends as many chunks as it has been given credits for. If a resumable
+            // session was picked back up, that notification's progress is the offset to
+            // carry on sending from.
 
 #if 0
-            Log::printf("%d bytes ble ota data received:", length);
-            for (size_t i = 0; i < length; ++i) {
-                Log::printf(" %02X", data[i]);
-            }
-            Log::print("\n");
+            Log::hexdump<LogLevel::Verbose, LogCategory::Ota>(data, length, "%d bytes ble ota data received:", length);
 #endif
 
             if (length < 1) {
@@ -1001,218 +1880,288 @@ BLECharacteristic *Ble::createOtaUpdateCharacteristic(BLEService *service) {
                     onOtaFinish(&data[1], length - 1);
                     break;
                 default:
-                    Log::printf("invalid ble ota type: %02X\n", data[0]);
+                    Log::warning<LogCategory::Ota>("invalid ble ota type: %02X\n", data[0]);
                     break;
             }
         }
 
         void onOtaStart(const uint8_t *data, size_t length) {
-            if (length != 5) {
-                Log::printf("invalid ble ota start message length: %d\n", length);
+            if (length != 5 && length != 8 && length != 40) {
+                Log::warning<LogCategory::Ota>("invalid ble ota start message length: %d\n", length);
                 return;
             }
 
-            if (data[0] != 0x01) {
-                Log::printf("invalid ble ota format: %d\n", data[1]);
+            if (data[0] < static_cast<uint8_t>(OtaFormat::Raw) || data[0] > static_cast<uint8_t>(OtaFormat::DeflateDelta)) {
+                Log::warning<LogCategory::Ota>("invalid ble ota format: %d\n", data[0]);
                 return;
             }
 
-            ota_partition = esp_ota_get_next_update_partition(nullptr);
-            if (!ota_partition) {
-                Log::print("ble ota partition not found\n");
-                return;
-            }
+            OtaFormat format = static_cast<OtaFormat>(data[0]);
 
-            image_size = (data[4] << 24) | (data[3] << 16) | (data[2] << 8) | data[1];
+            size_t image_size = (data[4] << 24) | (data[3] << 16) | (data[2] << 8) | data[1];
 
-            esp_err_t err = esp_ota_begin(ota_partition, image_size, &ota_handle);
-            if (err != ESP_OK) {
-                Log::printf("ble ota failed to start: %s (%d)\n", esp_err_to_name(err), err);
-                notify(true, false);
-                image_size = 0;
-                return;
+            uint8_t version = 1;
+            size_t chunk_size = 0;
+            if (length >= 8) {
+                version = data[5];
+                chunk_size = (data[7] << 8) | data[6];
+
+                if (version < 2 || version > 5 || chunk_size == 0 || chunk_size > ESP_GATT_MAX_ATTR_LEN) {
+                    Log::warning<LogCategory::Ota>("invalid ble ota v2 start: version %d, chunk size %d\n", version, chunk_size);
+                    return;
+                }
             }
 
-            Log::printf("ble ota update started (%s), expecting %d bytes\n", ota_partition->label, image_size);
-            bytes_written = 0;
+            const uint8_t *image_id = nullptr;
+            if (length == 40) {
+                if (version < 5) {
+                    Log::warning<LogCategory::Ota>("invalid ble ota start: image id needs v5, got v%d\n", version);
+                    return;
+                }
 
-            mbedtls_sha256_init(&sha_ctx);
-            mbedtls_sha256_starts_ret(&sha_ctx, 0);
+                image_id = &data[8];
+            }
 
-            notify(false, false);
-        }
+            ota_protocol_version = version;
 
-        void onOtaChunk(const uint8_t *data, size_t length) {
-            if (image_size == 0) {
-                Log::print("ble ota chunk message received without start\n");
-                return;
+            if (!Ota::begin(format, image_size, chunk_size, image_id)) {
+                notifyOtaStatus(characteristic, 0, true, false, 0);
             }
+        }
 
+        void onOtaChunk(const uint8_t *data, size_t length) {
             if (length == 0) {
                 return;
             }
 
-            if ((bytes_written + length) > image_size) {
-                Log::printf("ble ota chunk out of bounds: (%d + %d) > %d\n", bytes_written, length, image_size);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                mbedtls_sha256_free(&sha_ctx);
-                return;
-            }
+            // Failures after this point are reported by the writer task.
+            Ota::write(data, length);
+        }
 
-            esp_err_t err = esp_ota_write(ota_handle, data, length);
-            if (err != ESP_OK) {
-                Log::printf("ble ota failed to write: %s (%d)\n", esp_err_to_name(err), err);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                mbedtls_sha256_free(&sha_ctx);
-                return;
-            }
+        void onOtaFinish(const uint8_t *data, size_t length) {
+            Ota::end(data, length);
+        }
 
-            mbedtls_sha256_update_ret(&sha_ctx, data, length);
+        BLECharacteristic *characteristic = nullptr;
+    };
 
-            bytes_written += length;
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_OTA_UPDATE, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR | BLECharacteristic::PROPERTY_NOTIFY);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
 
-            Log::printf("ble ota update chunk processed (%d / %d bytes)\n", bytes_written, image_size);
+    // The writer task does the flash work, so this is where progress and the result come from.
+    Ota::setStatusCallback([characteristic](size_t progress, bool complete, bool success, uint16_t credits) {
+        notifyOtaStatus(characteristic, progress, complete, success, credits);
+        Led::setOtaActive(!complete);
 
-            notify(false, false);
+        if (complete && success) {
+            Power::restart();
         }
+    });
 
-        void onOtaFinish(const uint8_t *data, size_t length) {
-            if (image_size == 0) {
-                Log::print("ble ota finish message received without start\n");
-                return;
-            }
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("OTA Update");
+    characteristic->addDescriptor(description_descriptor);
 
-            if (bytes_written != image_size) {
-                Log::printf("ble ota finish message image size mismatch (%d != %d)\n", bytes_written, image_size);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                mbedtls_sha256_free(&sha_ctx);
-                return;
-            }
+    BLE2902 *configuration_descriptor = new BLE2902();
+    configuration_descriptor->setAccessPermissions(ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE_ENC_MITM);
+    client_config_descriptors.push_back(configuration_descriptor);
+    characteristic->addDescriptor(configuration_descriptor);
+
+    return characteristic;
+#else
+    #warning "OTA_PUBLIC_KEY_X/Y not defined, OTA update will not be available"
+    Log::warning<LogCategory::Ota>("signing key not defined, ota updates disabled\n");
+
+    return nullptr;
+#endif
+}
+
+BLECharacteristic *Ble::createStatsCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            constexpr size_t span_count = static_cast<size_t>(TraceSpan::Count);
 
-            uint8_t hash[32];
-            mbedtls_sha256_finish_ret(&sha_ctx, hash);
-            mbedtls_sha256_free(&sha_ctx);
+            uint8_t value[2 + (span_count * 16)];
+            value[0] = 1; // version
+            value[1] = span_count;
 
-            Log::print("ble ota image hash: ");
-            for (uint8_t byte : hash) {
-                Log::printf("%02x", byte);
+            uint8_t *out = value + 2;
+            auto put = [&](uint32_t field) {
+                for (int i = 0; i < 4; ++i) {
+                    *out++ = (field >> (i * 8)) & 0xFF;
+                }
+            };
+
+            for (size_t i = 0; i < span_count; ++i) {
+                const auto &histogram = Trace::getHistogram(static_cast<TraceSpan>(i));
+                put(histogram.count());
+                put(histogram.percentile(50));
+                put(histogram.percentile(99));
+                put(histogram.max());
             }
-            Log::print("\n");
 
-            char sig_error[256];
+            characteristic->setValue(value, sizeof(value));
+        }
 
-            mbedtls_ecp_keypair sig_key;
-            mbedtls_ecp_keypair_init(&sig_key);
+        void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            Log::info<LogCategory::General>("latency stats reset by ble client\n");
+            Trace::reset();
+        }
+    };
 
-            int sig_err = mbedtls_ecp_group_load(&sig_key.grp, MBEDTLS_ECP_DP_SECP256R1);
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_STATS, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("ble ota signature verification failed - mbedtls_ecp_group_load: %s (%d)\n", sig_error, sig_err);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                return;
-            }
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Latency Stats");
+    characteristic->addDescriptor(description_descriptor);
 
-            sig_err = mbedtls_ecp_point_read_string(&sig_key.Q, 16, QUOTE(OTA_PUBLIC_KEY_X), QUOTE(OTA_PUBLIC_KEY_Y));
+    return characteristic;
+}
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("ble ota signature verification failed - mbedtls_ecp_point_read_string: %s (%d)\n", sig_error, sig_err);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                return;
-            }
+BLECharacteristic *Ble::createDiagnosticsCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            std::vector<uint8_t> value = Diagnostics::getSnapshot();
+            characteristic->setValue(value.data(), value.size());
+        }
+    };
 
-            mbedtls_ecdsa_context sig_ctx;
-            mbedtls_ecdsa_init(&sig_ctx);
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_DIAGNOSTICS, BLECharacteristic::PROPERTY_READ);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM);
 
-            sig_err = mbedtls_ecdsa_from_keypair(&sig_ctx, &sig_key);
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Diagnostics");
+    characteristic->addDescriptor(description_descriptor);
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("ble ota signature verification failed - mbedtls_ecdsa_from_keypair: %s (%d)\n", sig_error, sig_err);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
-                return;
-            }
+    return characteristic;
+}
+
+static void updateBenchmarkResult(bool notify) {
+    TickType_t end = (benchmark.mode == BenchmarkMode::Off) ? benchmark.finished : xTaskGetTickCount();
+    uint32_t elapsed = (end - benchmark.started) * portTICK_PERIOD_MS;
+    uint32_t notifications = benchmark.notifications.load(std::memory_order_relaxed);
+    uint32_t bytes = benchmark.bytes.load(std::memory_order_relaxed);
+    uint32_t round_trip = Trace::getHistogram(TraceSpan::RoundTrip).percentile(50);
+
+    uint16_t connection_interval = 0;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        BleConnection *connection = findConnection(benchmark.conn_id);
+        if (connection) {
+            connection_interval = connection->connection_interval;
+        }
+    }
+
+    uint8_t value[1 + 4 + 4 + 4 + 2 + 4];
+    uint8_t *out = value;
+    auto put = [&](uint32_t field, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            *out++ = (field >> (i * 8)) & 0xFF;
+        }
+    };
+
+    put(static_cast<uint8_t>(benchmark.mode.load()), 1);
+    put(notifications, 4);
+    put(bytes, 4);
+    put(elapsed, 4);
+    put(connection_interval, 2);
+    put(round_trip, 4);
+
+    benchmark_characteristic->setValue(value, sizeof(value));
+    if (notify) {
+        notifySubscribers(benchmark_characteristic);
+    }
+}
+
+static void stopBenchmark() {
+    if (benchmark.mode == BenchmarkMode::Off) {
+        return;
+    }
+
+    benchmark.mode = BenchmarkMode::Off;
+    benchmark.finished = xTaskGetTickCount();
 
-            sig_err = mbedtls_ecdsa_read_signature(&sig_ctx, hash, sizeof(hash), data, length);
+    uint32_t elapsed = (benchmark.finished - benchmark.started) * portTICK_PERIOD_MS;
+    uint32_t bytes = benchmark.bytes.load(std::memory_order_relaxed);
+    Log::info<LogCategory::Serial>("benchmark finished: %u notifications, %u bytes in %ums (%u B/s)\n",
+        benchmark.notifications.load(std::memory_order_relaxed), bytes, elapsed,
+        elapsed > 0 ? (uint32_t)(((uint64_t)bytes * 1000) / elapsed) : 0);
 
-            if (sig_err != 0) {
-                mbedtls_strerror(sig_err, sig_error, sizeof(sig_error));
-                Log::printf("ble ota signature verification failed - mbedtls_ecdsa_read_signature: %s (%d)\n", sig_error, sig_err);
-                notify(true, false);
-                image_size = 0;
-                esp_ota_abort(ota_handle);
+    updateBenchmarkResult(true);
+}
+
+BLECharacteristic *Ble::createBenchmarkCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            updateBenchmarkResult(false);
+        }
+
+        void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            uint8_t *data = characteristic->getData();
+            size_t length = characteristic->getLength();
+
+            if (length < 1) {
                 return;
             }
 
-            mbedtls_ecdsa_free(&sig_ctx);
-            mbedtls_ecp_keypair_free(&sig_key);
-
-            Log::printf("ble ota signature verification passed\n");
+            auto mode = static_cast<BenchmarkMode>(data[0]);
+            if (mode == BenchmarkMode::Off) {
+                stopBenchmark();
+                return;
+            }
 
-            esp_err_t err = esp_ota_end(ota_handle);
-            if (err != ESP_OK) {
-                Log::printf("ble ota failed to validate: %s (%d)\n", esp_err_to_name(err), err);
-                notify(true, false);
-                image_size = 0;
+            if (mode != BenchmarkMode::Echo && mode != BenchmarkMode::Synthesize) {
+                Log::warning<LogCategory::Serial>("unknown benchmark mode: %d\n", data[0]);
                 return;
             }
 
-            err = esp_ota_set_boot_partition(ota_partition);
-            if (err != ESP_OK) {
-                Log::printf("ble ota failed to switch partition: %s (%d)\n", esp_err_to_name(err), err);
-                notify(true, false);
-                image_size = 0;
+            uint16_t frame_size = 16;
+            uint16_t rate = 0;
+            uint32_t frame_count = 1000;
+            if (length >= 9) {
+                frame_size = (data[2] << 8) | data[1];
+                rate = (data[4] << 8) | data[3];
+                frame_count = (data[8] << 24) | (data[7] << 16) | (data[6] << 8) | data[5];
+            }
+
+            if (frame_size < 2 || frame_size > BENCHMARK_MAX_FRAME_SIZE) {
+                Log::warning<LogCategory::Serial>("benchmark frame size out of bounds: %d\n", frame_size);
                 return;
             }
 
-            Log::print("ble ota complete\n");
-            notify(true, true);
+            stopBenchmark();
 
-            // We're in the BLE handler task here. We can't suspend it.
-            // TODO: We should probably move more of the update process out.
-            gracefulRestart();
-        }
+            benchmark.conn_id = param->write.conn_id;
+            benchmark.frame_size = frame_size;
+            benchmark.rate = rate;
+            benchmark.frame_count = frame_count;
+            benchmark.notifications = 0;
+            benchmark.bytes = 0;
+            benchmark.started = xTaskGetTickCount();
+            benchmark.mode = mode;
 
-        void notify(bool complete, bool success) {
-            uint8_t byte_0 = complete ? 0xFF : (bytes_written & 0xFF);
-            uint8_t byte_1 = complete ? 0xFF : ((bytes_written >> 8) & 0xFF);
-            uint8_t byte_2 = complete ? 0xFF : ((bytes_written >> 16) & 0xFF);
-            uint8_t byte_3 = complete ? 0xFF : ((bytes_written >> 24) & 0xFF);
-            uint8_t byte_4 = success ? 1 : 0;
+            Trace::reset();
 
-            uint8_t value[5] = { byte_0, byte_1, byte_2, byte_3, byte_4 };
-            characteristic->setValue(value, sizeof(value));
-            characteristic->notify();
-        }
+            Log::info<LogCategory::Serial>("benchmark started: mode %d, %d byte frames, %d/s, %u frames\n", mode, frame_size, rate, frame_count);
 
-        BLECharacteristic *characteristic = nullptr;
-        size_t image_size = 0;
-        size_t bytes_written = 0;
-        const esp_partition_t *ota_partition = nullptr;
-        esp_ota_handle_t ota_handle;
-        mbedtls_sha256_context sha_ctx;
+            xTaskNotifyGive(benchmark_task);
+        }
     };
 
-    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_OTA_UPDATE, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR | BLECharacteristic::PROPERTY_NOTIFY);
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_BENCHMARK, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY);
     characteristic->setCallbacks(new Callbacks());
     characteristic->setAccessPermissions(ESP_GATT_PERM_READ_ENC_MITM | ESP_GATT_PERM_WRITE_ENC_MITM);
 
     BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
     description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
-    description_descriptor->setValue("OTA Update");
+    description_descriptor->setValue("Benchmark");
     characteristic->addDescriptor(description_descriptor);
 
     BLE2902 *configuration_descriptor = new BLE2902();
@@ -1220,20 +2169,111 @@ BLECharacteristic *Ble::createOtaUpdateCharacteristic(BLEService *service) {
     client_config_descriptors.push_back(configuration_descriptor);
     characteristic->addDescriptor(configuration_descriptor);
 
+    benchmark_characteristic = characteristic;
+
+    // Generates frames into the receive path for the synthesize mode, echo is handled in the serial data onWrite.
+    xTaskCreatePinnedToCore([](void *parameters) {
+        uint8_t frame[BENCHMARK_MAX_FRAME_SIZE];
+
+        for (;;) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            uint32_t sent = 0;
+            while (benchmark.mode == BenchmarkMode::Synthesize && sent < benchmark.frame_count) {
+                uint32_t due = benchmark.frame_count;
+                if (benchmark.rate != 0) {
+                    uint64_t elapsed = (xTaskGetTickCount() - benchmark.started) * portTICK_PERIOD_MS;
+                    due = std::min<uint64_t>(benchmark.frame_count, ((elapsed * benchmark.rate) / 1000) + 1);
+                }
+
+                size_t frame_size = benchmark.frame_size;
+                while (sent < due) {
+                    // Printable filler that changes each frame, never containing the delimiter.
+                    frame[0] = 'b';
+                    for (size_t i = 1; i < (frame_size - 1); ++i) {
+                        frame[i] = 'a' + ((sent + i) % 26);
+                    }
+                    frame[frame_size - 1] = '\n';
+
+                    {
+                        std::lock_guard<std::mutex> lock(serial_rx_mutex);
+                        if (serial_rx_framer.space() < frame_size) {
+                            break;
+                        }
+
+                        serial_rx_framer.push(frame, frame_size);
+                    }
+
+                    ++sent;
+                }
+
+                xTaskNotifyGive(serial_notify_task);
+                vTaskDelay(1);
+            }
+
+            if (benchmark.mode != BenchmarkMode::Synthesize) {
+                continue;
+            }
+
+            // Let the notify task catch up before taking the end time.
+            while (!serial_rx_framer.empty() && benchmark.mode == BenchmarkMode::Synthesize) {
+                vTaskDelay(1);
+            }
+
+            stopBenchmark();
+        }
+    }, "benchmark", 4096, nullptr, 1, &benchmark_task, CONFIG_ARDUINO_RUNNING_CORE);
+
     return characteristic;
-#else
-    #warning "OTA_PUBLIC_KEY_X/Y not defined, OTA update will not be available"
-    Log::print("signing key not defined, ota updates disabled\n");
+}
 
-    return nullptr;
-#endif
+BLECharacteristic *Ble::createLinkInfoCharacteristic(BLEService *service) {
+    class Callbacks: public BLECharacteristicCallbacks {
+        void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
+            BleConnection link = {};
+            link.mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+            link.tx_data_length = DEFAULT_LINK_DATA_LENGTH;
+            link.rx_data_length = DEFAULT_LINK_DATA_LENGTH;
+            link.tx_phy = 1;
+            link.rx_phy = 1;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                BleConnection *connection = findConnection(param->read.conn_id);
+                if (connection) {
+                    link = *connection;
+                }
+            }
+
+            uint8_t value[] = {
+                (uint8_t)(link.mtu & 0xFF), (uint8_t)(link.mtu >> 8),
+                (uint8_t)(link.tx_data_length & 0xFF), (uint8_t)(link.tx_data_length >> 8),
+                (uint8_t)(link.rx_data_length & 0xFF), (uint8_t)(link.rx_data_length >> 8),
+                link.tx_phy,
+                link.rx_phy,
+                (uint8_t)(link.connection_interval & 0xFF), (uint8_t)(link.connection_interval >> 8),
+            };
+
+            characteristic->setValue(value, sizeof(value));
+        }
+    };
+
+    BLECharacteristic *characteristic = service->createCharacteristic(X1_GATT_UUID_LINK_INFO, BLECharacteristic::PROPERTY_READ);
+    characteristic->setCallbacks(new Callbacks());
+    characteristic->setAccessPermissions(ESP_GATT_PERM_READ);
+
+    BLEDescriptor *description_descriptor = new BLEDescriptor(BLEUUID((uint16_t)ESP_GATT_UUID_CHAR_DESCRIPTION));
+    description_descriptor->setAccessPermissions(ESP_GATT_PERM_READ);
+    description_descriptor->setValue("Link Info");
+    characteristic->addDescriptor(description_descriptor);
+
+    return characteristic;
 }
 
 BLECharacteristic *Ble::createMtuInfoCharacteristic(BLEService *service) {
     class Callbacks: public BLECharacteristicCallbacks {
         void onRead(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override {
-            // param->read.conn_id
-            characteristic->setValue(current_mtu);
+            uint16_t mtu = getConnectionMtu(param->read.conn_id);
+            characteristic->setValue(mtu);
         }
     };
 
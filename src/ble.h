@@ -17,19 +17,46 @@
 #define X1_GATT_UUID_CONFIG_DISCON_IDLE "0000200b-7858-48fb-b797-8613e960da6a"
 #define X1_GATT_UUID_SLEEP              "0000200c-7858-48fb-b797-8613e960da6a"
 #define X1_GATT_UUID_MTU_INFO           "0000200d-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_SERIAL_MODE        "0000200e-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_CONFIG_BLOB        "0000200f-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_SERIAL_FLOW        "00002010-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_STATS              "00002011-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_BENCHMARK          "00002012-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_LINK_INFO          "00002013-7858-48fb-b797-8613e960da6a"
+#define X1_GATT_UUID_DIAGNOSTICS        "00002014-7858-48fb-b797-8613e960da6a"
 
 // BLE API:
+//   Up to BLE_MAX_CONNECTIONS clients can be connected at once, each only gets the notifications
+//   it has enabled. Anything sized to the MTU uses the smallest of the connected clients' MTUs.
+//
 //   X1_GATT_UUID_SERIAL_DATA
 //     - Notify: received full command from connected BT SPP
 //     - Write: send data to connected BT SPP
+//   X1_GATT_UUID_SERIAL_MODE
+//     - Read / Write: u8 mode flags + u8 batch deadline (ms), shared by all clients,
+//       reset once the last one disconnects
+//         0x01: batched notify, pack as many full commands as fit in the MTU into
+//               each serial data notification, sent when full or after the deadline
+//         0x02: coalesce writes, while the SPP link is busy only the newest pending write
+//               per lowercase command letter is kept, each write must be a single command
+//         0x04: envelopes, notifications and writes are each wrapped in a binary envelope with a
+//               sequence number, ack, and timestamp, see envelope.h. Frames are packed into each
+//               envelope as they arrive, or up to the deadline with batched notify as well
+//   X1_GATT_UUID_SERIAL_FLOW
+//     - Read / Notify: u8 paused + u16 free bytes in the SPP TX queue, notified when
+//       the queue passes its high-water mark (paused, stop writing) and when it drains
+//       back down (resumed), writes that don't fit in the queue are dropped
 //
 //   X1_GATT_UUID_BT_SCAN
 //     - Read: current scan state
-//     - Notify: on new device found
-//     - Write: start / stop scan
+//     - Notify: on a device being found, renamed, or its rssi changing, then 7 zero bytes when done
+//         started with 0x01: u8 address[6] + i8 rssi + name, one device per notification
+//         started with 0x02: [u8 address[6]][i8 rssi][u8 name length][name] records, as many as fit
+//     - Write: u8 0 stop / 1 or 2 start scan, works again after having connected
 //   X1_GATT_UUID_BT_CONNECT
 //     - Read / Notify: current connection state
 //     - Write: connect / disconnect
+//     - With auto connect set in the config blob, connecting starts by itself at boot
 //
 //   X1_GATT_UUID_CONFIG_NAME
 //     - Read / Write: string tied to config, restart required
@@ -41,20 +68,43 @@
 //     - Read / Write: u32 tied to config
 //   X1_GATT_UUID_CONFIG_DISCON_SLEEP
 //     - Read / Write: u32 tied to config
+//   X1_GATT_UUID_CONFIG_BLOB
+//     - Read / Write: u8 version (1) + [u8 tag][u8 length][value] records, see config_blob.h
+//         absent fields are left unchanged, the whole write is validated then committed at once
 //
 //   X1_GATT_UUID_BATTERY_VOLTAGE
 //     - Read: current battery voltage
 //   X1_GATT_UUID_DEBUG_LOG
-//     - Notify: log write
+//     - Notify: one or more complete log lines, each terminated by a newline
+//     - Write: u8 category (0xFF for all) + u8 level, set runtime log level
 //   X1_GATT_UUID_RESTART
 //     - Write: restart module, param to erase config first
 //   X1_GATT_UUID_SLEEP
 //     - Write: deep sleep module
 //   X1_GATT_UUID_OTA_UPDATE
 //     - Write: ota update message
-//     - Notify: ota update status
+//     - Read: u8 ota protocol version (5) + uncompressed signing public key
+//     - Notify: ota update status, u32 bytes written to flash (every 16 KiB) + u8 success
+//         + u16 chunk credits for protocol v2 (every 4 KiB)
 //   X1_GATT_UUID_MTU
-//     - Read: u32 current mtu
+//     - Read: u32 current mtu of the reading client
+//   X1_GATT_UUID_LINK_INFO
+//     - Read: the reading client's u16 mtu + u16 tx / rx link layer data length + u8 tx / rx phy (1 = 1M, 2 = 2M)
+//         + u16 connection interval (1.25ms units)
+//   X1_GATT_UUID_STATS
+//     - Read: u8 version (1) + u8 span count + per span u32 count, p50, p99, max (us)
+//         spans: ble->spp, spp response, framing, notify, round trip (see trace.h)
+//     - Write: reset the histograms
+//   X1_GATT_UUID_DIAGNOSTICS
+//     - Read: heap and per task stack / cpu snapshot, sampled every DIAGNOSTICS_SAMPLE_INTERVAL,
+//         see diagnostics.h for the layout
+//   X1_GATT_UUID_BENCHMARK
+//     - Write: u8 mode + optional u16 frame size + u16 rate (frames/s, 0 unlimited) + u32 frame count
+//         0: stop, 1: echo serial data writes back as notifications instead of sending them to SPP,
+//         2: synthesize frames into the notify path, finishing after frame count
+//     - Read / Notify: u8 mode + u32 notifications + u32 bytes + u32 elapsed ms
+//         + u16 connection interval of the client that started it (1.25ms units) + u32 round trip p50 (us),
+//         notified on finish
 
 class BLEServer;
 class BLEService;
@@ -64,6 +114,9 @@ class Ble {
 public:
     static void init(const std::string &name, uint32_t pinCode);
     static void deinit();
+    // Connects to the saved BT address in the background if auto connect is enabled, after
+    // both Ble::init and Bluetooth::init.
+    static void startAutoConnect();
     static bool isClientConnected();
     static void updateBatteryLevel(uint8_t level, uint32_t millivolts);
 
@@ -71,6 +124,8 @@ private:
     static void initBatteryService(BLEServer *server);
     static void initBridgeService(BLEServer *server);
     static BLECharacteristic *createSerialDataCharacteristic(BLEService *service);
+    static BLECharacteristic *createSerialModeCharacteristic(BLEService *service);
+    static BLECharacteristic *createSerialFlowCharacteristic(BLEService *service);
     static BLECharacteristic *createBluetoothScanCharacteristic(BLEService *service);
     static BLECharacteristic *createBluetoothConnectCharacteristic(BLEService *service);
     static BLECharacteristic *createConfigNameCharacteristic(BLEService *service);
@@ -78,10 +133,15 @@ private:
     static BLECharacteristic *createConfigBluetoothAddressCharacteristic(BLEService *service);
     static BLECharacteristic *createConfigConnectedIdleTimeoutCharacteristic(BLEService *service);
     static BLECharacteristic *createConfigDisconnectedIdleTimeoutCharacteristic(BLEService *service);
+    static BLECharacteristic *createConfigBlobCharacteristic(BLEService *service);
     static BLECharacteristic *createBatteryVoltageCharacteristic(BLEService *service);
     static BLECharacteristic *createDebugLogCharacteristic(BLEService *service);
     static BLECharacteristic *createRestartCharacteristic(BLEService *service);
     static BLECharacteristic *createSleepCharacteristic(BLEService *service);
     static BLECharacteristic *createOtaUpdateCharacteristic(BLEService *service);
     static BLECharacteristic *createMtuInfoCharacteristic(BLEService *service);
+    static BLECharacteristic *createLinkInfoCharacteristic(BLEService *service);
+    static BLECharacteristic *createStatsCharacteristic(BLEService *service);
+    static BLECharacteristic *createBenchmarkCharacteristic(BLEService *service);
+    static BLECharacteristic *createDiagnosticsCharacteristic(BLEService *service);
 };
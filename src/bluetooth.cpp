@@ -1,232 +1,781 @@
 #include "bluetooth.h"
+#include "defaults.h"
+#include "log.h"
+#include "ring_buffer.h"
+#include "trace.h"
 
 #include <BluetoothSerial.h>
+#include <esp_attr.h>
+#include <esp_gap_bt_api.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 
-// TODO: Implement a way to clear out the "known" client so that we can re-run
-//       discovery after disconnecting. Without this we'll need to reset the
-//       module to allow the user to reconfigure the device to connect to.
 // TODO: BluetoothSerial has a fair few other deficiencies that would be good
 //       to address at some point. We try and offer a sane API from our module
 //       that isn't tightly bound to BluetoothSerial and synthesizes some of
 //       the more egregious omissions.
-//         - No callback for discovery completing.
 //         - Client connection is blocking only.
-//         - No callback for client disconnection.
 BluetoothSerial SerialBT;
 
-bool can_scan = true;
-
-TaskHandle_t scan_task = nullptr;
-TaskHandle_t connect_task = nullptr;
+// Every operation is run by the single btWorker task, the public API just queues a command.
+// The worker owns all the state below apart from can_scan, the pending callbacks and the discovery table.
+enum class BtCommandType : uint8_t {
+    Scan,
+    CancelScan,
+    Connect,
+    Disconnect,
+    Closed, // Posted by the SPP callback.
+    InquiryStopped, // Posted by the GAP callback.
+};
+
+struct BtCommand {
+    BtCommandType type;
+    std::array<uint8_t, 6> address;
+    uint8_t retry_count;
+};
+
+static QueueHandle_t command_queue = nullptr;
+
+// Only once our GAP callback is in place.
+static std::atomic<bool> can_scan = false;
+
+// Handed over from the caller with each scan / connect command, the worker takes a copy when it starts the operation.
+static std::mutex callback_mutex;
+static std::function<void(const std::vector<AdvertisedDevice> &devices)> pending_on_devices = nullptr;
+static std::function<void(bool canceled)> pending_on_scan_finished = nullptr;
+static std::function<void(bool connected)> pending_on_connection_changed = nullptr;
+static std::function<void(uint8_t attempt, uint8_t count)> pending_on_connection_attempt = nullptr;
+
+// Serial writes are queued here and written out by btTx, so a congested SPP link
+// only ever blocks that task. Backpressure is signalled through the flow callback.
+static constexpr size_t TX_HIGH_WATER = 1536;
+static constexpr size_t TX_LOW_WATER = 512;
+static RingBuffer<2048> tx_ring;
+static std::mutex tx_mutex;
+static TaskHandle_t tx_task = nullptr;
+static std::atomic<bool> tx_paused = false;
+static std::function<void(bool paused, size_t space)> tx_flow_callback = nullptr;
+
+// With coalescing on, single-command writes that arrive while the link is still busy
+// are held here instead, keeping only the newest per command letter. They're moved
+// into tx_ring whenever it drains, so they go out as fast as the link can take them.
+struct CoalescedCommand {
+    uint8_t length;
+    uint8_t data[15];
+};
+
+static bool tx_coalescing = false;
+static std::array<CoalescedCommand, 8> coalesced_commands;
+static size_t coalesced_count = 0;
+
+// The SPP channel service discovery found on the last successful connect. It's kept in RTC
+// memory so it survives deep sleep, and reconnecting after a wake can skip SDP entirely.
+struct CachedChannel {
+    std::array<uint8_t, 6> address;
+    uint8_t channel;
+};
+
+static RTC_DATA_ATTR CachedChannel cached_channel = {};
+
+// Set by the SPP callback, so that a close for a failed connection attempt
+// isn't mistaken for the established connection going away.
+static std::atomic<bool> spp_open = false;
+
+// Called from the BT stack task after BluetoothSerial has handled the event.
+static void sppCallback(esp_spp_cb_event_t event, esp_spp_cb_param_t *param) {
+    if (event == ESP_SPP_OPEN_EVT && param->open.status == ESP_SPP_SUCCESS) {
+        spp_open = true;
+    } else if (event == ESP_SPP_CLOSE_EVT) {
+        if (!spp_open.exchange(false)) {
+            return;
+        }
 
-void Bluetooth::init(const std::string &name) {
-    SerialBT.begin(name.c_str(), true);
+        BtCommand command = { BtCommandType::Closed };
+        xQueueSend(command_queue, &command, 0);
+    }
 }
 
-void Bluetooth::deinit() {
-    disconnect();
+// Discovery runs on the raw GAP events rather than BluetoothSerial's, which only report a device
+// once per scan. Every inquiry result updates this table, and the worker periodically sends on
+// the named devices that are new, renamed, or whose RSSI has moved by BT_SCAN_RSSI_THRESHOLD.
+struct DiscoveredDevice {
+    std::array<uint8_t, 6> address;
+    int8_t rssi;
+    int8_t reported_rssi;
+    bool changed;
+    uint8_t name_length;
+    char name[32];
+};
+
+static std::mutex discovery_mutex;
+static std::array<DiscoveredDevice, 16> discovered_devices;
+static size_t discovered_count = 0;
+
+static void onDiscoveryResult(esp_bt_gap_cb_param_t *param) {
+    const char *name = nullptr;
+    uint8_t name_length = 0;
+    std::optional<int8_t> rssi = std::nullopt;
+
+    for (int i = 0; i < param->disc_res.num_prop; ++i) {
+        const esp_bt_gap_dev_prop_t &prop = param->disc_res.prop[i];
+        switch (prop.type) {
+            case ESP_BT_GAP_DEV_PROP_BDNAME:
+                name = static_cast<const char *>(prop.val);
+                name_length = strnlen(name, prop.len);
+                break;
+            case ESP_BT_GAP_DEV_PROP_RSSI:
+                rssi = *static_cast<int8_t *>(prop.val);
+                break;
+            case ESP_BT_GAP_DEV_PROP_EIR:
+                if (!name) {
+                    uint8_t *eir = static_cast<uint8_t *>(prop.val);
+                    uint8_t *eir_name = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &name_length);
+                    if (!eir_name) {
+                        eir_name = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &name_length);
+                    }
+
+                    name = reinterpret_cast<const char *>(eir_name);
+                }
+                break;
+            default:
+                break;
+        }
+    }
 
-    while (isConnected()) {
-        vTaskDelay(1);
+    if (!name) {
+        name_length = 0;
     }
 
-    SerialBT.end();
-}
+    name_length = std::min<size_t>(name_length, sizeof(DiscoveredDevice::name));
 
-bool Bluetooth::canScan() {
-    return can_scan;
-}
+    std::array<uint8_t, 6> address;
+    std::copy(param->disc_res.bda, param->disc_res.bda + address.size(), address.begin());
 
-bool Bluetooth::scan(std::function<void(const AdvertisedDevice &advertisedDevice)> on_device, std::function<void(bool canceled)> on_finished) {
-    if (!can_scan) {
-        return false;
-    }
+    std::lock_guard<std::mutex> lock(discovery_mutex);
 
-    cancelScan();
+    auto end = discovered_devices.begin() + discovered_count;
+    auto device = std::find_if(discovered_devices.begin(), end, [&](const DiscoveredDevice &device) {
+        return device.address == address;
+    });
 
-    // BluetoothSerial can call our callback before it has discovered the device name,
-    // and it'll only call us once per device. We'd like a call every change instead.
-    // As we can't easily get to the callbacks without completely replacing BluetoothSerial,
-    // we periodically clear the result set while scanning so every device update is new.
-    bool scanning = SerialBT.discoverAsync([=](BTAdvertisedDevice *advertisedDevice) {
-        if (!advertisedDevice->haveName()) {
+    if (device == end) {
+        if (discovered_count == discovered_devices.size()) {
             return;
         }
 
-        AdvertisedDevice device = {};
-        auto address = advertisedDevice->getAddress().getNative();
-        std::copy(*address, (*address) + sizeof(esp_bd_addr_t), device.address.begin());
-        device.name = advertisedDevice->getName();
-        device.rssi = advertisedDevice->haveRSSI() ? advertisedDevice->getRSSI() : 0;
+        ++discovered_count;
+        *device = {};
+        device->address = address;
+        device->changed = true;
+    }
+
+    if (rssi) {
+        device->rssi = *rssi;
+        if (std::abs(device->rssi - device->reported_rssi) >= BT_SCAN_RSSI_THRESHOLD) {
+            device->changed = true;
+        }
+    }
+
+    // Not every response carries the name, so only a different one counts as a change.
+    if (name_length > 0 && (name_length != device->name_length || memcmp(name, device->name, name_length) != 0)) {
+        std::copy(name, name + name_length, device->name);
+        device->name_length = name_length;
+        device->changed = true;
+    }
+}
 
-        on_device(device);
-    }, SerialBT.MAX_INQ_TIME);
+// Registering this replaces BluetoothSerial's GAP callback, there can only be one, so it
+// also answers the pairing requests that one did, with the same defaults.
+static void gapCallback(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param) {
+    switch (event) {
+        case ESP_BT_GAP_DISC_RES_EVT:
+            onDiscoveryResult(param);
+            break;
+        case ESP_BT_GAP_DISC_STATE_CHANGED_EVT:
+            if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED) {
+                BtCommand command = { BtCommandType::InquiryStopped };
+                xQueueSend(command_queue, &command, 0);
+            }
+            break;
+        case ESP_BT_GAP_PIN_REQ_EVT: {
+            esp_bt_pin_code_t pin_code;
+            uint8_t length = param->pin_req.min_16_digit ? 16 : 4;
+            if (param->pin_req.min_16_digit) {
+                memset(pin_code, '0', sizeof(pin_code));
+            } else {
+                memcpy(pin_code, "1234", length);
+            }
 
-    if (!scanning) {
+            esp_bt_gap_pin_reply(param->pin_req.bda, true, length, pin_code);
+            break;
+        }
+        case ESP_BT_GAP_CFM_REQ_EVT:
+            esp_bt_gap_ssp_confirm_reply(param->cfm_req.bda, true);
+            break;
+        case ESP_BT_GAP_AUTH_CMPL_EVT:
+            Log::info<LogCategory::Bluetooth>("bt authentication %s (%d)\n",
+                (param->auth_cmpl.stat == ESP_BT_STATUS_SUCCESS) ? "complete" : "failed", param->auth_cmpl.stat);
+            break;
+        default:
+            break;
+    }
+}
+
+static bool queueCommand(const BtCommand &command) {
+    if (!command_queue) {
         return false;
     }
 
-    struct BtScanParams {
-        std::function<void(bool canceled)> on_finished;
-    };
+    return xQueueSend(command_queue, &command, 0) == pdTRUE;
+}
 
-    // This is a gross hack in the name of providing a nicer API for the future.
-    xTaskCreateUniversal([](void *pvParameters) {
-        std::unique_ptr<BtScanParams> params(static_cast<BtScanParams *>(pvParameters));
+class BtWorker {
+public:
+    [[noreturn]] void run() {
+        for (;;) {
+            TickType_t wait = portMAX_DELAY;
+            if (scanning) {
+                TickType_t elapsed = xTaskGetTickCount() - scan_poll_start;
+                wait = (elapsed < SCAN_POLL_TICKS) ? (SCAN_POLL_TICKS - elapsed) : 0;
+            }
 
-        bool canceled = false;
-        for (int t = 0; t < ESP_BT_GAP_MAX_INQ_LEN; ++t) {
-            canceled = ulTaskNotifyTake(pdTRUE, SerialBT.INQ_TIME / portTICK_PERIOD_MS) != 0;
-            if (canceled) {
-                break;
+            BtCommand command;
+            if (xQueueReceive(command_queue, &command, wait) != pdTRUE) {
+                pollScan();
+                continue;
             }
 
-            // We have to clear the scan results each poll as it keys on the address and thus won't update.
-            // This will also call it to re-call our callback each update.
-            SerialBT.discoverClear();
+            switch (command.type) {
+                case BtCommandType::Scan:
+                    startScan();
+                    break;
+                case BtCommandType::CancelScan:
+                    stopScan(true);
+                    break;
+                case BtCommandType::Connect:
+                    connect(command.address, command.retry_count);
+                    break;
+                case BtCommandType::Disconnect:
+                    disconnect();
+                    break;
+                case BtCommandType::Closed:
+                    if (connected) {
+                        setConnected(false);
+                    }
+                    break;
+                case BtCommandType::InquiryStopped:
+                    onInquiryStopped();
+                    break;
+            }
         }
+    }
 
-        if (!canceled) {
-            // We don't strictly need to do this, but it clears out the callback.
-            SerialBT.discoverAsyncStop();
-
-            // TODO: We might need to actually check it is the same.
-            scan_task = nullptr;
+private:
+    // Changes are batched up and sent on this often while scanning.
+    static constexpr TickType_t SCAN_POLL_TICKS = pdMS_TO_TICKS(500);
+    // A scan is as long as it always was, but made of shorter inquiries so that each new
+    // one hears from every device again, and we pick up their name and RSSI changes.
+    static constexpr TickType_t SCAN_DURATION_TICKS = pdMS_TO_TICKS(ESP_BT_GAP_MAX_INQ_LEN * 1280);
+    static constexpr uint8_t INQUIRY_LENGTH = 8; // 1.28s units
+
+    void startScan() {
+        stopScan(true);
+
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            on_devices = pending_on_devices;
+            on_scan_finished = pending_on_scan_finished;
         }
 
-        params->on_finished(canceled);
+        // Every scan reports each device afresh.
+        {
+            std::lock_guard<std::mutex> lock(discovery_mutex);
+            discovered_count = 0;
+        }
 
-        vTaskDelete(nullptr);
-    }, "btScanComplete", getArduinoLoopTaskStackSize(), new BtScanParams {
-        on_finished,
-    }, 1, &scan_task, ARDUINO_RUNNING_CORE);
+        scanning = true;
+        scan_start = xTaskGetTickCount();
+        scan_poll_start = scan_start;
 
-    return true;
-}
+        if (!startInquiry()) {
+            scanning = false;
 
-void Bluetooth::cancelScan() {
-    if (!scan_task) {
-        return;
+            if (on_scan_finished) {
+                on_scan_finished(true);
+            }
+        }
     }
 
-    SerialBT.discoverAsyncStop();
+    bool startInquiry() {
+        esp_err_t err = esp_bt_gap_start_discovery(ESP_BT_INQ_MODE_GENERAL_INQUIRY, INQUIRY_LENGTH, 0);
+        if (err != ESP_OK) {
+            Log::warning<LogCategory::Bluetooth>("esp_bt_gap_start_discovery failed: %s\n", esp_err_to_name(err));
+            return false;
+        }
 
-    xTaskNotifyGive(scan_task);
+        inquiry_active = true;
+        return true;
+    }
 
-    scan_task = nullptr;
-}
+    void onInquiryStopped() {
+        inquiry_active = false;
 
-void Bluetooth::connect(std::array<uint8_t, 6> address, std::function<void(bool connected)> on_changed, std::function<void(uint8_t attempt, uint8_t count)> on_attempt, uint8_t retry_count) {
-    // BluetoothSerial doesn't support discovery after having ever attempted to connect.
-    can_scan = false;
+        if (!scanning) {
+            return;
+        }
 
-    cancelScan();
+        if ((xTaskGetTickCount() - scan_start) < SCAN_DURATION_TICKS && startInquiry()) {
+            return;
+        }
 
-    if (connect_task) {
-        xTaskNotifyGive(connect_task);
-        connect_task = nullptr;
+        stopScan(false);
     }
 
-    struct ConnectTaskParams {
-        std::array<uint8_t, 6> address;
-        std::function<void(bool connected)> on_changed;
-        std::function<void(uint8_t attempt, uint8_t count)> on_attempt;
-        uint8_t retry_count;
-    };
+    void pollScan() {
+        if (!scanning) {
+            return;
+        }
 
-    ConnectTaskParams *params = new ConnectTaskParams {
-        address,
-        on_changed,
-        on_attempt,
-        retry_count,
-    };
+        scan_poll_start = xTaskGetTickCount();
+        flushDiscoveredDevices();
 
-    // This is a gross hack in the name of providing a nicer API for the future.
-    xTaskCreateUniversal([](void *pvParameters) {
-        std::unique_ptr<ConnectTaskParams> params(static_cast<ConnectTaskParams *>(pvParameters));
+        // In case the inquiry stopped event was lost, the queue could have been full.
+        if ((scan_poll_start - scan_start) > (SCAN_DURATION_TICKS + pdMS_TO_TICKS(INQUIRY_LENGTH * 1280))) {
+            stopScan(false);
+        }
+    }
 
-        bool connected = false;
-        for (uint8_t i = 0; i < params->retry_count; ++i) {
-            if (params->on_attempt) {
-                params->on_attempt(i + 1, params->retry_count);
-            }
+    void flushDiscoveredDevices() {
+        std::vector<AdvertisedDevice> devices;
 
-            if (SerialBT.connect(params->address.data())) {
-                connected = true;
-                break;
+        {
+            std::lock_guard<std::mutex> lock(discovery_mutex);
+            for (size_t i = 0; i < discovered_count; ++i) {
+                auto &device = discovered_devices[i];
+
+                // Devices that haven't told us their name yet aren't any use to the app.
+                if (!device.changed || device.name_length == 0) {
+                    continue;
+                }
+
+                devices.push_back({ device.address, std::string(device.name, device.name_length), device.rssi });
+                device.reported_rssi = device.rssi;
+                device.changed = false;
             }
         }
 
-        params->on_changed(connected);
+        if (!devices.empty() && on_devices) {
+            on_devices(devices);
+        }
+    }
 
-        if (!connected) {
-            vTaskDelete(nullptr);
+    void stopScan(bool canceled) {
+        if (!scanning) {
             return;
         }
 
-        // No callback for the connection being closed, so we have to poll.
-        bool notified = false;
-        for (;;) {
-            notified = ulTaskNotifyTake(pdTRUE, 1000 / portTICK_PERIOD_MS) != 0;
-            if (notified) {
+        scanning = false;
+
+        if (inquiry_active) {
+            esp_bt_gap_cancel_discovery();
+        }
+
+        if (!canceled) {
+            flushDiscoveredDevices();
+        }
+
+        if (on_scan_finished) {
+            on_scan_finished(canceled);
+        }
+    }
+
+    void connect(const std::array<uint8_t, 6> &address, uint8_t retry_count) {
+        stopScan(true);
+
+        if (connected) {
+            SerialBT.disconnect();
+            setConnected(false);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            on_connection_changed = pending_on_connection_changed;
+            on_connection_attempt = pending_on_connection_attempt;
+        }
+
+        bool success = false;
+        TickType_t backoff = pdMS_TO_TICKS(BT_CONNECT_BACKOFF);
+        for (uint8_t i = 0; i < retry_count; ++i) {
+            // Give up on the retries if we've already been asked to do something else.
+            if (i > 0 ? waitForBackoff(backoff) : isConnectionCommandPending()) {
                 break;
             }
 
-            if (!SerialBT.hasClient()) {
+            if (i > 0) {
+                backoff = std::min<TickType_t>(backoff * 2, pdMS_TO_TICKS(BT_CONNECT_BACKOFF_MAX));
+            }
+
+            if (on_connection_attempt) {
+                on_connection_attempt(i + 1, retry_count);
+            }
+
+            if (attemptConnection(address)) {
+                success = true;
                 break;
             }
         }
 
-        if (!notified) {
-            // TODO: We might need to actually check it is the same.
-            connect_task = nullptr;
+        setConnected(success);
+    }
+
+    bool attemptConnection(const std::array<uint8_t, 6> &address) {
+        std::array<uint8_t, 6> remote_address = address;
+
+        if (cached_channel.channel != 0 && cached_channel.address == address) {
+            if (SerialBT.connect(remote_address.data(), cached_channel.channel)) {
+                return true;
+            }
+
+            // The service may have moved, so look it up again on the next attempt.
+            Log::info<LogCategory::Bluetooth>("connect on cached channel %d failed\n", cached_channel.channel);
+            cached_channel.channel = 0;
+            return false;
         }
 
-        params->on_changed(false);
+        // Look up the channel on its own first. It's a full SDP query, but one that fails fast
+        // when the device is off or out of range (at the controller's 5.12s page timeout, which
+        // the IDF 4.4 API can't change), and then we don't go on to a connect at all.
+        auto channels = SerialBT.getChannels(BTAddress(remote_address.data()));
+        if (channels.empty()) {
+            Log::info<LogCategory::Bluetooth>("device not found, or has no spp service\n");
+            return false;
+        }
 
-        vTaskDelete(nullptr);
-    }, "btConnect", getArduinoLoopTaskStackSize(), params, 1, &connect_task, ARDUINO_RUNNING_CORE);
-}
+        uint8_t channel = channels.begin()->first;
+        if (!SerialBT.connect(remote_address.data(), channel)) {
+            return false;
+        }
 
-void Bluetooth::disconnect() {
-    // This is a gross hack in the name of providing a nicer API for the future.
-    xTaskCreateUniversal([](void *pvParameters) {
+        Log::debug<LogCategory::Bluetooth>("caching spp channel %d\n", channel);
+        cached_channel = { address, channel };
+        return true;
+    }
+
+    void disconnect() {
         SerialBT.disconnect();
 
-        if (connect_task) {
-            xTaskNotifyGive(connect_task);
-            connect_task = nullptr;
+        if (connected) {
+            setConnected(false);
+        }
+    }
+
+    void setConnected(bool value) {
+        connected = value;
+
+        if (on_connection_changed) {
+            on_connection_changed(value);
+        }
+    }
+
+    // Waits out the backoff between attempts, returns true as soon as a connect or disconnect is queued.
+    bool waitForBackoff(TickType_t duration) {
+        TickType_t start = xTaskGetTickCount();
+
+        BtCommand next;
+        if (xQueuePeek(command_queue, &next, duration) != pdTRUE) {
+            return false;
+        }
+
+        if (next.type == BtCommandType::Connect || next.type == BtCommandType::Disconnect) {
+            return true;
+        }
+
+        // Anything else waits behind the connect, so the rest of the backoff is just a delay.
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed < duration) {
+            vTaskDelay(duration - elapsed);
         }
 
-        vTaskDelete(nullptr);
-    }, "btDisconnect", getArduinoLoopTaskStackSize(), nullptr, 1, nullptr, ARDUINO_RUNNING_CORE);
+        return false;
+    }
+
+    bool isConnectionCommandPending() {
+        BtCommand next;
+        if (xQueuePeek(command_queue, &next, 0) != pdTRUE) {
+            return false;
+        }
+
+        return next.type == BtCommandType::Connect || next.type == BtCommandType::Disconnect;
+    }
+
+    bool scanning = false;
+    bool inquiry_active = false;
+    TickType_t scan_start = 0;
+    TickType_t scan_poll_start = 0;
+    std::function<void(const std::vector<AdvertisedDevice> &devices)> on_devices = nullptr;
+    std::function<void(bool canceled)> on_scan_finished = nullptr;
+
+    bool connected = false;
+    std::function<void(bool connected)> on_connection_changed = nullptr;
+    std::function<void(uint8_t attempt, uint8_t count)> on_connection_attempt = nullptr;
+};
+
+static BtWorker worker;
+
+// Called with tx_mutex held, returns true if the command was held back.
+static bool coalesceWrite(const uint8_t *data, size_t length) {
+    // Only lowercase (setter) commands, uppercase ones are queries and always go in order.
+    if (length < 2 || length > sizeof(CoalescedCommand::data) || data[0] < 'a' || data[0] > 'z') {
+        return false;
+    }
+
+    // With coalescing on each write is one command, the letter, its value, then the newline.
+    // The value is binary and can have 0x0A in it, so only the ends say where the frame is.
+    if (data[length - 1] != '\n') {
+        return false;
+    }
+
+    // Nothing waiting on the link, no reason to hold it back.
+    if (coalesced_count == 0 && tx_ring.size() == 0) {
+        return false;
+    }
+
+    CoalescedCommand *slot = nullptr;
+    for (size_t i = 0; i < coalesced_count; ++i) {
+        if (coalesced_commands[i].data[0] == data[0]) {
+            slot = &coalesced_commands[i];
+            Log::debug<LogCategory::Serial>("replaced pending '%c' command\n", data[0]);
+            break;
+        }
+    }
+
+    if (!slot) {
+        if (coalesced_count == coalesced_commands.size()) {
+            return false;
+        }
+
+        slot = &coalesced_commands[coalesced_count++];
+    }
+
+    slot->length = length;
+    std::copy(data, data + length, slot->data);
+
+    return true;
 }
 
-bool Bluetooth::isConnected() {
-    if (SerialBT.hasClient()) {
-        return true;
+// Called with tx_mutex held, moves as many held commands into tx_ring as fit, oldest first.
+static void flushCoalescedWrites() {
+    size_t flushed = 0;
+    while (flushed < coalesced_count) {
+        const auto &command = coalesced_commands[flushed];
+        if (tx_ring.space() < command.length) {
+            break;
+        }
+
+        tx_ring.write(command.data, command.length);
+        ++flushed;
+    }
+
+    std::copy(coalesced_commands.begin() + flushed, coalesced_commands.begin() + coalesced_count, coalesced_commands.begin());
+    coalesced_count -= flushed;
+}
+
+static void updateTxFlow() {
+    size_t queued = tx_ring.capacity() - tx_ring.space();
+
+    bool paused = tx_paused;
+    if (!paused && queued >= TX_HIGH_WATER) {
+        paused = true;
+    } else if (paused && queued <= TX_LOW_WATER) {
+        paused = false;
+    } else {
+        return;
+    }
+
+    if (tx_paused.exchange(paused) == paused) {
+        return;
+    }
+
+    Log::debug<LogCategory::Serial>("serial tx %s with %d bytes queued\n", paused ? "paused" : "resumed", queued);
+
+    if (tx_flow_callback) {
+        tx_flow_callback(paused, tx_ring.space());
+    }
+}
+
+void Bluetooth::init(const std::string &name) {
+    if (!tx_task) {
+        xTaskCreateUniversal([](void *) {
+            for (;;) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+                for (;;) {
+                    const uint8_t *block = nullptr;
+                    size_t length = tx_ring.peek(0, &block);
+                    if (length == 0) {
+                        // The link has caught up, send whatever's been coalesced in the meantime.
+                        std::lock_guard<std::mutex> lock(tx_mutex);
+                        flushCoalescedWrites();
+
+                        length = tx_ring.peek(0, &block);
+                        if (length == 0) {
+                            break;
+                        }
+                    }
+
+                    // This is the call that can block for a long time when the link is congested.
+                    if (isConnected()) {
+                        SerialBT.write(block, length);
+                        Trace::mark(TraceHop::SppWrite);
+                    }
+
+                    tx_ring.consume(length);
+                    updateTxFlow();
+                }
+            }
+        }, "btTx", 4096, nullptr, 2, &tx_task, ARDUINO_RUNNING_CORE);
+    }
+
+    if (!command_queue) {
+        command_queue = xQueueCreate(8, sizeof(BtCommand));
+
+        // Connection attempts block in SerialBT.connect and call back into Ble, which needs a bit of headroom.
+        xTaskCreateUniversal([](void *) {
+            worker.run();
+        }, "btWorker", 4096, nullptr, 1, nullptr, ARDUINO_RUNNING_CORE);
+    }
+
+    SerialBT.register_callback(sppCallback);
+    SerialBT.begin(name.c_str(), true);
+
+    esp_err_t err = esp_bt_gap_register_callback(gapCallback);
+    if (err != ESP_OK) {
+        Log::error<LogCategory::Bluetooth>("esp_bt_gap_register_callback failed: %s\n", esp_err_to_name(err));
+    }
+
+    can_scan = (err == ESP_OK);
+}
+
+void Bluetooth::deinit() {
+    disconnect();
+
+    while (isConnected()) {
+        vTaskDelay(1);
     }
 
-    if (connect_task) {
-        xTaskNotifyGive(connect_task);
-        connect_task = nullptr;
+    can_scan = false;
+    SerialBT.end();
+}
+
+bool Bluetooth::canScan() {
+    return can_scan;
+}
+
+bool Bluetooth::scan(std::function<void(const std::vector<AdvertisedDevice> &devices)> on_devices, std::function<void(bool canceled)> on_finished) {
+    if (!can_scan) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        pending_on_devices = on_devices;
+        pending_on_scan_finished = on_finished;
+    }
+
+    return queueCommand({ BtCommandType::Scan });
+}
+
+void Bluetooth::cancelScan() {
+    queueCommand({ BtCommandType::CancelScan });
+}
+
+void Bluetooth::connect(std::array<uint8_t, 6> address, std::function<void(bool connected)> on_changed, std::function<void(uint8_t attempt, uint8_t count)> on_attempt, uint8_t retry_count) {
+    {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        pending_on_connection_changed = on_changed;
+        pending_on_connection_attempt = on_attempt;
     }
 
-    return false;
+    queueCommand({ BtCommandType::Connect, address, retry_count });
+}
+
+void Bluetooth::disconnect() {
+    queueCommand({ BtCommandType::Disconnect });
+}
+
+bool Bluetooth::isConnected() {
+    return SerialBT.hasClient();
 }
 
-bool Bluetooth::write(const std::vector<uint8_t> &data) {
-    if (!isConnected()) {
+bool Bluetooth::write(const uint8_t *data, size_t length) {
+    if (!isConnected() || !tx_task) {
         return false;
     }
 
-    return SerialBT.write(data.data(), data.size()) != 0;
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+
+        if (tx_coalescing && coalesceWrite(data, length)) {
+            return true;
+        }
+
+        // Anything held back was sent before this, so it has to go first. If some of it still
+        // doesn't fit, this can't go ahead of it and is dropped like any other write without room.
+        flushCoalescedWrites();
+        if (coalesced_count > 0) {
+            return false;
+        }
+
+        // Commands are never split, so if it doesn't all fit it's dropped.
+        if (tx_ring.space() < length) {
+            return false;
+        }
+
+        tx_ring.write(data, length);
+    }
+
+    updateTxFlow();
+    xTaskNotifyGive(tx_task);
+
+    return true;
 }
 
-void Bluetooth::setDataCallback(std::function<void(const std::vector<uint8_t> &data)> callback) {
-    SerialBT.onData([=](const uint8_t *buffer, size_t size) {
-        callback(std::vector(buffer, buffer + size));
-    });
+bool Bluetooth::isTxPaused() {
+    return tx_paused;
+}
+
+size_t Bluetooth::getTxSpace() {
+    return tx_ring.space();
+}
+
+void Bluetooth::setWriteCoalescing(bool enabled) {
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        tx_coalescing = enabled;
+
+        // Nothing new is held back once it's off, but whatever already is still goes out. btTx
+        // moves the rest into the ring as it drains, the same as with coalescing on.
+        if (!enabled) {
+            flushCoalescedWrites();
+        }
+    }
+
+    if (tx_task) {
+        xTaskNotifyGive(tx_task);
+    }
+}
+
+void Bluetooth::setTxFlowCallback(std::function<void(bool paused, size_t space)> callback) {
+    tx_flow_callback = callback;
+}
+
+void Bluetooth::setDataCallback(std::function<void(const uint8_t *data, size_t length)> callback) {
+    // The buffer is only valid for the duration of the callback, so it's passed straight through.
+    SerialBT.onData(callback);
 }
@@ -4,6 +4,7 @@
 #include <functional>
 #include <array>
 #include <optional>
+#include <vector>
 
 struct AdvertisedDevice {
     std::array<uint8_t, 6> address;
@@ -16,11 +17,22 @@ public:
     static void init(const std::string &name);
     static void deinit();
     static bool canScan();
-    static bool scan(std::function<void(const AdvertisedDevice &advertisedDevice)> on_device, std::function<void(bool canceled)> on_finished);
+    // on_devices is called with batches of devices that are new or changed since they were last
+    // reported. Scanning works whether or not there has been a connection since boot.
+    static bool scan(std::function<void(const std::vector<AdvertisedDevice> &devices)> on_devices, std::function<void(bool canceled)> on_finished);
     static void cancelScan();
+    // Attempts are spaced out with an exponential backoff, and the SPP channel found by the first
+    // successful connect is reused (across deep sleep too) so reconnecting skips service discovery.
     static void connect(std::array<uint8_t, 6> address, std::function<void(bool connected)> on_changed, std::function<void(uint8_t attempt, uint8_t count)> on_attempt = nullptr, uint8_t retry_count = 5);
     static void disconnect();
     static bool isConnected();
-    static bool write(const std::vector<uint8_t> &data);
-    static void setDataCallback(std::function<void(const std::vector<uint8_t> &data)> callback);
+    // Queues data for the SPP link without blocking, returns false if not connected or there isn't room for all of it.
+    static bool write(const uint8_t *data, size_t length);
+    // While the link is busy, only keep the newest pending single-command write per (lowercase) command letter.
+    static void setWriteCoalescing(bool enabled);
+    static bool isTxPaused();
+    static size_t getTxSpace();
+    // Called when the TX queue crosses its high-water mark (paused) and drains back to its low-water mark.
+    static void setTxFlowCallback(std::function<void(bool paused, size_t space)> callback);
+    static void setDataCallback(std::function<void(const uint8_t *data, size_t length)> callback);
 };
@@ -1,90 +1,242 @@
 #include "config.h"
 #include "defaults.h"
+#include "log.h"
 
 #include <nvs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
+#include <mutex>
 #include <stdexcept>
 
+// The stored values, std::nullopt where the key isn't set so the defaults can still change with the firmware.
+struct ConfigSnapshot {
+    std::optional<std::string> name;
+    std::optional<uint32_t> pin_code;
+    std::optional<uint32_t> connected_idle_timeout;
+    std::optional<uint32_t> disconnected_idle_timeout;
+    std::optional<std::array<uint8_t, 6>> bt_address;
+    std::optional<std::string> bt_address_name;
+    std::optional<uint32_t> auto_connect;
+};
+
+enum ConfigKey : uint32_t {
+    CONFIG_KEY_NAME = 1 << 0,
+    CONFIG_KEY_PIN_CODE = 1 << 1,
+    CONFIG_KEY_CONNECTED_IDLE_TIMEOUT = 1 << 2,
+    CONFIG_KEY_DISCONNECTED_IDLE_TIMEOUT = 1 << 3,
+    CONFIG_KEY_BT_ADDRESS = 1 << 4,
+    CONFIG_KEY_BT_ADDRESS_NAME = 1 << 5,
+    CONFIG_KEY_AUTO_CONNECT = 1 << 6,
+};
+
+static std::mutex snapshot_mutex;
+static ConfigSnapshot snapshot;
+static uint32_t dirty_keys = 0;
+
+// Commits are serialized separately so the snapshot is never locked during a flash write.
+static std::mutex commit_mutex;
+static TaskHandle_t commit_task = nullptr;
+
+void Config::init() {
+    ConfigSnapshot loaded;
+    loaded.name = getString("name");
+    loaded.pin_code = getUint32("pin-code");
+    loaded.connected_idle_timeout = getUint32("conn-timeout");
+    loaded.disconnected_idle_timeout = getUint32("disconn-timeout");
+    loaded.bt_address = getAddress("bt-address");
+    loaded.bt_address_name = getString("bt-addr-name");
+    loaded.auto_connect = getUint32("auto-connect");
+
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot = loaded;
+        dirty_keys = 0;
+    }
+
+    if (commit_task) {
+        return;
+    }
+
+    xTaskCreatePinnedToCore([](void *) {
+        for (;;) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            // Keep pushing the commit back while writes are still arriving.
+            while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_COMMIT_DELAY)) != 0) {
+                // Nothing to do.
+            }
+
+            try {
+                commit();
+            } catch (const std::exception &e) {
+                Log::error<LogCategory::Config>("config commit failed: %s\n", e.what());
+            }
+        }
+    }, "configCommit", 4096, nullptr, 1, &commit_task, tskNO_AFFINITY);
+}
+
+void Config::commit() {
+    std::lock_guard<std::mutex> commit_lock(commit_mutex);
+
+    ConfigSnapshot pending;
+    uint32_t keys;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        pending = snapshot;
+        keys = dirty_keys;
+        dirty_keys = 0;
+    }
+
+    if (keys == 0) {
+        return;
+    }
+
+    Log::debug<LogCategory::Config>("committing config changes: %02x\n", keys);
+
+    try {
+        if (keys & CONFIG_KEY_NAME) {
+            setString("name", pending.name);
+        }
+
+        if (keys & CONFIG_KEY_PIN_CODE) {
+            setUint32("pin-code", pending.pin_code);
+        }
+
+        if (keys & CONFIG_KEY_CONNECTED_IDLE_TIMEOUT) {
+            setUint32("conn-timeout", pending.connected_idle_timeout);
+        }
+
+        if (keys & CONFIG_KEY_DISCONNECTED_IDLE_TIMEOUT) {
+            setUint32("disconn-timeout", pending.disconnected_idle_timeout);
+        }
+
+        if (keys & CONFIG_KEY_BT_ADDRESS) {
+            setAddress("bt-address", pending.bt_address);
+        }
+
+        if (keys & CONFIG_KEY_BT_ADDRESS_NAME) {
+            setString("bt-addr-name", pending.bt_address_name);
+        }
+
+        if (keys & CONFIG_KEY_AUTO_CONNECT) {
+            setUint32("auto-connect", pending.auto_connect);
+        }
+
+        esp_err_t err = nvs_commit(ensureInitialized());
+        if (err != ESP_OK) {
+            throwError("nvs_commit", err);
+        }
+    } catch (...) {
+        // Leave them dirty so the next commit retries.
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        dirty_keys |= keys;
+        throw;
+    }
+}
+
 std::string Config::getName() {
-    return getString("name").value_or(DEFAULT_NAME);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.name.value_or(DEFAULT_NAME);
 }
 
 void Config::setName(const std::string &name) {
-    setString("name", name);
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.name = name;
+    }
+
+    markDirty(CONFIG_KEY_NAME);
 }
 
 uint32_t Config::getPinCode() {
-    return getUint32("pin-code").value_or(DEFAULT_PIN);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.pin_code.value_or(DEFAULT_PIN);
 }
 
 void Config::setPinCode(uint32_t pin_code) {
-    setUint32("pin-code", pin_code);
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.pin_code = pin_code;
+    }
+
+    markDirty(CONFIG_KEY_PIN_CODE);
 }
 
 uint32_t Config::getConnectedIdleTimeout() {
-    return getUint32("conn-timeout").value_or(DEFAULT_CONNECTED_IDLE_TIME);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.connected_idle_timeout.value_or(DEFAULT_CONNECTED_IDLE_TIME);
 }
 
 void Config::setConnectedIdleTimeout(uint32_t timeout) {
-    setUint32("conn-timeout", timeout);
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.connected_idle_timeout = timeout;
+    }
+
+    markDirty(CONFIG_KEY_CONNECTED_IDLE_TIMEOUT);
 }
 
 uint32_t Config::getDisconnectedIdleTimeout() {
-    return getUint32("disconn-timeout").value_or(DEFAULT_DISCONNECTED_IDLE_TIME);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.disconnected_idle_timeout.value_or(DEFAULT_DISCONNECTED_IDLE_TIME);
 }
 
 void Config::setDisconnectedIdleTimeout(uint32_t timeout) {
-    setUint32("disconn-timeout", timeout);
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.disconnected_idle_timeout = timeout;
+    }
+
+    markDirty(CONFIG_KEY_DISCONNECTED_IDLE_TIMEOUT);
 }
 
 std::optional<std::array<uint8_t, 6>> Config::getBtAddress() {
-    nvs_handle_t handle = ensureInitialized();
-
-    std::array<uint8_t, 6> value = {0};
-    size_t length = value.size();
-    esp_err_t err = nvs_get_blob(handle, "bt-address", value.data(), &length);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        throwError("nvs_get_blob", err);
-    }
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.bt_address;
+}
 
-    if (err == ESP_ERR_NVS_NOT_FOUND) {
-        return std::nullopt;
+void Config::setBtAddress(const std::optional<std::array<uint8_t, 6>> &bt_address) {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.bt_address = bt_address;
     }
 
-    return value;
+    markDirty(CONFIG_KEY_BT_ADDRESS);
 }
 
-void Config::setBtAddress(const std::optional<std::array<uint8_t, 6>> &bt_address) {
-    nvs_handle_t handle = ensureInitialized();
+std::optional<std::string> Config::getBtAddressName() {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.bt_address_name;
+}
 
-    esp_err_t err;
-    if (bt_address) {
-        err = nvs_set_blob(handle, "bt-address", bt_address->data(), bt_address->size());
-        if (err != ESP_OK) {
-            throwError("nvs_set_blob", err);
-        }
-    } else {
-        err = nvs_erase_key(handle, "bt-address");
-        if (err != ESP_OK) {
-            throwError("nvs_erase_key", err);
-        }
+void Config::setBtAddressName(const std::optional<std::string> &name) {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.bt_address_name = name;
     }
 
-    err = nvs_commit(handle);
-    if (err != ESP_OK) {
-        throwError("nvs_commit", err);
-    }
+    markDirty(CONFIG_KEY_BT_ADDRESS_NAME);
 }
 
-std::optional<std::string> Config::getBtAddressName() {
-    return getString("bt-addr-name");
+bool Config::getAutoConnect() {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot.auto_connect.value_or(DEFAULT_AUTO_CONNECT) != 0;
 }
 
-void Config::setBtAddressName(const std::optional<std::string> &name) {
-    setString("bt-addr-name", name);
+void Config::setAutoConnect(bool auto_connect) {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snapshot.auto_connect = auto_connect;
+    }
+
+    markDirty(CONFIG_KEY_AUTO_CONNECT);
 }
 
+// Not deferred, this is always followed by a restart.
 void Config::reset() {
+    std::lock_guard<std::mutex> commit_lock(commit_mutex);
+
     nvs_handle_t handle = ensureInitialized();
 
     esp_err_t err = nvs_erase_all(handle);
@@ -96,6 +248,10 @@ void Config::reset() {
     if (err != ESP_OK) {
         throwError("nvs_commit", err);
     }
+
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    snapshot = {};
+    dirty_keys = 0;
 }
 
 nvs_handle_t Config::ensureInitialized() {
@@ -112,6 +268,17 @@ nvs_handle_t Config::ensureInitialized() {
     return handle;
 }
 
+void Config::markDirty(uint32_t keys) {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        dirty_keys |= keys;
+    }
+
+    if (commit_task) {
+        xTaskNotifyGive(commit_task);
+    }
+}
+
 void Config::throwError(const std::string &label, esp_err_t err) {
     const char *name = esp_err_to_name(err);
 
@@ -145,15 +312,10 @@ void Config::setUint32(const char *key, const std::optional<uint32_t> &value) {
         }
     } else {
         err = nvs_erase_key(handle, key);
-        if (err != ESP_OK) {
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
             throwError("nvs_erase_key", err);
         }
     }
-
-    err = nvs_commit(handle);
-    if (err != ESP_OK) {
-        throwError("nvs_commit", err);
-    }
 }
 
 std::optional<std::string> Config::getString(const char *key) {
@@ -192,13 +354,43 @@ void Config::setString(const char *key, const std::optional<std::string> &value)
         }
     } else {
         err = nvs_erase_key(handle, key);
-        if (err != ESP_OK) {
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
             throwError("nvs_erase_key", err);
         }
     }
 
-    err = nvs_commit(handle);
-    if (err != ESP_OK) {
-        throwError("nvs_commit", err);
+}
+
+std::optional<std::array<uint8_t, 6>> Config::getAddress(const char *key) {
+    nvs_handle_t handle = ensureInitialized();
+
+    std::array<uint8_t, 6> value = {0};
+    size_t length = value.size();
+    esp_err_t err = nvs_get_blob(handle, key, value.data(), &length);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        throwError("nvs_get_blob", err);
+    }
+
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return std::nullopt;
+    }
+
+    return value;
+}
+
+void Config::setAddress(const char *key, const std::optional<std::array<uint8_t, 6>> &value) {
+    nvs_handle_t handle = ensureInitialized();
+
+    esp_err_t err;
+    if (value) {
+        err = nvs_set_blob(handle, key, value->data(), value->size());
+        if (err != ESP_OK) {
+            throwError("nvs_set_blob", err);
+        }
+    } else {
+        err = nvs_erase_key(handle, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            throwError("nvs_erase_key", err);
+        }
     }
 }
@@ -6,8 +6,16 @@
 #include <array>
 #include <optional>
 
+// Settings are loaded from NVS once by init() and served from RAM after that.
+// Setters only update the cached copy and mark the key dirty, the configCommit
+// task then writes everything that changed in a single NVS commit once writes
+// have been quiet for CONFIG_COMMIT_DELAY, or commit() can be called to flush
+// immediately (e.g. before sleeping).
 class Config {
 public:
+    static void init();
+    static void commit();
+
     static std::string getName();
     static void setName(const std::string &name);
 
@@ -26,13 +34,19 @@ public:
     static std::optional<std::string> getBtAddressName();
     static void setBtAddressName(const std::optional<std::string> &name);
 
+    static bool getAutoConnect();
+    static void setAutoConnect(bool auto_connect);
+
     static void reset();
 
 private:
     static uint32_t ensureInitialized();
+    static void markDirty(uint32_t keys);
     static void throwError(const std::string &label, esp_err_t err);
     static std::optional<uint32_t> getUint32(const char *key);
     static void setUint32(const char *key, const std::optional<uint32_t> &value);
     static std::optional<std::string> getString(const char *key);
     static void setString(const char *key, const std::optional<std::string> &value);
+    static std::optional<std::array<uint8_t, 6>> getAddress(const char *key);
+    static void setAddress(const char *key, const std::optional<std::array<uint8_t, 6>> &value);
 };
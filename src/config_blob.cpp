@@ -0,0 +1,156 @@
+#include "config_blob.h"
+
+#include <algorithm>
+
+static void appendRecord(std::vector<uint8_t> &blob, uint8_t tag, const uint8_t *value, size_t length) {
+    length = std::min<size_t>(length, UINT8_MAX);
+
+    blob.push_back(tag);
+    blob.push_back(length);
+    blob.insert(blob.end(), value, value + length);
+}
+
+static void appendString(std::vector<uint8_t> &blob, uint8_t tag, const std::string &value) {
+    appendRecord(blob, tag, reinterpret_cast<const uint8_t *>(value.data()), value.size());
+}
+
+static void appendUint32(std::vector<uint8_t> &blob, uint8_t tag, uint32_t value) {
+    uint8_t bytes[] = {
+        (uint8_t)(value & 0xFF),
+        (uint8_t)((value >> 8) & 0xFF),
+        (uint8_t)((value >> 16) & 0xFF),
+        (uint8_t)((value >> 24) & 0xFF),
+    };
+
+    appendRecord(blob, tag, bytes, sizeof(bytes));
+}
+
+static uint32_t readUint32(const uint8_t *data) {
+    return ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[1] << 8) | data[0];
+}
+
+std::vector<uint8_t> ConfigBlob::encode() const {
+    std::vector<uint8_t> blob;
+    blob.reserve(64);
+    blob.push_back(VERSION);
+
+    if (name) {
+        appendString(blob, TAG_NAME, *name);
+    }
+
+    if (pin_code) {
+        appendUint32(blob, TAG_PIN_CODE, *pin_code);
+    }
+
+    if (bt_address) {
+        appendRecord(blob, TAG_BT_ADDRESS, bt_address->data(), bt_address->size());
+    } else if (clear_bt_address) {
+        appendRecord(blob, TAG_BT_ADDRESS, nullptr, 0);
+    }
+
+    if (bt_address_name) {
+        appendString(blob, TAG_BT_ADDRESS_NAME, *bt_address_name);
+    }
+
+    if (connected_idle_timeout) {
+        appendUint32(blob, TAG_CONNECTED_IDLE_TIMEOUT, *connected_idle_timeout);
+    }
+
+    if (disconnected_idle_timeout) {
+        appendUint32(blob, TAG_DISCONNECTED_IDLE_TIMEOUT, *disconnected_idle_timeout);
+    }
+
+    if (auto_connect) {
+        uint8_t value = *auto_connect ? 1 : 0;
+        appendRecord(blob, TAG_AUTO_CONNECT, &value, sizeof(value));
+    }
+
+    return blob;
+}
+
+std::optional<ConfigBlob> ConfigBlob::decode(const uint8_t *data, size_t length) {
+    if (length < 1 || data[0] != VERSION) {
+        return std::nullopt;
+    }
+
+    ConfigBlob blob;
+
+    size_t offset = 1;
+    while (offset < length) {
+        if ((length - offset) < 2) {
+            return std::nullopt;
+        }
+
+        uint8_t tag = data[offset];
+        uint8_t value_length = data[offset + 1];
+        offset += 2;
+
+        if ((length - offset) < value_length) {
+            return std::nullopt;
+        }
+
+        const uint8_t *value = data + offset;
+        offset += value_length;
+
+        switch (tag) {
+            case TAG_NAME:
+                if (value_length == 0) {
+                    return std::nullopt;
+                }
+
+                blob.name = std::string(reinterpret_cast<const char *>(value), value_length);
+                break;
+            case TAG_PIN_CODE:
+                if (value_length != 4 || readUint32(value) > 999999) {
+                    return std::nullopt;
+                }
+
+                blob.pin_code = readUint32(value);
+                break;
+            case TAG_BT_ADDRESS:
+                if (value_length == 0) {
+                    blob.bt_address = std::nullopt;
+                    blob.clear_bt_address = true;
+                    break;
+                }
+
+                if (value_length != 6) {
+                    return std::nullopt;
+                }
+
+                blob.bt_address.emplace();
+                std::copy(value, value + value_length, blob.bt_address->begin());
+                blob.clear_bt_address = false;
+                break;
+            case TAG_BT_ADDRESS_NAME:
+                blob.bt_address_name = std::string(reinterpret_cast<const char *>(value), value_length);
+                break;
+            case TAG_CONNECTED_IDLE_TIMEOUT:
+                if (value_length != 4) {
+                    return std::nullopt;
+                }
+
+                blob.connected_idle_timeout = readUint32(value);
+                break;
+            case TAG_DISCONNECTED_IDLE_TIMEOUT:
+                if (value_length != 4) {
+                    return std::nullopt;
+                }
+
+                blob.disconnected_idle_timeout = readUint32(value);
+                break;
+            case TAG_AUTO_CONNECT:
+                if (value_length != 1 || value[0] > 1) {
+                    return std::nullopt;
+                }
+
+                blob.auto_connect = value[0] != 0;
+                break;
+            default:
+                // Newer fields this firmware doesn't know about.
+                break;
+        }
+    }
+
+    return blob;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Versioned TLV encoding of the whole Config surface, so it can be read or
+// written in a single GATT operation. The layout is a u8 version followed by
+// any number of [u8 tag][u8 length][value] records, integers little endian.
+// Fields that are absent are left untouched on write, unknown tags are skipped.
+struct ConfigBlob {
+    static constexpr uint8_t VERSION = 1;
+
+    enum Tag : uint8_t {
+        TAG_NAME = 0x01,                      // string
+        TAG_PIN_CODE = 0x02,                  // u32, write only
+        TAG_BT_ADDRESS = 0x03,                // u8[6], or empty to clear the address and name. A new
+                                              // address without TAG_BT_ADDRESS_NAME clears the name too
+        TAG_BT_ADDRESS_NAME = 0x04,           // string
+        TAG_CONNECTED_IDLE_TIMEOUT = 0x05,    // u32 seconds
+        TAG_DISCONNECTED_IDLE_TIMEOUT = 0x06, // u32 seconds
+        TAG_AUTO_CONNECT = 0x07,              // u8 0 or 1, connect to the bt address on boot
+    };
+
+    std::optional<std::string> name;
+    std::optional<uint32_t> pin_code;
+    std::optional<std::array<uint8_t, 6>> bt_address;
+    bool clear_bt_address = false;
+    std::optional<std::string> bt_address_name;
+    std::optional<uint32_t> connected_idle_timeout;
+    std::optional<uint32_t> disconnected_idle_timeout;
+    std::optional<bool> auto_connect;
+
+    std::vector<uint8_t> encode() const;
+
+    // Returns std::nullopt if the blob is malformed or any value is out of range,
+    // the whole blob is validated before anything is returned.
+    static std::optional<ConfigBlob> decode(const uint8_t *data, size_t length);
+};
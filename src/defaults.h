@@ -22,6 +22,95 @@
 #define DEFAULT_DISCONNECTED_IDLE_TIME 1800
 #endif
 
+// Connect to the saved BT address straight away on boot, rather than waiting to be asked.
+#ifndef DEFAULT_AUTO_CONNECT
+#define DEFAULT_AUTO_CONNECT false
+#endif
+
+// How long config writes have to be quiet for (in ms) before they're committed to flash.
+#ifndef CONFIG_COMMIT_DELAY
+#define CONFIG_COMMIT_DELAY 2000
+#endif
+
+// Log levels: 1 error, 2 warning, 3 info, 4 debug, 5 verbose.
+// Anything above LOG_MAX_LEVEL is compiled out, DEFAULT_LOG_LEVEL applies at boot.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 4
+#endif
+
+#ifndef DEFAULT_LOG_LEVEL
+#define DEFAULT_LOG_LEVEL 3
+#endif
+
+// Seconds without serial / OTA traffic before we ask for the power saving connection parameters.
+#ifndef BLE_CONNECTION_IDLE_DELAY
+#define BLE_CONNECTION_IDLE_DELAY 5
+#endif
+
+// How many BLE clients can be connected at once. The controller allows 3 by default
+// (CONFIG_BTDM_CTRL_BLE_MAX_CONN), so raising this past that needs the sdkconfig changed too.
+#ifndef BLE_MAX_CONNECTIONS
+#define BLE_MAX_CONNECTIONS 2
+#endif
+
+// Timestamps the serial path for the latency histograms, see trace.h.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Battery voltage (in mV) below which we deep sleep, and how far above that it has to be
+// to boot again, so a battery that recovers a little once unloaded doesn't boot loop.
+#ifndef BATTERY_CUTOFF_VOLTAGE
+#define BATTERY_CUTOFF_VOLTAGE 3100
+#endif
+
+#ifndef BATTERY_CUTOFF_HYSTERESIS
+#define BATTERY_CUTOFF_HYSTERESIS 100
+#endif
+
+// Seconds between battery readings, the reported level is filtered over several of them.
+#ifndef BATTERY_READING_INTERVAL
+#define BATTERY_READING_INTERVAL 10
+#endif
+
+// Battery level (%) at or below which the LED shows the low battery pattern.
+#ifndef LED_LOW_BATTERY_LEVEL
+#define LED_LOW_BATTERY_LEVEL 10
+#endif
+
+// The backoff (in ms) between SPP connection attempts, doubling from the first value up to the second.
+#ifndef BT_CONNECT_BACKOFF
+#define BT_CONNECT_BACKOFF 500
+#endif
+
+#ifndef BT_CONNECT_BACKOFF_MAX
+#define BT_CONNECT_BACKOFF_MAX 8000
+#endif
+
+// How far (in dB) a discovered device's RSSI has to move before it's reported again.
+#ifndef BT_SCAN_RSSI_THRESHOLD
+#define BT_SCAN_RSSI_THRESHOLD 6
+#endif
+
+// Seconds between heap and task samples, see diagnostics.h. The task table has room for
+// DIAGNOSTICS_MAX_TASKS, and a task is warned about once its free stack drops below
+// DIAGNOSTICS_STACK_WARNING bytes.
+#ifndef DIAGNOSTICS_SAMPLE_INTERVAL
+#define DIAGNOSTICS_SAMPLE_INTERVAL 60
+#endif
+
+#ifndef DIAGNOSTICS_MAX_TASKS
+#define DIAGNOSTICS_MAX_TASKS 32
+#endif
+
+#ifndef DIAGNOSTICS_STACK_WARNING
+#define DIAGNOSTICS_STACK_WARNING 512
+#endif
+
+#ifndef DEFAULT_SERIAL_BATCH_DEADLINE
+#define DEFAULT_SERIAL_BATCH_DEADLINE 3
+#endif
+
 #if (defined OTA_PUBLIC_KEY_X) && (EXPAND(OTA_PUBLIC_KEY_X) == 1)
 #undef OTA_PUBLIC_KEY_X
 #endif
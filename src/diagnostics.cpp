@@ -0,0 +1,157 @@
+#include "diagnostics.h"
+
+#include "defaults.h"
+#include "log.h"
+
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+static constexpr uint8_t SNAPSHOT_VERSION = 1;
+static constexpr size_t SNAPSHOT_HEADER_SIZE = 1 + 4 + 4 + 4 + 4 + 1;
+static constexpr size_t TASK_RECORD_HEADER_SIZE = 1 + 2 + 1 + 1 + 1;
+// The largest attribute value a client can read.
+static constexpr size_t MAX_SNAPSHOT_SIZE = 512;
+
+static constexpr uint8_t CORE_ANY = 0xFF;
+static constexpr uint8_t CPU_UNKNOWN = 0xFF;
+
+static esp_timer_handle_t sample_timer = nullptr;
+static std::mutex snapshot_mutex;
+static std::vector<uint8_t> snapshot;
+
+#if configUSE_TRACE_FACILITY
+// What we knew about each task at the previous sample, matched up by task number.
+struct TaskHistory {
+    UBaseType_t number;
+    uint32_t run_time;
+    bool warned;
+};
+
+// Only touched from sample(), static to keep them off the esp_timer task's small stack.
+static TaskStatus_t task_status[DIAGNOSTICS_MAX_TASKS];
+static TaskHistory task_history[DIAGNOSTICS_MAX_TASKS];
+static TaskHistory next_task_history[DIAGNOSTICS_MAX_TASKS];
+static size_t task_history_count = 0;
+static uint32_t last_total_run_time = 0;
+#endif
+
+static void put(std::vector<uint8_t> &value, uint32_t field, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        value.push_back((field >> (i * 8)) & 0xFF);
+    }
+}
+
+void Diagnostics::init() {
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = [](void *) {
+        Diagnostics::sample();
+    };
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "diagnostics";
+    esp_timer_create(&timer_args, &sample_timer);
+
+    sample();
+    esp_timer_start_periodic(sample_timer, DIAGNOSTICS_SAMPLE_INTERVAL * 1000000ull);
+}
+
+std::vector<uint8_t> Diagnostics::getSnapshot() {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot;
+}
+
+void Diagnostics::sample() {
+    std::vector<uint8_t> value;
+    value.reserve(MAX_SNAPSHOT_SIZE);
+
+    uint32_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    uint32_t minimum_free_heap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    uint32_t largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    value.push_back(SNAPSHOT_VERSION);
+    put(value, esp_timer_get_time() / 1000000, 4);
+    put(value, free_heap, 4);
+    put(value, minimum_free_heap, 4);
+    put(value, largest_free_block, 4);
+    value.push_back(0); // task count, filled in below
+
+    Log::debug<LogCategory::General>("heap free %u, minimum %u, largest block %u\n", free_heap, minimum_free_heap, largest_free_block);
+
+#if configUSE_TRACE_FACILITY
+    uint32_t total_run_time = 0;
+    size_t task_count = uxTaskGetSystemState(task_status, DIAGNOSTICS_MAX_TASKS, &total_run_time);
+    if (task_count == 0) {
+        // More tasks than we have room for, uxTaskGetSystemState doesn't fill in a partial list.
+        Log::warning<LogCategory::General>("more than %d tasks, increase DIAGNOSTICS_MAX_TASKS\n", DIAGNOSTICS_MAX_TASKS);
+    }
+
+    std::sort(task_status, task_status + task_count, [](const TaskStatus_t &a, const TaskStatus_t &b) {
+        return a.usStackHighWaterMark < b.usStackHighWaterMark;
+    });
+
+    // The run time counters are per core, so between them they add up to the elapsed time on each core.
+    uint32_t elapsed_run_time = (total_run_time - last_total_run_time) * portNUM_PROCESSORS;
+    last_total_run_time = total_run_time;
+
+    uint8_t records = 0;
+    for (size_t i = 0; i < task_count; ++i) {
+        const TaskStatus_t &status = task_status[i];
+
+        TaskHistory *previous = std::find_if(task_history, task_history + task_history_count, [&](const TaskHistory &entry) {
+            return entry.number == status.xTaskNumber;
+        });
+        bool known = previous != (task_history + task_history_count);
+
+        // On the ESP32 the high water mark is in bytes rather than words.
+        uint32_t stack_free = status.usStackHighWaterMark;
+        bool warned = known && previous->warned;
+        if (!warned && stack_free < DIAGNOSTICS_STACK_WARNING) {
+            Log::warning<LogCategory::General>("task %s is down to %u bytes of stack\n", status.pcTaskName, stack_free);
+            warned = true;
+        }
+
+        next_task_history[i] = { status.xTaskNumber, status.ulRunTimeCounter, warned };
+
+        uint8_t cpu = CPU_UNKNOWN;
+#if configGENERATE_RUN_TIME_STATS
+        if (known && elapsed_run_time > 0) {
+            uint64_t task_run_time = status.ulRunTimeCounter - previous->run_time;
+            cpu = std::min<uint64_t>((task_run_time * 100) / elapsed_run_time, 100);
+        }
+#endif
+
+        uint8_t core = CORE_ANY;
+#if configTASKLIST_INCLUDE_COREID
+        if (status.xCoreID >= 0 && status.xCoreID < portNUM_PROCESSORS) {
+            core = status.xCoreID;
+        }
+#endif
+
+        size_t name_length = strnlen(status.pcTaskName, configMAX_TASK_NAME_LEN);
+        if ((value.size() + TASK_RECORD_HEADER_SIZE + name_length) > MAX_SNAPSHOT_SIZE) {
+            continue;
+        }
+
+        value.push_back(name_length);
+        value.insert(value.end(), status.pcTaskName, status.pcTaskName + name_length);
+        put(value, std::min<uint32_t>(stack_free, UINT16_MAX), 2);
+        value.push_back(std::min<UBaseType_t>(status.uxCurrentPriority, UINT8_MAX));
+        value.push_back(core);
+        value.push_back(cpu);
+        ++records;
+    }
+
+    std::copy(next_task_history, next_task_history + task_count, task_history);
+    task_history_count = task_count;
+
+    value[SNAPSHOT_HEADER_SIZE - 1] = records;
+#endif
+
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    snapshot = std::move(value);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Heap and per task stack / CPU usage, sampled every DIAGNOSTICS_SAMPLE_INTERVAL seconds so
+// stacks can be sized from what the tasks actually use in the field.
+//
+// The snapshot is little endian:
+//   u8 version (1) + u32 uptime (s) + u32 free heap + u32 minimum free heap + u32 largest free block
+//   + u8 task count + per task [u8 name length][name][u16 stack high water (bytes)][u8 priority]
+//   [u8 core, 0xFF for either][u8 cpu % since the previous sample, 0xFF if not available]
+// Tasks are ordered by how little stack they have left, and cut off to fit in a GATT attribute.
+class Diagnostics {
+public:
+    // Takes the first sample straight away, so there's always a snapshot to read.
+    static void init();
+
+    // The most recent snapshot.
+    static std::vector<uint8_t> getSnapshot();
+
+private:
+    static void sample();
+};
@@ -0,0 +1,34 @@
+#include "envelope.h"
+
+void EnvelopeHeader::encode(uint8_t *out) const {
+    out[0] = length & 0xFF;
+    out[1] = (length >> 8) & 0xFF;
+    out[2] = sequence & 0xFF;
+    out[3] = (sequence >> 8) & 0xFF;
+    out[4] = ack & 0xFF;
+    out[5] = (ack >> 8) & 0xFF;
+    out[6] = flags;
+    out[7] = timestamp & 0xFF;
+    out[8] = (timestamp >> 8) & 0xFF;
+    out[9] = (timestamp >> 16) & 0xFF;
+    out[10] = (timestamp >> 24) & 0xFF;
+}
+
+std::optional<EnvelopeHeader> EnvelopeHeader::decode(const uint8_t *data, size_t length) {
+    if (length < SIZE) {
+        return std::nullopt;
+    }
+
+    EnvelopeHeader header = {};
+    header.length = (data[1] << 8) | data[0];
+    header.sequence = (data[3] << 8) | data[2];
+    header.ack = (data[5] << 8) | data[4];
+    header.flags = data[6];
+    header.timestamp = ((uint32_t)data[10] << 24) | ((uint32_t)data[9] << 16) | ((uint32_t)data[8] << 8) | data[7];
+
+    if (header.length != (length - SIZE)) {
+        return std::nullopt;
+    }
+
+    return header;
+}
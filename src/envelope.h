@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Binary framing for the serial data characteristic, opted in to through the serial mode.
+// Every notification and write is exactly one envelope, an 11 byte header followed by the
+// payload, integers little endian:
+//     u16 payload length + u16 sequence + u16 ack + u8 flags + u32 timestamp (us)
+// Notifications carry [u16 length][frame] records, one per X1 frame, and ack the sequence of
+// the last write that made it into the SPP queue. A frame too long for one envelope is split
+// across several, with FLAG_CONTINUED set on each envelope whose last record carries on in the
+// next. Writes carry the raw bytes for the SPP link, their flags and timestamp are ignored.
+struct EnvelopeHeader {
+    static constexpr size_t SIZE = 2 + 2 + 2 + 1 + 4;
+
+    enum Flag : uint8_t {
+        FLAG_CONTINUED = 0x01,  // the last record's frame continues in the next envelope
+        FLAG_RX_DROPPED = 0x02, // SPP data was lost since the previous envelope, our receive buffer was full
+        FLAG_TX_DROPPED = 0x04, // a write was dropped or out of sequence since the previous envelope
+    };
+
+    uint16_t length;
+    uint16_t sequence;
+    uint16_t ack;
+    uint8_t flags;
+    uint32_t timestamp;
+
+    // Writes SIZE bytes.
+    void encode(uint8_t *out) const;
+
+    // Returns std::nullopt unless the data is exactly one envelope, header and payload.
+    static std::optional<EnvelopeHeader> decode(const uint8_t *data, size_t length);
+};
+
+// Packs frames into envelopes no larger than the limit, without allocating.
+// Capacity is the largest envelope that can ever be built, the limit can be lowered per envelope.
+template<size_t Capacity>
+class EnvelopePacker {
+public:
+    static constexpr size_t RECORD_HEADER_SIZE = 2;
+
+    static_assert(Capacity > EnvelopeHeader::SIZE + RECORD_HEADER_SIZE, "envelope capacity must fit at least one byte of payload");
+
+    // Only takes effect from the next envelope, so a partly built one is never cut short.
+    void setLimit(size_t limit) {
+        next_limit = std::clamp<size_t>(limit, EnvelopeHeader::SIZE + RECORD_HEADER_SIZE + 1, Capacity);
+        if (empty()) {
+            this->limit = next_limit;
+        }
+    }
+
+    bool empty() const {
+        return length == EnvelopeHeader::SIZE;
+    }
+
+    // Whether another frame would get at least one byte in, or should go in the next envelope.
+    bool full() const {
+        return (length + RECORD_HEADER_SIZE) >= limit;
+    }
+
+    // Adds as much of the frame as fits as a record and returns how many bytes were taken.
+    // Anything less than the whole frame means the envelope is full, and the rest of the frame
+    // should be appended again once it's been sent.
+    size_t append(const uint8_t *frame, size_t frame_length) {
+        if (full()) {
+            return 0;
+        }
+
+        size_t taken = std::min(frame_length, limit - length - RECORD_HEADER_SIZE);
+
+        buffer[length] = taken & 0xFF;
+        buffer[length + 1] = (taken >> 8) & 0xFF;
+        std::copy(frame, frame + taken, buffer + length + RECORD_HEADER_SIZE);
+        length += RECORD_HEADER_SIZE + taken;
+
+        continued = taken < frame_length;
+
+        return taken;
+    }
+
+    // Fills in the header and passes the envelope to on_envelope(data, length), then starts the next one.
+    template<typename Callback>
+    void finish(uint16_t sequence, uint16_t ack, uint8_t flags, uint32_t timestamp, Callback &&on_envelope) {
+        EnvelopeHeader header = {};
+        header.length = length - EnvelopeHeader::SIZE;
+        header.sequence = sequence;
+        header.ack = ack;
+        header.flags = flags | (continued ? EnvelopeHeader::FLAG_CONTINUED : 0);
+        header.timestamp = timestamp;
+        header.encode(buffer);
+
+        on_envelope(static_cast<const uint8_t *>(buffer), length);
+
+        length = EnvelopeHeader::SIZE;
+        limit = next_limit;
+        continued = false;
+    }
+
+private:
+    uint8_t buffer[Capacity];
+    size_t length = EnvelopeHeader::SIZE;
+    size_t limit = Capacity;
+    size_t next_limit = Capacity;
+    bool continued = false;
+};
@@ -0,0 +1,40 @@
+#include "framer.h"
+
+#include <cstring>
+
+const uint8_t *findByte(const uint8_t *data, size_t length, uint8_t value) {
+    const uint8_t *end = data + length;
+
+    while (data < end && (reinterpret_cast<uintptr_t>(data) % sizeof(uint32_t)) != 0) {
+        if (*data == value) {
+            return data;
+        }
+
+        ++data;
+    }
+
+    // XOR each word with the value repeated so matching bytes become zero, then use
+    // the usual "has a zero byte" trick to skip over words with no match in them.
+    const uint32_t pattern = 0x01010101u * value;
+    while ((end - data) >= static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+        uint32_t word;
+        std::memcpy(&word, data, sizeof(word));
+        word ^= pattern;
+
+        if (((word - 0x01010101u) & ~word & 0x80808080u) != 0) {
+            break;
+        }
+
+        data += sizeof(uint32_t);
+    }
+
+    while (data < end) {
+        if (*data == value) {
+            return data;
+        }
+
+        ++data;
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "ring_buffer.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// memchr equivalent that compares a 32-bit word at a time once aligned.
+const uint8_t *findByte(const uint8_t *data, size_t length, uint8_t value);
+
+// Splits a byte stream into newline terminated frames without allocating.
+// push() is called by the producer (the SPP receive callback), drain() by the consumer.
+template<size_t Capacity>
+class LineFramer {
+public:
+    static constexpr uint8_t DELIMITER = '\n';
+
+    size_t push(const uint8_t *data, size_t length) {
+        return ring.write(data, length);
+    }
+
+    // Producer side: bytes that can be pushed without any being dropped.
+    size_t space() const {
+        return ring.space();
+    }
+
+    bool empty() const {
+        return ring.size() == 0;
+    }
+
+    // Calls on_frame(data, length) for each complete frame currently buffered.
+    // Frames are passed as a pointer straight into the ring, unless they wrap
+    // around the end of it, in which case they are first linearized into scratch.
+    // If the ring fills without a delimiter the whole ring is emitted so we can't stall.
+    template<typename Callback>
+    size_t drain(Callback &&on_frame) {
+        size_t frames = 0;
+
+        for (;;) {
+            size_t available = ring.size();
+
+            size_t frame_length = 0;
+            while (scanned < available) {
+                const uint8_t *block = nullptr;
+                size_t block_length = ring.peek(scanned, &block);
+
+                const uint8_t *delimiter = findByte(block, block_length, DELIMITER);
+                if (delimiter) {
+                    frame_length = scanned + (delimiter - block) + 1;
+                    break;
+                }
+
+                scanned += block_length;
+            }
+
+            if (frame_length == 0) {
+                if (available < Capacity) {
+                    break;
+                }
+
+                frame_length = available;
+            }
+
+            const uint8_t *frame = nullptr;
+            if (ring.peek(0, &frame) < frame_length) {
+                ring.copy(0, scratch, frame_length);
+                frame = scratch;
+            }
+
+            on_frame(frame, frame_length);
+
+            ring.consume(frame_length);
+            scanned = 0;
+            ++frames;
+        }
+
+        return frames;
+    }
+
+private:
+    RingBuffer<Capacity> ring;
+
+    // How far into the ring we've already searched without finding a delimiter.
+    size_t scanned = 0;
+
+    uint8_t scratch[Capacity];
+};
@@ -0,0 +1,140 @@
+#include "led.h"
+
+#include "log.h"
+
+#include <Arduino.h>
+#include <driver/ledc.h>
+
+#include <mutex>
+
+// REF_TICK is a fixed 1MHz whatever the CPU and APB clocks are doing under power management,
+// and 1MHz / 2^10 leaves enough divider range to go all the way down to 1Hz.
+static constexpr ledc_mode_t LED_SPEED_MODE = LEDC_LOW_SPEED_MODE;
+static constexpr ledc_timer_t LED_TIMER = LEDC_TIMER_3;
+static constexpr ledc_channel_t LED_CHANNEL = LEDC_CHANNEL_7;
+static constexpr ledc_timer_bit_t LED_DUTY_RESOLUTION = LEDC_TIMER_10_BIT;
+static constexpr uint32_t LED_DUTY_MAX = 1 << 10;
+
+// One flash of duty percent per cycle, at frequency Hz.
+struct LedPattern {
+    uint32_t frequency;
+    uint8_t duty;
+};
+
+static constexpr LedPattern LED_BOOTING = { 1, 100 };
+static constexpr LedPattern LED_WAITING = { 1, 5 };
+static constexpr LedPattern LED_BLE_CONNECTED = { 2, 10 };
+static constexpr LedPattern LED_SPP_CONNECTED = { 1, 90 };
+static constexpr LedPattern LED_BATTERY_LOW = { 4, 10 };
+static constexpr LedPattern LED_OTA_ACTIVE = { 8, 50 };
+
+static std::mutex led_mutex;
+static bool started = false;
+static bool ble_connected = false;
+static bool spp_connected = false;
+static bool ota_active = false;
+static bool battery_low = false;
+static const LedPattern *current_pattern = nullptr;
+
+static void applyPattern(const LedPattern &pattern) {
+    esp_err_t err = ledc_set_freq(LED_SPEED_MODE, LED_TIMER, pattern.frequency);
+    if (err == ESP_OK) {
+        err = ledc_set_duty(LED_SPEED_MODE, LED_CHANNEL, (LED_DUTY_MAX * pattern.duty) / 100);
+    }
+
+    if (err == ESP_OK) {
+        err = ledc_update_duty(LED_SPEED_MODE, LED_CHANNEL);
+    }
+
+    if (err != ESP_OK) {
+        Log::warning<LogCategory::General>("failed to set led pattern: %s\n", esp_err_to_name(err));
+    }
+}
+
+void Led::init() {
+    ledc_timer_config_t timer_config = {};
+    timer_config.speed_mode = LED_SPEED_MODE;
+    timer_config.duty_resolution = LED_DUTY_RESOLUTION;
+    timer_config.timer_num = LED_TIMER;
+    timer_config.freq_hz = LED_BOOTING.frequency;
+    timer_config.clk_cfg = LEDC_USE_REF_TICK;
+
+    esp_err_t err = ledc_timer_config(&timer_config);
+    if (err != ESP_OK) {
+        Log::error<LogCategory::General>("ledc_timer_config failed: %s\n", esp_err_to_name(err));
+        return;
+    }
+
+    ledc_channel_config_t channel_config = {};
+    channel_config.gpio_num = LED_BUILTIN;
+    channel_config.speed_mode = LED_SPEED_MODE;
+    channel_config.channel = LED_CHANNEL;
+    channel_config.timer_sel = LED_TIMER;
+    channel_config.duty = (LED_DUTY_MAX * LED_BOOTING.duty) / 100;
+    channel_config.hpoint = 0;
+
+    err = ledc_channel_config(&channel_config);
+    if (err != ESP_OK) {
+        Log::error<LogCategory::General>("ledc_channel_config failed: %s\n", esp_err_to_name(err));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(led_mutex);
+    current_pattern = &LED_BOOTING;
+}
+
+void Led::start() {
+    std::lock_guard<std::mutex> lock(led_mutex);
+    started = true;
+    update();
+}
+
+void Led::setBleConnected(bool connected) {
+    std::lock_guard<std::mutex> lock(led_mutex);
+    ble_connected = connected;
+    update();
+}
+
+void Led::setSppConnected(bool connected) {
+    std::lock_guard<std::mutex> lock(led_mutex);
+    spp_connected = connected;
+    update();
+}
+
+void Led::setOtaActive(bool active) {
+    std::lock_guard<std::mutex> lock(led_mutex);
+    ota_active = active;
+    update();
+}
+
+void Led::setBatteryLow(bool low) {
+    std::lock_guard<std::mutex> lock(led_mutex);
+    battery_low = low;
+    update();
+}
+
+// Callers hold led_mutex.
+void Led::update() {
+    // Nothing to change until we're out of the boot state, or if init failed.
+    if (!started || !current_pattern) {
+        return;
+    }
+
+    const LedPattern *pattern = &LED_WAITING;
+    if (ota_active) {
+        pattern = &LED_OTA_ACTIVE;
+    } else if (battery_low) {
+        pattern = &LED_BATTERY_LOW;
+    } else if (spp_connected) {
+        pattern = &LED_SPP_CONNECTED;
+    } else if (ble_connected) {
+        pattern = &LED_BLE_CONNECTED;
+    }
+
+    if (pattern == current_pattern) {
+        return;
+    }
+
+    applyPattern(*pattern);
+    current_pattern = pattern;
+}
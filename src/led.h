@@ -0,0 +1,22 @@
+#pragma once
+
+// The status LED, blinked by an LEDC channel so the pattern runs in hardware with nothing to wake
+// the CPU for. Each setter picks the pattern for the new state, only when something changes.
+//
+// From highest priority: OTA update (fast blink), low battery (quick flashes), X1 linked over SPP
+// (mostly on), BLE client connected (flash twice a second), waiting (flash once a second).
+class Led {
+public:
+    // Turns the LED on solid, so we can see we've booted.
+    static void init();
+    // Leaves the boot state and starts showing the status patterns.
+    static void start();
+
+    static void setBleConnected(bool connected);
+    static void setSppConnected(bool connected);
+    static void setOtaActive(bool active);
+    static void setBatteryLow(bool low);
+
+private:
+    static void update();
+};
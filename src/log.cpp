@@ -1,38 +1,140 @@
 #include "log.h"
+#include "log_batch.h"
+#include "log_ring.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <stdexcept>
 
-static bool output_callback_suspended = false;
-static std::string output_callback_buffer = "";
-static std::function<void(const std::string &message)> output_callback = nullptr;
+// 32 slots of a little over 128 bytes each is ~4 KiB, enough to soak up a connect / scan burst.
+static LogRing<32, 124> log_ring;
+static std::atomic<uint32_t> dropped_messages = 0;
+
+static TaskHandle_t sink_task = nullptr;
+static std::atomic<bool> sink_busy = false;
+
+// Only touched by logSink, partial lines are left at the front until their newline arrives.
+static LogBatch<512> output_batch;
+// Default BLE MTU less the ATT header, until Ble tells us otherwise.
+static std::atomic<size_t> output_limit = 20;
+static std::function<void(const char *data, size_t length)> output_callback = nullptr;
+
+LogLevel Log::category_levels[static_cast<size_t>(LogCategory::Count)] = {
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+    static_cast<LogLevel>(DEFAULT_LOG_LEVEL),
+};
+
+LogLevel Log::getLevel(LogCategory category) {
+    if (category >= LogCategory::Count) {
+        return LogLevel::None;
+    }
+
+    return category_levels[static_cast<size_t>(category)];
+}
+
+void Log::setLevel(LogCategory category, LogLevel level) {
+    if (category >= LogCategory::Count) {
+        return;
+    }
+
+    category_levels[static_cast<size_t>(category)] = level;
+}
+
+static void writeOutput(const char *data, size_t length) {
+    ::fwrite(data, 1, length, stdout);
+
+    if (!output_callback) {
+        return;
+    }
 
-LogSuspender::~LogSuspender() {
-    output_callback_suspended = false;
+    output_batch.write(data, length, output_limit.load(std::memory_order_relaxed), output_callback);
 }
 
-void Log::print(const char *message) {
-    ::fputs(message, stdout);
+static void drainLogRing() {
+    for (;;) {
+        uint32_t dropped = dropped_messages.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            char message[48];
+            int length = snprintf(message, sizeof(message), "log dropped %u messages\n", (unsigned)dropped);
+            writeOutput(message, std::min<size_t>(length, sizeof(message) - 1));
+        }
+
+        if (!log_ring.pop(writeOutput)) {
+            break;
+        }
+    }
+
     ::fflush(stdout);
 
-    if (output_callback && !output_callback_suspended) {
-        output_callback_buffer.append(message);
+    if (output_callback) {
+        output_batch.send(output_limit.load(std::memory_order_relaxed), true, output_callback);
+    }
+}
+
+void Log::init() {
+    if (sink_task) {
+        return;
+    }
 
+    // Lowest priority above idle, anything that wants to log is more important than the logging.
+    xTaskCreatePinnedToCore([](void *) {
         for (;;) {
-            size_t newline = output_callback_buffer.find('\n');
-            if (newline == std::string::npos) {
-                break;
-            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            sink_busy = true;
+            drainLogRing();
+            sink_busy = false;
+        }
+    }, "logSink", 4096, nullptr, tskIDLE_PRIORITY + 1, &sink_task, tskNO_AFFINITY);
+
+    // Pick up anything logged before we started.
+    xTaskNotifyGive(sink_task);
+}
 
-            std::string line(output_callback_buffer.c_str(), newline);
-            output_callback_buffer.erase(0, newline + 1);
+void Log::flush(uint32_t timeout_ms) {
+    if (!sink_task) {
+        return;
+    }
 
-            output_callback(line);
+    TickType_t start = xTaskGetTickCount();
+    while (!log_ring.empty() || sink_busy) {
+        if ((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout_ms)) {
+            break;
         }
+
+        vTaskDelay(1);
+    }
+}
+
+void Log::push(const char *message) {
+    size_t length = strlen(message);
+    if (length == 0) {
+        return;
+    }
+
+    // A long message takes several slots, reserved together so it can't be interleaved with
+    // another task's, and so a full ring drops all of it rather than just the end.
+    if (!log_ring.pushWhole(message, length)) {
+        dropped_messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (sink_task) {
+        xTaskNotifyGive(sink_task);
     }
 }
 
-void Log::printf(const char *format, ...) {
+void Log::printFormatted(const char *format, ...) {
     va_list args;
     va_start(args, format);
     vprintf(format, args);
@@ -40,27 +142,72 @@ void Log::printf(const char *format, ...) {
 }
 
 void Log::vprintf(const char *format, va_list args) {
+    // Almost every message fits on the stack, only fall back to the heap for the odd long one.
+    char stack_buffer[128];
+
     va_list copy;
     va_copy(copy, args);
-    int length = vsnprintf(nullptr, 0, format, copy);
+    int length = vsnprintf(stack_buffer, sizeof(stack_buffer), format, copy);
     va_end(copy);
 
     if (length < 0) {
         throw std::runtime_error("string formatting failed");
     }
 
+    if (static_cast<size_t>(length) < sizeof(stack_buffer)) {
+        push(stack_buffer);
+        return;
+    }
+
     std::string buffer(length + 1, '\0');
     vsnprintf(&buffer[0], buffer.size(), format, args);
     buffer.resize(length);
 
-    print(buffer.c_str());
+    push(buffer.c_str());
 }
 
-LogSuspender Log::suspendOutputCallback() {
-    output_callback_suspended = true;
-    return {};
+void Log::vhexdump(const uint8_t *data, size_t length, const char *format, va_list args) {
+    static constexpr char digits[] = "0123456789ABCDEF";
+
+    char stack_buffer[128];
+
+    va_list copy;
+    va_copy(copy, args);
+    int prefix_length = vsnprintf(stack_buffer, sizeof(stack_buffer), format, copy);
+    va_end(copy);
+
+    if (prefix_length < 0) {
+        throw std::runtime_error("string formatting failed");
+    }
+
+    // The whole line goes to push() in one go, so it comes out in one piece. Short dumps
+    // are built on the stack, only a long one needs the heap.
+    size_t total = prefix_length + (length * 3) + 1;
+
+    std::string heap_buffer;
+    char *buffer = stack_buffer;
+    if (total >= sizeof(stack_buffer)) {
+        heap_buffer.resize(total + 1);
+        vsnprintf(&heap_buffer[0], heap_buffer.size(), format, args);
+        buffer = &heap_buffer[0];
+    }
+
+    size_t used = prefix_length;
+    for (size_t i = 0; i < length; ++i) {
+        buffer[used++] = ' ';
+        buffer[used++] = digits[data[i] >> 4];
+        buffer[used++] = digits[data[i] & 0x0F];
+    }
+
+    buffer[used++] = '\n';
+    buffer[used] = '\0';
+    push(buffer);
 }
 
-void Log::setOutputCallback(std::function<void(const std::string &message)> function) {
+void Log::setOutputCallback(std::function<void(const char *data, size_t length)> function) {
     output_callback = function;
 }
+
+void Log::setOutputLimit(size_t length) {
+    output_limit = std::max<size_t>(length, 1);
+}
@@ -1,21 +1,112 @@
 #pragma once
 
+#include "defaults.h"
+
 #include <cstdarg>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <string>
+
+enum class LogLevel : uint8_t {
+    None = 0,
+    Error = 1,
+    Warning = 2,
+    Info = 3,
+    Debug = 4,
+    Verbose = 5,
+};
 
-class LogSuspender {
-    LogSuspender(const LogSuspender &) = delete;
+enum class LogCategory : uint8_t {
+    General = 0,
+    Ble,
+    Bluetooth,
+    Serial,
+    Config,
+    Ota,
+    Power,
 
-public:
-    ~LogSuspender();
+    Count,
 };
 
+// Every call site picks a level and category. Anything above LOG_MAX_LEVEL is
+// compiled out entirely, everything else is checked against the runtime level
+// for its category before any formatting happens.
+//
+// Formatted messages are copied into a lock-free ring and written out by the
+// logSink task, so logging is safe from any task (including the BT stack
+// callbacks) and never waits on the UART or a BLE notification. If the ring is
+// full the message is dropped and counted instead.
 class Log {
 public:
-    static void print(const char *message);
-    static void printf(const char *format, ...);
+    template<LogLevel level, LogCategory category>
+    static constexpr bool isCompiledIn() {
+        return level != LogLevel::None && static_cast<uint8_t>(level) <= LOG_MAX_LEVEL && category < LogCategory::Count;
+    }
+
+    template<LogLevel level, LogCategory category>
+    static bool isEnabled() {
+        if constexpr (!isCompiledIn<level, category>()) {
+            return false;
+        } else {
+            return level <= category_levels[static_cast<size_t>(category)];
+        }
+    }
+
+    template<LogLevel level, LogCategory category, typename... Args>
+    static void print(const char *format, Args... args) {
+        if constexpr (isCompiledIn<level, category>()) {
+            if (isEnabled<level, category>()) {
+                printFormatted(format, args...);
+            }
+        }
+    }
+
+    template<LogCategory category, typename... Args>
+    static void error(const char *format, Args... args) { print<LogLevel::Error, category>(format, args...); }
+
+    template<LogCategory category, typename... Args>
+    static void warning(const char *format, Args... args) { print<LogLevel::Warning, category>(format, args...); }
+
+    template<LogCategory category, typename... Args>
+    static void info(const char *format, Args... args) { print<LogLevel::Info, category>(format, args...); }
+
+    template<LogCategory category, typename... Args>
+    static void debug(const char *format, Args... args) { print<LogLevel::Debug, category>(format, args...); }
+
+    // Writes the formatted prefix followed by " XX" for each byte and a newline,
+    // formatted into one buffer (on the heap only for long dumps) and logged as one message.
+    template<LogLevel level, LogCategory category>
+    __attribute__((format(printf, 3, 4))) static void hexdump(const uint8_t *data, size_t length, const char *format, ...) {
+        if constexpr (isCompiledIn<level, category>()) {
+            if (isEnabled<level, category>()) {
+                va_list args;
+                va_start(args, format);
+                vhexdump(data, length, format, args);
+                va_end(args);
+            }
+        }
+    }
+
+    // Starts the logSink task, messages logged before this are held in the ring.
+    static void init();
+
+    // Waits up to timeout_ms for everything logged so far to be written out, call before sleeping or restarting.
+    static void flush(uint32_t timeout_ms);
+
+    static LogLevel getLevel(LogCategory category);
+    static void setLevel(LogCategory category, LogLevel level);
+
+    // The callback is called from logSink with one or more complete lines (including
+    // their newlines) at a time, packed up to the output limit (e.g. the usable MTU).
+    static void setOutputCallback(std::function<void(const char *data, size_t length)> function);
+    static void setOutputLimit(size_t length);
+
+private:
+    static void push(const char *message);
+    static void printFormatted(const char *format, ...);
     static void vprintf(const char *format, va_list args);
+    static void vhexdump(const uint8_t *data, size_t length, const char *format, va_list args);
 
-    static LogSuspender suspendOutputCallback();
-    static void setOutputCallback(std::function<void(const std::string &message)> function);
+    static LogLevel category_levels[static_cast<size_t>(LogCategory::Count)];
 };
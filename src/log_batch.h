@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+// Packs log output into writes of at most limit bytes for a transport like BLE notifications.
+// Complete lines are sent together, a line longer than limit goes out in pieces, and a trailing
+// partial line is held until its newline arrives. The limit can drop between calls (a client with
+// a smaller MTU connecting) while more than that is still buffered.
+template<size_t Size>
+class LogBatch {
+public:
+    template<typename Callback>
+    void write(const char *data, size_t length, size_t limit, Callback &&on_output) {
+        limit = clampLimit(limit);
+
+        while (length > 0) {
+            // Each send takes at least a byte, so this always makes room, even after the limit dropped.
+            while (buffered >= limit) {
+                send(limit, false, on_output);
+            }
+
+            size_t chunk = std::min(length, limit - buffered);
+            std::memcpy(buffer + buffered, data, chunk);
+            buffered += chunk;
+
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    // Sends complete lines, or everything that doesn't fit in limit. With all false only a single
+    // callback is made, to make room.
+    template<typename Callback>
+    void send(size_t limit, bool all, Callback &&on_output) {
+        limit = clampLimit(limit);
+
+        while (buffered > 0) {
+            size_t length = std::min(buffered, limit);
+
+            size_t line_end = length;
+            while (line_end > 0 && buffer[line_end - 1] != '\n') {
+                --line_end;
+            }
+
+            if (line_end > 0) {
+                length = line_end;
+            } else if (buffered < limit) {
+                break;
+            }
+
+            on_output(buffer, length);
+
+            buffered -= length;
+            std::memmove(buffer, buffer + length, buffered);
+
+            if (!all) {
+                break;
+            }
+        }
+    }
+
+    size_t length() const {
+        return buffered;
+    }
+
+private:
+    static size_t clampLimit(size_t limit) {
+        return std::clamp<size_t>(limit, 1, Size);
+    }
+
+    char buffer[Size];
+    size_t buffered = 0;
+};
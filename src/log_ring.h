@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Bounded multi-producer / single consumer queue of short messages.
+// Each slot carries a sequence number that tells producers and the consumer
+// whose turn it is (Vyukov's bounded queue), so pushing never takes a lock and
+// a full ring is reported to the caller rather than waited on.
+template<size_t SlotCount, size_t SlotSize>
+class LogRing {
+    static_assert(SlotCount > 1 && (SlotCount & (SlotCount - 1)) == 0, "log ring slot count must be a power of two");
+    static_assert(SlotSize <= UINT16_MAX, "log ring slot size must fit in the length field");
+
+public:
+    static constexpr size_t SLOT_SIZE = SlotSize;
+
+    LogRing() {
+        for (size_t i = 0; i < SlotCount; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any task: copies up to SlotSize bytes into a free slot, returns false if the ring is full.
+    bool push(const char *data, size_t length) {
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+
+        Slot *slot = nullptr;
+        for (;;) {
+            slot = &slots[position & (SlotCount - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->length = std::min(length, SlotSize);
+        std::memcpy(slot->data, data, slot->length);
+        slot->sequence.store(position + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // Any task: copies the whole message into as many consecutive slots as it needs, all or nothing.
+    // They're claimed in one go, so another producer's message can't land in between them, and
+    // the consumer gets them back to back. Returns false if there aren't enough free slots.
+    bool pushWhole(const char *data, size_t length) {
+        size_t count = std::max<size_t>((length + SlotSize - 1) / SlotSize, 1);
+        if (count > SlotCount) {
+            return false;
+        }
+
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        for (;;) {
+            // The consumer frees slots in order, so if the last one we need is free, so are the others.
+            size_t last = position + count - 1;
+            size_t sequence = slots[last & (SlotCount - 1)].sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(last);
+
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + count, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            Slot &slot = slots[(position + i) & (SlotCount - 1)];
+            slot.length = std::min(length, SlotSize);
+            std::memcpy(slot.data, data, slot.length);
+            slot.sequence.store(position + i + 1, std::memory_order_release);
+
+            data += slot.length;
+            length -= slot.length;
+        }
+
+        return true;
+    }
+
+    // Consumer only: calls on_message(data, length) for the oldest message, returns false if there is none.
+    template<typename Callback>
+    bool pop(Callback &&on_message) {
+        size_t position = dequeue_position.load(std::memory_order_relaxed);
+        Slot &slot = slots[position & (SlotCount - 1)];
+
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != (position + 1)) {
+            return false;
+        }
+
+        on_message(slot.data, slot.length);
+
+        slot.sequence.store(position + SlotCount, std::memory_order_release);
+        dequeue_position.store(position + 1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    bool empty() const {
+        return dequeue_position.load(std::memory_order_relaxed) == enqueue_position.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        uint16_t length;
+        char data[SlotSize];
+    };
+
+    Slot slots[SlotCount];
+    std::atomic<size_t> enqueue_position = 0;
+    std::atomic<size_t> dequeue_position = 0;
+};
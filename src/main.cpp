@@ -1,113 +1,142 @@
 #include "config.h"
+#include "battery.h"
 #include "ble.h"
 #include "bluetooth.h"
+#include "defaults.h"
+#include "diagnostics.h"
+#include "led.h"
 #include "log.h"
+#include "ota.h"
+#include "power.h"
+#include "trace.h"
 
 #include <Arduino.h>
 
-void startLedBlinkTask() {
-    xTaskCreateUniversal([](void *pvParameters) {
-        for (;;) {
-            digitalWrite(LED_BUILTIN, HIGH);
+#include <esp_sleep.h>
+#include <esp_timer.h>
 
-            delay(100);
+static esp_timer_handle_t battery_timer = nullptr;
+static TaskHandle_t console_task = nullptr;
 
-            digitalWrite(LED_BUILTIN, LOW);
+void startBatteryMonitorTimer() {
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = [](void *) {
+        uint8_t level = Battery::update();
+        Ble::updateBatteryLevel(level, Battery::getMillivolts());
+        Led::setBatteryLow(level <= LED_LOW_BATTERY_LEVEL);
 
-            if (!Ble::isClientConnected()) {
-                delay(2 * 1000);
-
-                continue;
-            }
-
-            delay(150);
-
-            digitalWrite(LED_BUILTIN, HIGH);
-
-            delay(100);
-
-            digitalWrite(LED_BUILTIN, LOW);
-
-            delay(750);
+        if (Battery::isLow()) {
+            Log::warning<LogCategory::Power>("battery level low, going to deep sleep\n");
+            Power::sleep();
         }
-    }, "ledBlink", getArduinoLoopTaskStackSize(), NULL, 1, NULL, ARDUINO_RUNNING_CORE);
-}
-
-void checkBatteryLevel() {
-    uint32_t millivolts = analogReadMilliVolts(A13) * 2;
-
-    // 4234 (mostly 4232) appears to be our actual max
-    // 3218 seems to be the minimum seen when re-connecting usb after death
-    // seeing as low as 3016 via ble after disconnecting again
-    // got stuck at 3.9v charge after discharge test - needed a cold reboot
-    float percentage = (((int32_t)millivolts - 3200) / (4200.0 - 3200.0)) * 100;
-    Log::printf("battery: %dmV %.02f%%\n", millivolts, percentage);
+    };
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "batteryMonitor";
+    esp_timer_create(&timer_args, &battery_timer);
 
-    uint8_t level = constrain((int32_t)percentage, 0, 100);
-    Ble::updateBatteryLevel(level, millivolts);
-
-    // TODO: Tune the cutoff values.
-    if (millivolts < 3100) {
-        Log::print("battery level low, going to deep sleep");
-
-        // Gracefully clean up.
-        Bluetooth::deinit();
-        Ble::deinit();
-        delay(5 * 1000);
+    esp_timer_start_periodic(battery_timer, BATTERY_READING_INTERVAL * 1000000ull);
+}
 
-        esp_deep_sleep_start();
+void handleConsoleCommand(const std::string &command) {
+    if (command == "stats") {
+        Trace::dump();
+    } else if (command == "stats reset") {
+        Trace::reset();
+        Log::info<LogCategory::General>("latency stats reset\n");
+    } else if (!command.empty()) {
+        Log::info<LogCategory::General>("unknown command \"%s\", try \"stats\" or \"stats reset\"\n", command.c_str());
     }
 }
 
-void startBatteryMonitorTask() {
-    xTaskCreateUniversal([](void *pvParameters) {
-        for (;;) {
-            // TODO: We probably don't need to run this very often at all.
-            delay(60 * 1000);
+void setup() {
+    // Only needed for reading console commands, output goes through the log. The loop task
+    // runs the console, and sleeps until the UART driver tells it there's something to read.
+    console_task = xTaskGetCurrentTaskHandle();
+    Serial.onReceive([]() {
+        xTaskNotifyGive(console_task);
+    });
+    Serial.begin(115200);
 
-            checkBatteryLevel();
-        }
-    }, "batteryMonitor", getArduinoLoopTaskStackSize(), NULL, 1, NULL, ARDUINO_RUNNING_CORE);
-}
+    Log::init();
 
-void setup() {
-    Log::print("hello, world\n");
+    Log::info<LogCategory::General>("hello, world\n");
 
     // Increase our priority so our init tasks don't get interrupted.
     vTaskPrioritySet(nullptr, 10);
 
     // Turn the LED on immediately so we know we're on.
-    pinMode(LED_BUILTIN, OUTPUT);
-    digitalWrite(LED_BUILTIN, HIGH);
+    Led::init();
     delay(50);
 
-    // Run immediately so that we skip startup if the voltage is too low.
-    checkBatteryLevel();
-
-    startBatteryMonitorTask();
+    // Run immediately so that we skip startup if the voltage is too low. Nothing is up
+    // yet, so there's nothing to clean up before sleeping.
+    Battery::init();
+    if (!Battery::canStart()) {
+        Log::warning<LogCategory::Power>("battery level too low to start, going to deep sleep\n");
+        Log::flush(500);
+        esp_deep_sleep_start();
+    }
 
-    startLedBlinkTask();
+    Config::init();
 
     std::string name = Config::getName();
     uint32_t pin_code = Config::getPinCode();
-    Log::printf("name: \"%s\", pin code: %06d\n", name.c_str(), pin_code);
+    Log::info<LogCategory::General>("name: \"%s\", pin code: %06d\n", name.c_str(), pin_code);
 
-    // The name is shared internally in the BT stack, so must be the same for both.
+    // Idle timeouts come from the config, and the BLE callbacks feed activity in.
+    Power::init();
+
+    // Bring the radios up before anything that can wait, so we're advertising as soon as
+    // possible after a wake. The name is shared internally in the BT stack, so must be the same for both.
     Ble::init(name, pin_code);
     Bluetooth::init(name);
 
-    // Run battery monitor again now BLE is up to populate the battery level characteristic.
-    checkBatteryLevel();
+    // The SPP connect runs on the BT worker, so the link comes up in parallel with the rest
+    // of init and will usually be there by the time the app has connected over BLE.
+    Ble::startAutoConnect();
+
+    Led::start();
+
+    // Parse the OTA signing key up front, rather than when an update is being verified.
+    Ota::init();
+
+    // Populate the battery characteristics now BLE is up, the monitor only updates them on change.
+    Ble::updateBatteryLevel(Battery::getLevel(), Battery::getMillivolts());
+    Led::setBatteryLow(Battery::getLevel() <= LED_LOW_BATTERY_LEVEL);
+
+    startBatteryMonitorTimer();
+
+    // Last, so the first sample has every task in it.
+    Diagnostics::init();
 
-    Log::print("ready\n");
+    Log::info<LogCategory::General>("ready\n");
+
+    // Drop back down now init is done, the loop only runs the console.
+    vTaskPrioritySet(nullptr, 1);
 }
 
 void loop() {
-    // Just sleep in the loop, all the work is done by tasks.
-    // We don't want to just return as that'll waste CPU, but we need to wakeup
-    // periodically so that the Arduino core can handle serial events (I think?)
-    // delay(1000);
+    // All the real work is done by tasks, the loop just runs a tiny line based console
+    // on the USB serial port for diagnostics. It blocks until a receive event, so it
+    // never wakes the CPU on its own.
+    static std::string line;
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (Serial.available() > 0) {
+        char c = Serial.read();
+        if (c == '\r') {
+            continue;
+        }
 
-    // We don't need the `serialEvent` callback, so just end the loop task.
-    vTaskDelete(nullptr);
+        if (c == '\n') {
+            handleConsoleCommand(line);
+            line.clear();
+            continue;
+        }
+
+        if (line.size() < 64) {
+            line += c;
+        }
+    }
 }
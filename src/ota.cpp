@@ -0,0 +1,644 @@
+#include "ota.h"
+
+#include "log.h"
+#include "defaults.h"
+#include "ota_patch.h"
+#include "ota_session.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_image_format.h>
+#include <nvs.h>
+#include <esp32/rom/miniz.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/ecdsa.h>
+#include <mbedtls/error.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// How long the GATT callback waits for a free buffer before giving up on the update.
+static constexpr TickType_t BUFFER_TIMEOUT = pdMS_TO_TICKS(5000);
+
+// Checkpoints keep a software mode clone of the hash context, which is plain data and can be
+// restored into a fresh context as is.
+static_assert(sizeof(mbedtls_sha256_context) <= OtaCheckpoint::HASH_STATE_SIZE, "hash context must fit in a checkpoint");
+
+#if defined OTA_PUBLIC_KEY_X && defined OTA_PUBLIC_KEY_Y
+static constexpr char public_key_x[] = QUOTE(OTA_PUBLIC_KEY_X);
+static constexpr char public_key_y[] = QUOTE(OTA_PUBLIC_KEY_Y);
+
+static constexpr int hexDigit(char c) {
+    return (c >= '0' && c <= '9') ? (c - '0') : (c >= 'a' && c <= 'f') ? (c - 'a' + 10) : (c >= 'A' && c <= 'F') ? (c - 'A' + 10) : -1;
+}
+
+template <size_t N>
+static constexpr bool isKeyCoordinate(const char (&hex)[N]) {
+    if (N < 2 || (N - 1) > 64) {
+        return false;
+    }
+
+    for (size_t i = 0; i < (N - 1); ++i) {
+        if (hexDigit(hex[i]) < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Right aligned into 32 bytes, the build flags don't have to carry leading zeros.
+template <size_t N>
+static constexpr void writeKeyCoordinate(std::array<uint8_t, Ota::PUBLIC_KEY_SIZE> &key, size_t offset, const char (&hex)[N]) {
+    for (size_t digit = 0; digit < (N - 1); ++digit) {
+        size_t nibble = ((N - 1) - 1) - digit;
+        size_t index = offset + 31 - (nibble / 2);
+        int value = hexDigit(hex[digit]);
+        key[index] |= (nibble % 2) ? (value << 4) : value;
+    }
+}
+
+static constexpr std::array<uint8_t, Ota::PUBLIC_KEY_SIZE> encodePublicKey() {
+    std::array<uint8_t, Ota::PUBLIC_KEY_SIZE> key = {};
+    key[0] = 0x04; // Uncompressed point.
+    writeKeyCoordinate(key, 1, public_key_x);
+    writeKeyCoordinate(key, 1 + 32, public_key_y);
+    return key;
+}
+
+static_assert(isKeyCoordinate(public_key_x) && isKeyCoordinate(public_key_y), "OTA_PUBLIC_KEY_X/Y must be hex, at most 64 digits each");
+
+static constexpr std::array<uint8_t, Ota::PUBLIC_KEY_SIZE> public_key = encodePublicKey();
+#endif
+
+// Loaded once by init() and then only used from otaWriter.
+static mbedtls_ecdsa_context verify_ctx;
+static bool verify_ready = false;
+static bool verify_warm = false;
+
+static void logMbedtlsError(const char *step, int err) {
+    char error[128];
+    mbedtls_strerror(err, error, sizeof(error));
+    Log::error<LogCategory::Ota>("ble ota %s: %s (%d)\n", step, error, err);
+}
+
+// The first multiplication by the generator builds its fixed point comb table, which the group
+// then keeps (MBEDTLS_ECP_FIXED_POINT_OPTIM), so do one as soon as an update starts rather
+// than leaving it all to the verification at the end.
+static void warmVerifier() {
+    if (!verify_ready || verify_warm) {
+        return;
+    }
+
+    mbedtls_ecp_point result;
+    mbedtls_ecp_point_init(&result);
+
+    // 1 is special cased and wouldn't touch the table.
+    mbedtls_mpi two;
+    mbedtls_mpi_init(&two);
+    mbedtls_mpi_lset(&two, 2);
+
+    int err = mbedtls_ecp_muladd(&verify_ctx.grp, &result, &two, &verify_ctx.grp.G, &two, &verify_ctx.Q);
+    if (err != 0) {
+        logMbedtlsError("mbedtls_ecp_muladd", err);
+    }
+
+    mbedtls_mpi_free(&two);
+    mbedtls_ecp_point_free(&result);
+
+    verify_warm = true;
+}
+
+static bool verifySignature(const uint8_t *hash, size_t hash_length, const uint8_t *signature, size_t signature_length) {
+    if (!verify_ready) {
+        Log::error<LogCategory::Ota>("ble ota signature verification failed - no signing key\n");
+        return false;
+    }
+
+    int err = mbedtls_ecdsa_read_signature(&verify_ctx, hash, hash_length, signature, signature_length);
+    if (err != 0) {
+        logMbedtlsError("signature verification failed - mbedtls_ecdsa_read_signature", err);
+        return false;
+    }
+
+    return true;
+}
+
+static bool isCompressed(OtaFormat format) {
+    return format == OtaFormat::Deflate || format == OtaFormat::DeflateDelta;
+}
+
+static bool isDelta(OtaFormat format) {
+    return format == OtaFormat::Delta || format == OtaFormat::DeflateDelta;
+}
+
+// Inflates and / or patches the wire data into the image.
+class EspOtaDecoder : public OtaDecoder {
+public:
+    EspOtaDecoder(OtaFormat format, const esp_partition_t *target, WriteCallback write_image)
+        : format(format), target(target), write_image(write_image) {
+    }
+
+    ~EspOtaDecoder() override {
+        free(inflator);
+        free(window);
+        delete patch;
+        free(output);
+    }
+
+    bool init() {
+        if (isCompressed(format)) {
+            inflator = static_cast<tinfl_decompressor *>(malloc(sizeof(tinfl_decompressor)));
+            window = static_cast<uint8_t *>(malloc(Ota::DEFLATE_WINDOW));
+            if (!inflator || !window) {
+                Log::error<LogCategory::Ota>("ble ota failed to allocate inflate state\n");
+                return false;
+            }
+
+            tinfl_init(inflator);
+        }
+
+        if (isDelta(format)) {
+            source = esp_ota_get_running_partition();
+            output = static_cast<uint8_t *>(malloc(Ota::BUFFER_SIZE));
+            patch = new (std::nothrow) OtaPatch([this](const OtaPatch::Header &header) {
+                return checkPatchSource(header);
+            }, [this](size_t offset, uint8_t *data, size_t length) {
+                return esp_partition_read(source, offset, data, length) == ESP_OK;
+            }, [this](const uint8_t *data, size_t length) {
+                return bufferImage(data, length);
+            });
+
+            if (!source || !output || !patch) {
+                Log::error<LogCategory::Ota>("ble ota failed to allocate patch state\n");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool push(const uint8_t *data, size_t length) override {
+        return isCompressed(format) ? inflateChunk(data, length) : writeDecoded(data, length);
+    }
+
+    bool finish() override {
+        if (isCompressed(format)) {
+            if (!inflate_done) {
+                Log::error<LogCategory::Ota>("ble ota compressed image truncated\n");
+                return false;
+            }
+
+            Log::info<LogCategory::Ota>("ble ota inflated %d bytes\n", inflated_length);
+        }
+
+        if (isDelta(format)) {
+            if (!patch->isComplete()) {
+                Log::error<LogCategory::Ota>("ble ota patch truncated\n");
+                return false;
+            }
+
+            if (output_length > 0 && !write_image(output, output_length)) {
+                return false;
+            }
+
+            output_length = 0;
+        }
+
+        return true;
+    }
+
+private:
+    // Patch output comes out in pieces as small as a byte, so it's gathered into whole sectors first.
+    bool bufferImage(const uint8_t *data, size_t length) {
+        while (length > 0) {
+            size_t count = std::min(length, Ota::BUFFER_SIZE - output_length);
+            memcpy(&output[output_length], data, count);
+            output_length += count;
+            data += count;
+            length -= count;
+
+            if (output_length == Ota::BUFFER_SIZE) {
+                if (!write_image(output, output_length)) {
+                    return false;
+                }
+
+                output_length = 0;
+            }
+        }
+
+        return true;
+    }
+
+    // The patch has to have been made against exactly the image we're running.
+    bool checkPatchSource(const OtaPatch::Header &header) {
+        if (header.source_size > source->size) {
+            Log::error<LogCategory::Ota>("ble ota patch source larger than running partition (%d > %d)\n", header.source_size, source->size);
+            return false;
+        }
+
+        if (header.target_size > target->size) {
+            Log::error<LogCategory::Ota>("ble ota image too large for partition (%d > %d)\n", header.target_size, target->size);
+            return false;
+        }
+
+        // Nothing has been output yet, so the sector buffer is free to read through.
+        mbedtls_sha256_context source_ctx;
+        mbedtls_sha256_init(&source_ctx);
+        mbedtls_sha256_starts_ret(&source_ctx, 0);
+
+        bool read_ok = true;
+        for (size_t offset = 0; offset < header.source_size; offset += Ota::BUFFER_SIZE) {
+            size_t count = std::min<size_t>(header.source_size - offset, Ota::BUFFER_SIZE);
+            if (esp_partition_read(source, offset, output, count) != ESP_OK) {
+                read_ok = false;
+                break;
+            }
+
+            mbedtls_sha256_update_ret(&source_ctx, output, count);
+        }
+
+        uint8_t hash[32];
+        mbedtls_sha256_finish_ret(&source_ctx, hash);
+        mbedtls_sha256_free(&source_ctx);
+
+        if (!read_ok) {
+            Log::error<LogCategory::Ota>("ble ota failed to read running partition\n");
+            return false;
+        }
+
+        if (memcmp(hash, header.source_hash.data(), sizeof(hash)) != 0) {
+            Log::error<LogCategory::Ota>("ble ota patch was made against a different image\n");
+            return false;
+        }
+
+        Log::info<LogCategory::Ota>("ble ota patching %d byte image from %s into %d bytes\n", header.source_size, source->label, header.target_size);
+        return true;
+    }
+
+    // Decoded wire data either is the image, or is a patch that produces it.
+    bool writeDecoded(const uint8_t *data, size_t length) {
+        if (patch) {
+            if (!patch->push(data, length)) {
+                Log::error<LogCategory::Ota>("ble ota failed to apply patch\n");
+                return false;
+            }
+
+            return true;
+        }
+
+        return write_image(data, length);
+    }
+
+    // The window is a power of two no smaller than the stream's, so tinfl can use it as its
+    // dictionary in wrapping mode. It's flushed every time it fills, which keeps raw image
+    // writes sector aligned, and whatever is left is flushed when the stream ends.
+    bool inflateChunk(const uint8_t *data, size_t length) {
+        while (!inflate_done) {
+            size_t in_bytes = length;
+            size_t out_bytes = Ota::DEFLATE_WINDOW - window_length;
+
+            tinfl_status status = tinfl_decompress(inflator, data, &in_bytes, window, &window[window_length], &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+
+            data += in_bytes;
+            length -= in_bytes;
+            window_length += out_bytes;
+
+            if (status < TINFL_STATUS_DONE) {
+                Log::error<LogCategory::Ota>("ble ota failed to inflate image: %d\n", status);
+                return false;
+            }
+
+            if (status == TINFL_STATUS_DONE) {
+                inflate_done = true;
+            }
+
+            if (window_length == Ota::DEFLATE_WINDOW || (inflate_done && window_length > 0)) {
+                if (!writeDecoded(window, window_length)) {
+                    return false;
+                }
+
+                inflated_length += window_length;
+                window_length = 0;
+            }
+
+            if (status == TINFL_STATUS_NEEDS_MORE_INPUT && length == 0) {
+                return true;
+            }
+        }
+
+        if (length > 0) {
+            Log::error<LogCategory::Ota>("ble ota %d bytes of trailing data after the compressed image\n", length);
+            return false;
+        }
+
+        return true;
+    }
+
+    OtaFormat format;
+    const esp_partition_t *target;
+    WriteCallback write_image;
+
+    // Only allocated for compressed images, the window is written out each time it fills.
+    tinfl_decompressor *inflator = nullptr;
+    uint8_t *window = nullptr;
+    size_t window_length = 0;
+    size_t inflated_length = 0;
+    bool inflate_done = false;
+
+    // Only allocated for delta images, the patch output is collected into sectors here.
+    OtaPatch *patch = nullptr;
+    const esp_partition_t *source = nullptr;
+    uint8_t *output = nullptr;
+    size_t output_length = 0;
+};
+
+// FreeRTOS queues between the GATT callback and otaWriter, the checkpoint in NVS, and the next
+// OTA partition, written directly rather than through esp_ota_write, which can only ever start
+// at the beginning of the image.
+class EspOtaPlatform : public OtaPlatform {
+public:
+    bool setup();
+
+    QueueHandle_t getMessageQueue() const {
+        return message_queue;
+    }
+
+    uint8_t *takeBuffer() override {
+        uint8_t *buffer = nullptr;
+        if (xQueueReceive(free_queue, &buffer, BUFFER_TIMEOUT) != pdTRUE) {
+            return nullptr;
+        }
+
+        return buffer;
+    }
+
+    void returnBuffer(uint8_t *buffer) override {
+        xQueueSend(free_queue, &buffer, 0);
+    }
+
+    bool postMessage(const OtaMessage &message) override {
+        return xQueueSend(message_queue, &message, 0) == pdTRUE;
+    }
+
+    bool loadCheckpoint(OtaCheckpoint &checkpoint) override {
+        size_t length = sizeof(checkpoint);
+        return nvs_get_blob(checkpoint_nvs, "checkpoint", &checkpoint, &length) == ESP_OK && length == sizeof(checkpoint);
+    }
+
+    bool saveCheckpoint(const OtaCheckpoint &checkpoint) override {
+        esp_err_t err = nvs_set_blob(checkpoint_nvs, "checkpoint", &checkpoint, sizeof(checkpoint));
+        if (err == ESP_OK) {
+            err = nvs_commit(checkpoint_nvs);
+        }
+
+        if (err != ESP_OK) {
+            Log::warning<LogCategory::Ota>("ble ota failed to save checkpoint: %s (%d)\n", esp_err_to_name(err), err);
+            return false;
+        }
+
+        return true;
+    }
+
+    void clearCheckpoint() override {
+        esp_err_t err = nvs_erase_key(checkpoint_nvs, "checkpoint");
+        if (err == ESP_OK) {
+            nvs_commit(checkpoint_nvs);
+        }
+    }
+
+    void getAppId(uint8_t *app_id) override {
+        memcpy(app_id, esp_ota_get_app_description()->app_elf_sha256, 32);
+    }
+
+    bool getTarget(OtaPartitionInfo &info) override {
+        if (!target) {
+            return false;
+        }
+
+        info = { target->address, target->size, target->label };
+        return true;
+    }
+
+    bool eraseTarget(size_t offset, size_t length) override {
+        esp_err_t err = esp_partition_erase_range(target, offset, length);
+        if (err != ESP_OK) {
+            Log::error<LogCategory::Ota>("ble ota failed to erase: %s (%d)\n", esp_err_to_name(err), err);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool writeTarget(size_t offset, const uint8_t *data, size_t length) override {
+        esp_err_t err = esp_partition_write(target, offset, data, length);
+        if (err != ESP_OK) {
+            Log::error<LogCategory::Ota>("ble ota failed to write: %s (%d)\n", esp_err_to_name(err), err);
+            return false;
+        }
+
+        return true;
+    }
+
+    // With MBEDTLS_HARDWARE_SHA (the IDF default) this runs on the SHA peripheral, and a
+    // resumed one carries on in software.
+    void startHash(const uint8_t *state) override {
+        mbedtls_sha256_init(&sha_ctx);
+
+        if (state) {
+            memcpy(&sha_ctx, state, sizeof(sha_ctx));
+        } else {
+            mbedtls_sha256_starts_ret(&sha_ctx, 0);
+        }
+    }
+
+    void updateHash(const uint8_t *data, size_t length) override {
+        mbedtls_sha256_update_ret(&sha_ctx, data, length);
+    }
+
+    // Reads the state out of the SHA peripheral if that's where it lives.
+    void saveHash(uint8_t *state) override {
+        mbedtls_sha256_context clone;
+        mbedtls_sha256_init(&clone);
+        mbedtls_sha256_clone(&clone, &sha_ctx);
+        memcpy(state, &clone, sizeof(clone));
+        mbedtls_sha256_free(&clone);
+    }
+
+    void finishHash(uint8_t *hash) override {
+        if (hash) {
+            mbedtls_sha256_finish_ret(&sha_ctx, hash);
+        }
+
+        mbedtls_sha256_free(&sha_ctx);
+    }
+
+    std::unique_ptr<OtaDecoder> createDecoder(OtaFormat format, OtaDecoder::WriteCallback write_image) override {
+        if (!isCompressed(format) && !isDelta(format)) {
+            return nullptr;
+        }
+
+        std::unique_ptr<EspOtaDecoder> decoder(new (std::nothrow) EspOtaDecoder(format, target, write_image));
+        if (!decoder || !decoder->init()) {
+            return nullptr;
+        }
+
+        return decoder;
+    }
+
+    void prepareVerifier() override {
+        warmVerifier();
+    }
+
+    bool verifySignature(const uint8_t *hash, size_t hash_length, const uint8_t *signature, size_t signature_length) override {
+        return ::verifySignature(hash, hash_length, signature, signature_length);
+    }
+
+    // What esp_ota_end would have checked, the image written by hand still has to be a valid app.
+    bool activateTarget() override {
+        esp_partition_pos_t position = { target->address, target->size };
+        esp_image_metadata_t metadata;
+        esp_err_t err = esp_image_verify(ESP_IMAGE_VERIFY, &position, &metadata);
+        if (err != ESP_OK) {
+            Log::error<LogCategory::Ota>("ble ota failed to validate: %s (%d)\n", esp_err_to_name(err), err);
+            return false;
+        }
+
+        err = esp_ota_set_boot_partition(target);
+        if (err != ESP_OK) {
+            Log::error<LogCategory::Ota>("ble ota failed to switch partition: %s (%d)\n", esp_err_to_name(err), err);
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    uint8_t *buffer_pool = nullptr;
+    QueueHandle_t free_queue = nullptr;
+    QueueHandle_t message_queue = nullptr;
+    nvs_handle_t checkpoint_nvs = 0;
+    // The next update partition doesn't change until we've switched to it and restarted.
+    const esp_partition_t *target = nullptr;
+    mbedtls_sha256_context sha_ctx;
+};
+
+static EspOtaPlatform platform;
+static OtaSession session(platform);
+static TaskHandle_t writer_task = nullptr;
+
+bool EspOtaPlatform::setup() {
+    // Only allocated once someone actually starts an update, and kept until the restart that follows it.
+    buffer_pool = static_cast<uint8_t *>(malloc(OtaSession::BUFFER_COUNT * Ota::BUFFER_SIZE));
+    if (!buffer_pool) {
+        Log::error<LogCategory::Ota>("ble ota failed to allocate %d byte buffer pool\n", OtaSession::BUFFER_COUNT * Ota::BUFFER_SIZE);
+        return false;
+    }
+
+    esp_err_t err = nvs_open("ota", NVS_READWRITE, &checkpoint_nvs);
+    if (err != ESP_OK) {
+        Log::error<LogCategory::Ota>("ble ota failed to open nvs: %s (%d)\n", esp_err_to_name(err), err);
+        free(buffer_pool);
+        buffer_pool = nullptr;
+        return false;
+    }
+
+    target = esp_ota_get_next_update_partition(nullptr);
+
+    free_queue = xQueueCreate(OtaSession::BUFFER_COUNT, sizeof(uint8_t *));
+    // Room for every buffer plus the begin and finish / abort of two overlapping sessions, so sends never block.
+    message_queue = xQueueCreate(OtaSession::BUFFER_COUNT + 4, sizeof(OtaMessage));
+
+    for (size_t i = 0; i < OtaSession::BUFFER_COUNT; ++i) {
+        returnBuffer(&buffer_pool[i * Ota::BUFFER_SIZE]);
+    }
+
+    return true;
+}
+
+static bool setupPipeline() {
+    if (writer_task) {
+        return true;
+    }
+
+    if (!platform.setup()) {
+        return false;
+    }
+
+    xTaskCreateUniversal([](void *) {
+        for (;;) {
+            OtaMessage message;
+            if (xQueueReceive(platform.getMessageQueue(), &message, portMAX_DELAY) == pdTRUE) {
+                session.handleMessage(message);
+            }
+        }
+    }, "otaWriter", 4096, nullptr, 2, &writer_task, ARDUINO_RUNNING_CORE);
+
+    return true;
+}
+
+void Ota::init() {
+#if defined OTA_PUBLIC_KEY_X && defined OTA_PUBLIC_KEY_Y
+    if (verify_ready) {
+        return;
+    }
+
+    mbedtls_ecdsa_init(&verify_ctx);
+
+    int err = mbedtls_ecp_group_load(&verify_ctx.grp, MBEDTLS_ECP_DP_SECP256R1);
+    if (err != 0) {
+        logMbedtlsError("mbedtls_ecp_group_load", err);
+        return;
+    }
+
+    err = mbedtls_ecp_point_read_binary(&verify_ctx.grp, &verify_ctx.Q, public_key.data(), public_key.size());
+    if (err != 0) {
+        logMbedtlsError("mbedtls_ecp_point_read_binary", err);
+        return;
+    }
+
+    err = mbedtls_ecp_check_pubkey(&verify_ctx.grp, &verify_ctx.Q);
+    if (err != 0) {
+        logMbedtlsError("mbedtls_ecp_check_pubkey", err);
+        return;
+    }
+
+    verify_ready = true;
+#endif
+}
+
+const uint8_t *Ota::getPublicKey() {
+#if defined OTA_PUBLIC_KEY_X && defined OTA_PUBLIC_KEY_Y
+    return public_key.data();
+#else
+    return nullptr;
+#endif
+}
+
+
+void Ota::setStatusCallback(std::function<void(size_t progress, bool complete, bool success, uint16_t credits)> callback) {
+    session.setStatusCallback(callback);
+}
+
+bool Ota::begin(OtaFormat format, size_t size, size_t window_chunk_size, const uint8_t *image_id) {
+    if (!setupPipeline()) {
+        return false;
+    }
+
+    return session.begin(format, size, window_chunk_size, image_id);
+}
+
+bool Ota::write(const uint8_t *data, size_t length) {
+    return session.write(data, length);
+}
+
+bool Ota::end(const uint8_t *signature, size_t length) {
+    return session.end(signature, length);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// The start message format byte, describing how the image is encoded on the wire.
+enum class OtaFormat : uint8_t {
+    Raw = 0x01,
+    // Raw deflate stream (no zlib header) with a window of at most DEFLATE_WINDOW bytes.
+    Deflate = 0x02,
+    // Patch against the running image, see ota_patch.h.
+    Delta = 0x03,
+    // Delta patch, deflate compressed as for Deflate.
+    DeflateDelta = 0x04,
+};
+
+// Flash writes, hashing and signature verification for OTA updates all run in the
+// otaWriter task. The GATT callback feeding it only copies data into a small pool
+// of sector sized buffers, and blocks only when every buffer is waiting on flash.
+// The state machine itself is OtaSession in ota_session.h, this runs it on the hardware.
+class Ota {
+public:
+    // Buffers are handed to esp_ota_write whole, so every write is sector aligned.
+    static constexpr size_t BUFFER_SIZE = 4096;
+    static constexpr size_t PROGRESS_INTERVAL = 16 * 1024;
+    // The inflate window doubles as the sector buffer for the decompressed image.
+    static constexpr size_t DEFLATE_WINDOW = BUFFER_SIZE;
+    // Uncompressed P-256 point, 0x04 + X + Y.
+    static constexpr size_t PUBLIC_KEY_SIZE = 1 + 32 + 32;
+
+    // Loads the signing key into the verification context, so that's not done per update.
+    static void init();
+    // The signing key as encoded at build time, or nullptr if the firmware was built without one.
+    static const uint8_t *getPublicKey();
+
+    // Called from otaWriter with the number of (wire format) bytes processed. Progress is reported
+    // once the update has begun and then every PROGRESS_INTERVAL bytes, and complete is set
+    // exactly once when the update has either been applied or failed.
+    //
+    // For a windowed update credits is the number of chunk_size writes the client may make on
+    // top of those it's already been given. The first report grants the initial window, and
+    // after that one is sent for every buffer the writer frees up.
+    static void setStatusCallback(std::function<void(size_t progress, bool complete, bool success, uint16_t credits)> callback);
+
+    // These are only called from the GATT callback. They return false if the data was refused,
+    // anything that goes wrong later on in otaWriter is reported through the status callback.
+    // image_size is the number of bytes that will be written, which for a compressed or delta
+    // image is the size of that. The signature is always over the hash of the decoded image.
+    // A non-zero chunk_size makes it a windowed update, where no write may be larger than that.
+    // Raw images with an image_id (32 bytes, the client's choice, normally the image hash) are
+    // checkpointed to NVS as they're written. Starting the same one again picks up from the last
+    // checkpoint, which the first status report gives as the progress to send from.
+    static bool begin(OtaFormat format, size_t image_size, size_t chunk_size = 0, const uint8_t *image_id = nullptr);
+    static bool write(const uint8_t *data, size_t length);
+    static bool end(const uint8_t *signature, size_t length);
+};
@@ -0,0 +1,138 @@
+#include "ota_patch.h"
+
+#include <algorithm>
+#include <cstring>
+
+static uint32_t readUint32(const uint8_t *data) {
+    return ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[1] << 8) | data[0];
+}
+
+OtaPatch::OtaPatch(HeaderCallback on_header, ReadCallback read_source, WriteCallback write_target)
+    : on_header(on_header), read_source(read_source), write_target(write_target) {
+}
+
+bool OtaPatch::fail() {
+    state = State::Failed;
+    return false;
+}
+
+bool OtaPatch::push(const uint8_t *data, size_t length) {
+    while (length > 0) {
+        switch (state) {
+            case State::Failed:
+                return false;
+            case State::Header:
+            case State::Arguments: {
+                size_t count = std::min(length, pending_needed - pending_length);
+                memcpy(&pending[pending_length], data, count);
+                pending_length += count;
+                data += count;
+                length -= count;
+
+                if (pending_length < pending_needed) {
+                    break;
+                }
+
+                if (state == State::Arguments) {
+                    if (!onArguments()) {
+                        return fail();
+                    }
+
+                    break;
+                }
+
+                if (memcmp(pending, MAGIC, sizeof(MAGIC)) != 0) {
+                    return fail();
+                }
+
+                header.source_size = readUint32(&pending[4]);
+                std::copy(&pending[8], &pending[8 + 32], header.source_hash.begin());
+                header.target_size = readUint32(&pending[40]);
+
+                if (on_header && !on_header(header)) {
+                    return fail();
+                }
+
+                state = State::Op;
+                break;
+            }
+            case State::Op:
+                op = *data;
+                ++data;
+                --length;
+
+                if (op != OP_COPY && op != OP_INSERT) {
+                    return fail();
+                }
+
+                state = State::Arguments;
+                pending_length = 0;
+                pending_needed = (op == OP_COPY) ? 8 : 4;
+                break;
+            case State::Insert: {
+                size_t count = std::min(length, insert_remaining);
+                if (!write_target(data, count)) {
+                    return fail();
+                }
+
+                target_written += count;
+                insert_remaining -= count;
+                data += count;
+                length -= count;
+
+                if (insert_remaining == 0) {
+                    state = State::Op;
+                }
+                break;
+            }
+        }
+    }
+
+    return state != State::Failed;
+}
+
+bool OtaPatch::onArguments() {
+    if (op == OP_COPY) {
+        uint32_t offset = readUint32(&pending[0]);
+        uint32_t length = readUint32(&pending[4]);
+
+        state = State::Op;
+        return copy(offset, length);
+    }
+
+    insert_remaining = readUint32(&pending[0]);
+    if (insert_remaining > (header.target_size - target_written)) {
+        return false;
+    }
+
+    state = (insert_remaining > 0) ? State::Insert : State::Op;
+    return true;
+}
+
+bool OtaPatch::copy(uint32_t offset, uint32_t length) {
+    // Written to not overflow, both sides come straight off the wire.
+    if (offset > header.source_size || length > (header.source_size - offset)) {
+        return false;
+    }
+
+    if (length > (header.target_size - target_written)) {
+        return false;
+    }
+
+    while (length > 0) {
+        size_t count = std::min<size_t>(length, sizeof(copy_buffer));
+        if (!read_source(offset, copy_buffer, count) || !write_target(copy_buffer, count)) {
+            return false;
+        }
+
+        target_written += count;
+        offset += count;
+        length -= count;
+    }
+
+    return true;
+}
+
+bool OtaPatch::isComplete() const {
+    return state == State::Op && target_written == header.target_size;
+}
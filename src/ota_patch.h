@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Streaming applier for delta OTA images. A patch rebuilds the target image front to
+// back out of ranges of the running image and literal data, integers little endian:
+//
+//   header: u8 magic[4] "X1DP", u32 source size, u8 source sha256[32], u32 target size
+//   0x01 copy:   u32 source offset, u32 length
+//   0x02 insert: u32 length, u8 data[length]
+//
+// Input can be split anywhere, so it's fed straight from the transport (or the inflater).
+class OtaPatch {
+public:
+    static constexpr uint8_t MAGIC[4] = { 'X', '1', 'D', 'P' };
+    static constexpr size_t HEADER_SIZE = 4 + 4 + 32 + 4;
+
+    enum Op : uint8_t {
+        OP_COPY = 0x01,
+        OP_INSERT = 0x02,
+    };
+
+    struct Header {
+        uint32_t source_size;
+        std::array<uint8_t, 32> source_hash;
+        uint32_t target_size;
+    };
+
+    // Each of these returns false to fail the patch. The header callback is where the
+    // caller checks the running image is the one the patch was made against.
+    using HeaderCallback = std::function<bool(const Header &header)>;
+    using ReadCallback = std::function<bool(size_t offset, uint8_t *data, size_t length)>;
+    using WriteCallback = std::function<bool(const uint8_t *data, size_t length)>;
+
+    OtaPatch(HeaderCallback on_header, ReadCallback read_source, WriteCallback write_target);
+
+    // Returns false if the patch is malformed or a callback failed, it stays failed after that.
+    bool push(const uint8_t *data, size_t length);
+    // True once the patch has ended on an op boundary with the whole target written.
+    bool isComplete() const;
+
+private:
+    enum class State : uint8_t {
+        Header,
+        Op,
+        Arguments,
+        Insert,
+        Failed,
+    };
+
+    bool fail();
+    bool onArguments();
+    bool copy(uint32_t offset, uint32_t length);
+
+    HeaderCallback on_header;
+    ReadCallback read_source;
+    WriteCallback write_target;
+
+    State state = State::Header;
+    uint8_t op = 0;
+    // Header and op arguments are collected here until complete.
+    uint8_t pending[HEADER_SIZE];
+    size_t pending_length = 0;
+    size_t pending_needed = HEADER_SIZE;
+
+    Header header = {};
+    size_t target_written = 0;
+    size_t insert_remaining = 0;
+
+    uint8_t copy_buffer[256];
+};
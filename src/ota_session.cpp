@@ -0,0 +1,469 @@
+#include "ota_session.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static_assert((Ota::BUFFER_SIZE % OtaSession::FLASH_SECTOR_SIZE) == 0, "buffers must be whole sectors");
+static_assert(sizeof(OtaCheckpoint) <= Ota::BUFFER_SIZE, "checkpoints are passed in a buffer");
+
+OtaSession::OtaSession(OtaPlatform &platform) : platform(platform) {
+}
+
+void OtaSession::setStatusCallback(StatusCallback callback) {
+    status_callback = callback;
+}
+
+// Every byte the writer has committed frees up the same amount of buffer space, so as long as the
+// client keeps its writes to chunk_size, everything it's been granted fits without blocking.
+uint16_t OtaSession::takeCredits() {
+    if (writer.chunk_size == 0) {
+        return 0;
+    }
+
+    uint32_t total = ((BUFFER_COUNT * Ota::BUFFER_SIZE) + (writer.bytes_written - writer.window_base)) / writer.chunk_size;
+    uint32_t credits = std::min<uint32_t>(total - writer.credits_granted, UINT16_MAX);
+    writer.credits_granted += credits;
+
+    return credits;
+}
+
+void OtaSession::reportStatus(size_t progress, bool complete, bool success) {
+    uint16_t credits = complete ? 0 : takeCredits();
+
+    if (status_callback) {
+        status_callback(progress, complete, success, credits);
+    }
+}
+
+void OtaSession::closeSession(bool report_failure) {
+    if (writer.open) {
+        platform.finishHash(nullptr);
+        writer.open = false;
+    }
+
+    writer.decoder.reset();
+
+    if (report_failure) {
+        failed_session.store(writer.session);
+        reportStatus(writer.bytes_written, true, false);
+    }
+}
+
+void OtaSession::saveCheckpoint() {
+    writer.checkpoint.offset = writer.flash_length;
+    platform.saveHash(writer.checkpoint.hash_state);
+
+    if (!platform.saveCheckpoint(writer.checkpoint)) {
+        return;
+    }
+
+    Log::debug<LogCategory::Ota>("ble ota checkpoint at %d bytes\n", writer.flash_length);
+}
+
+// Writes decoded image data, which is hashed as it goes. Sectors are erased as they're first
+// written to, spreading the erase stalls across the transfer.
+bool OtaSession::writeImage(const uint8_t *data, size_t length) {
+    size_t offset = writer.flash_length;
+    if ((offset + length) > writer.partition.size) {
+        Log::error<LogCategory::Ota>("ble ota image too large for partition (%d > %d)\n", offset + length, writer.partition.size);
+        return false;
+    }
+
+    size_t erase_start = ((offset + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) * FLASH_SECTOR_SIZE;
+    size_t erase_end = ((offset + length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) * FLASH_SECTOR_SIZE;
+    if (erase_end > erase_start && !platform.eraseTarget(erase_start, erase_end - erase_start)) {
+        return false;
+    }
+
+    if (!platform.writeTarget(offset, data, length)) {
+        return false;
+    }
+
+    platform.updateHash(data, length);
+
+    writer.flash_length += length;
+    return true;
+}
+
+void OtaSession::writerBegin(const OtaMessage &message) {
+    // A restarted update replaces whatever was in progress.
+    closeSession(false);
+
+    writer.session = message.session;
+    writer.format = message.format;
+    writer.image_size = message.length;
+    writer.chunk_size = message.chunk_size;
+    writer.bytes_written = 0;
+    writer.flash_length = 0;
+    writer.last_progress = 0;
+    writer.window_base = 0;
+    writer.credits_granted = 0;
+    writer.resumable = false;
+
+    if (!platform.getTarget(writer.partition)) {
+        Log::error<LogCategory::Ota>("ble ota partition not found\n");
+        closeSession(true);
+        return;
+    }
+
+    if (writer.format == OtaFormat::Raw && writer.image_size > writer.partition.size) {
+        Log::error<LogCategory::Ota>("ble ota image too large for partition (%d > %d)\n", writer.image_size, writer.partition.size);
+        closeSession(true);
+        return;
+    }
+
+    if (writer.format != OtaFormat::Raw) {
+        writer.decoder = platform.createDecoder(writer.format, [this](const uint8_t *data, size_t length) {
+            return writeImage(data, length);
+        });
+
+        if (!writer.decoder) {
+            Log::error<LogCategory::Ota>("ble ota failed to set up decoder for format %d\n", static_cast<int>(writer.format));
+            closeSession(true);
+            return;
+        }
+    }
+
+    platform.prepareVerifier();
+
+    // The GATT side has already checked a checkpoint it passes on is for this image.
+    if (message.buffer) {
+        memcpy(&writer.checkpoint, message.buffer, sizeof(writer.checkpoint));
+        writer.resumable = true;
+    }
+
+    writer.open = true;
+
+    if (writer.resumable && writer.checkpoint.offset > 0) {
+        platform.startHash(writer.checkpoint.hash_state);
+
+        writer.bytes_written = writer.checkpoint.offset;
+        writer.flash_length = writer.checkpoint.offset;
+        writer.last_progress = writer.checkpoint.offset;
+        writer.window_base = writer.checkpoint.offset;
+
+        Log::info<LogCategory::Ota>("ble ota update resumed (%s) at %d of %d bytes\n", writer.partition.label, writer.bytes_written, writer.image_size);
+    } else {
+        // Anything we start writing invalidates a checkpoint for another image.
+        platform.clearCheckpoint();
+        platform.startHash(nullptr);
+
+        Log::info<LogCategory::Ota>("ble ota update started (%s), expecting %d bytes\n", writer.partition.label, writer.image_size);
+    }
+
+    reportStatus(writer.bytes_written, false, false);
+}
+
+void OtaSession::writerChunk(const OtaMessage &message) {
+    if (!writer.open || message.session != writer.session) {
+        return;
+    }
+
+    bool written = writer.decoder ? writer.decoder->push(message.buffer, message.length) : writeImage(message.buffer, message.length);
+    if (!written) {
+        closeSession(true);
+        return;
+    }
+
+    writer.bytes_written += message.length;
+
+    // Only full sectors have gone out, so the offset is always sector aligned here.
+    if (writer.resumable && (writer.flash_length - writer.checkpoint.offset) >= CHECKPOINT_INTERVAL && writer.flash_length < writer.image_size) {
+        saveCheckpoint();
+    }
+
+    // A windowed client is waiting on the credits, so it hears about every buffer.
+    if (writer.chunk_size != 0 || (writer.bytes_written - writer.last_progress) >= Ota::PROGRESS_INTERVAL) {
+        writer.last_progress = writer.bytes_written;
+
+        Log::debug<LogCategory::Ota>("ble ota update progress (%d / %d bytes)\n", writer.bytes_written, writer.image_size);
+        reportStatus(writer.bytes_written, false, false);
+    }
+}
+
+void OtaSession::writerFinish(const OtaMessage &message) {
+    if (!writer.open || message.session != writer.session) {
+        return;
+    }
+
+    if (writer.bytes_written != writer.image_size) {
+        Log::error<LogCategory::Ota>("ble ota finish message image size mismatch (%d != %d)\n", writer.bytes_written, writer.image_size);
+        closeSession(true);
+        return;
+    }
+
+    if (writer.decoder) {
+        if (!writer.decoder->finish()) {
+            closeSession(true);
+            return;
+        }
+
+        writer.decoder.reset();
+    }
+
+    // Whatever happens next, the image is complete and there's nothing left to resume.
+    if (writer.resumable) {
+        platform.clearCheckpoint();
+        writer.resumable = false;
+    }
+
+    uint8_t hash[32];
+    platform.finishHash(hash);
+    writer.open = false;
+
+    char hash_hex[(sizeof(hash) * 2) + 1];
+    for (size_t i = 0; i < sizeof(hash); ++i) {
+        snprintf(&hash_hex[i * 2], 3, "%02x", hash[i]);
+    }
+    Log::info<LogCategory::Ota>("ble ota image hash: %s (%d bytes)\n", hash_hex, writer.flash_length);
+
+    if (!platform.verifySignature(hash, sizeof(hash), message.buffer, message.length)) {
+        closeSession(true);
+        return;
+    }
+
+    Log::info<LogCategory::Ota>("ble ota signature verification passed\n");
+
+    if (!platform.activateTarget()) {
+        closeSession(true);
+        return;
+    }
+
+    Log::info<LogCategory::Ota>("ble ota complete\n");
+    reportStatus(writer.bytes_written, true, true);
+}
+
+void OtaSession::handleMessage(const OtaMessage &message) {
+    switch (message.type) {
+        case OtaMessageType::Begin:
+            writerBegin(message);
+            break;
+        case OtaMessageType::Chunk:
+            writerChunk(message);
+            break;
+        case OtaMessageType::Finish:
+            writerFinish(message);
+            break;
+        case OtaMessageType::Abort:
+            if (message.session == writer.session) {
+                closeSession(message.report_failure);
+            }
+            break;
+    }
+
+    if (message.buffer) {
+        platform.returnBuffer(message.buffer);
+    }
+}
+
+bool OtaSession::postMessage(OtaMessageType type, uint8_t *buffer, size_t length, bool report_failure) {
+    OtaMessage message = { type, report_failure, session, buffer, length, chunk_size, image_format };
+    if (!platform.postMessage(message)) {
+        Log::error<LogCategory::Ota>("ble ota writer queue full\n");
+
+        if (buffer) {
+            platform.returnBuffer(buffer);
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+uint8_t *OtaSession::takeBuffer() {
+    uint8_t *buffer = platform.takeBuffer();
+    if (!buffer) {
+        Log::error<LogCategory::Ota>("ble ota timed out waiting for flash\n");
+    }
+
+    return buffer;
+}
+
+// Drops the producer side of the session, and has the writer abort its side.
+void OtaSession::abortSession(bool report_failure) {
+    if (fill_buffer) {
+        platform.returnBuffer(fill_buffer);
+        fill_buffer = nullptr;
+        fill_length = 0;
+    }
+
+    session_active = false;
+    postMessage(OtaMessageType::Abort, nullptr, 0, report_failure);
+}
+
+// The writer has already reported the failure, we just need to stop feeding it.
+bool OtaSession::checkWriterFailed() {
+    if (failed_session.load() != session) {
+        return false;
+    }
+
+    if (fill_buffer) {
+        platform.returnBuffer(fill_buffer);
+        fill_buffer = nullptr;
+        fill_length = 0;
+    }
+
+    session_active = false;
+    return true;
+}
+
+// Fills buffer with the checkpoint to resume from for this image if there's a usable one,
+// or a fresh one for the writer to start saving. Returns the offset to resume from.
+size_t OtaSession::prepareCheckpoint(uint8_t *buffer, const uint8_t *image_id, size_t size) {
+    OtaPartitionInfo partition = {};
+    bool has_partition = platform.getTarget(partition);
+
+    uint8_t app_id[32];
+    platform.getAppId(app_id);
+
+    OtaCheckpoint checkpoint;
+    bool usable = platform.loadCheckpoint(checkpoint)
+        && memcmp(checkpoint.image_id, image_id, sizeof(checkpoint.image_id)) == 0
+        && memcmp(checkpoint.app_id, app_id, sizeof(checkpoint.app_id)) == 0
+        && has_partition && checkpoint.partition_address == partition.address
+        && checkpoint.image_size == size
+        && checkpoint.offset <= size && (checkpoint.offset % Ota::BUFFER_SIZE) == 0;
+
+    if (!usable) {
+        memset(&checkpoint, 0, sizeof(checkpoint));
+        memcpy(checkpoint.image_id, image_id, sizeof(checkpoint.image_id));
+        memcpy(checkpoint.app_id, app_id, sizeof(checkpoint.app_id));
+        checkpoint.partition_address = has_partition ? partition.address : 0;
+        checkpoint.image_size = size;
+    }
+
+    memcpy(buffer, &checkpoint, sizeof(checkpoint));
+    return checkpoint.offset;
+}
+
+bool OtaSession::begin(OtaFormat format, size_t size, size_t window_chunk_size, const uint8_t *image_id) {
+    if (session_active) {
+        Log::warning<LogCategory::Ota>("ble ota restarted, discarding %d bytes\n", bytes_received);
+        abortSession(false);
+    }
+
+    // Starts at 1, so it never matches the initial failed_session.
+    ++session;
+    session_active = true;
+    image_format = format;
+    image_size = size;
+    chunk_size = window_chunk_size;
+    bytes_received = 0;
+
+    // Only a raw image maps stream offsets straight onto flash, so those are the only ones
+    // that can pick up from a checkpoint. The decoders' state would be too big to keep.
+    uint8_t *checkpoint_buffer = nullptr;
+    if (image_id && format == OtaFormat::Raw) {
+        checkpoint_buffer = takeBuffer();
+        if (!checkpoint_buffer) {
+            session_active = false;
+            return false;
+        }
+
+        bytes_received = prepareCheckpoint(checkpoint_buffer, image_id, size);
+    }
+
+    if (!postMessage(OtaMessageType::Begin, checkpoint_buffer, size)) {
+        session_active = false;
+        return false;
+    }
+
+    return true;
+}
+
+bool OtaSession::write(const uint8_t *data, size_t length) {
+    if (!session_active) {
+        Log::warning<LogCategory::Ota>("ble ota chunk message received without start\n");
+        return false;
+    }
+
+    if (checkWriterFailed()) {
+        return false;
+    }
+
+    if (chunk_size != 0 && length > chunk_size) {
+        Log::error<LogCategory::Ota>("ble ota chunk larger than negotiated: %d > %d\n", length, chunk_size);
+        abortSession(true);
+        return false;
+    }
+
+    if ((bytes_received + length) > image_size) {
+        Log::error<LogCategory::Ota>("ble ota chunk out of bounds: (%d + %d) > %d\n", bytes_received, length, image_size);
+        abortSession(true);
+        return false;
+    }
+
+    while (length > 0) {
+        if (!fill_buffer) {
+            fill_buffer = takeBuffer();
+            if (!fill_buffer) {
+                abortSession(true);
+                return false;
+            }
+
+            fill_length = 0;
+        }
+
+        size_t count = std::min(length, Ota::BUFFER_SIZE - fill_length);
+        memcpy(&fill_buffer[fill_length], data, count);
+        fill_length += count;
+        bytes_received += count;
+        data += count;
+        length -= count;
+
+        if (fill_length == Ota::BUFFER_SIZE) {
+            uint8_t *buffer = fill_buffer;
+            fill_buffer = nullptr;
+
+            if (!postMessage(OtaMessageType::Chunk, buffer, Ota::BUFFER_SIZE)) {
+                abortSession(true);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool OtaSession::end(const uint8_t *signature, size_t length) {
+    if (!session_active) {
+        Log::warning<LogCategory::Ota>("ble ota finish message received without start\n");
+        return false;
+    }
+
+    if (checkWriterFailed()) {
+        return false;
+    }
+
+    if (length > Ota::BUFFER_SIZE) {
+        Log::error<LogCategory::Ota>("ble ota signature too long: %d\n", length);
+        abortSession(true);
+        return false;
+    }
+
+    // The final partial sector.
+    if (fill_buffer) {
+        uint8_t *buffer = fill_buffer;
+        fill_buffer = nullptr;
+
+        if (!postMessage(OtaMessageType::Chunk, buffer, fill_length)) {
+            abortSession(true);
+            return false;
+        }
+    }
+
+    uint8_t *buffer = takeBuffer();
+    if (!buffer) {
+        abortSession(true);
+        return false;
+    }
+
+    memcpy(buffer, signature, length);
+
+    session_active = false;
+    return postMessage(OtaMessageType::Finish, buffer, length);
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "ota.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+// A resumable session's progress, saved once everything before offset is in flash. The hash
+// state is whatever the platform saved it as, and is only valid for the same firmware build,
+// which app_id identifies.
+struct OtaCheckpoint {
+    static constexpr size_t HASH_STATE_SIZE = 128;
+
+    uint8_t image_id[32];
+    uint8_t app_id[32];
+    uint32_t partition_address;
+    uint32_t image_size;
+    uint32_t offset;
+    uint8_t hash_state[HASH_STATE_SIZE];
+};
+
+enum class OtaMessageType : uint8_t {
+    Begin,  // length is the image size, chunk_size is set for a windowed update, buffer holds an OtaCheckpoint for a resumable one
+    Chunk,  // buffer holds length bytes of image data
+    Finish, // buffer holds the length byte signature
+    Abort,
+};
+
+// Every message carries the session it belongs to, so the writer can discard
+// anything left over from an update that was restarted underneath it.
+struct OtaMessage {
+    OtaMessageType type;
+    bool report_failure;
+    uint32_t session;
+    uint8_t *buffer;
+    size_t length;
+    size_t chunk_size;
+    OtaFormat format;
+};
+
+struct OtaPartitionInfo {
+    uint32_t address;
+    size_t size;
+    const char *label;
+};
+
+// Turns compressed or delta wire data into the image, which it passes on to the write callback.
+class OtaDecoder {
+public:
+    using WriteCallback = std::function<bool(const uint8_t *data, size_t length)>;
+
+    virtual ~OtaDecoder() = default;
+
+    virtual bool push(const uint8_t *data, size_t length) = 0;
+    // Writes out anything still held, false if the stream ended early.
+    virtual bool finish() = 0;
+};
+
+// Everything the session needs from the hardware. The firmware's lives in ota.cpp.
+class OtaPlatform {
+public:
+    virtual ~OtaPlatform() = default;
+
+    // A pool of OtaSession::BUFFER_COUNT buffers of Ota::BUFFER_SIZE bytes, and the writer's
+    // queue. takeBuffer waits a while for the writer to free one, and returns nullptr if it
+    // doesn't. postMessage never blocks.
+    virtual uint8_t *takeBuffer() = 0;
+    virtual void returnBuffer(uint8_t *buffer) = 0;
+    virtual bool postMessage(const OtaMessage &message) = 0;
+
+    // The one saved checkpoint, and the build it has to match.
+    virtual bool loadCheckpoint(OtaCheckpoint &checkpoint) = 0;
+    virtual bool saveCheckpoint(const OtaCheckpoint &checkpoint) = 0;
+    virtual void clearCheckpoint() = 0;
+    virtual void getAppId(uint8_t *app_id) = 0;
+
+    // The partition the update is written to. Sectors are always erased before they're written.
+    virtual bool getTarget(OtaPartitionInfo &info) = 0;
+    virtual bool eraseTarget(size_t offset, size_t length) = 0;
+    virtual bool writeTarget(size_t offset, const uint8_t *data, size_t length) = 0;
+
+    // SHA-256 of the image as it's written. startHash carries on from a saved state if given one.
+    virtual void startHash(const uint8_t *state) = 0;
+    virtual void updateHash(const uint8_t *data, size_t length) = 0;
+    virtual void saveHash(uint8_t *state) = 0;
+    // Ends the hash, hash may be nullptr to just throw it away.
+    virtual void finishHash(uint8_t *hash) = 0;
+
+    // nullptr if the format isn't supported or there's not enough memory.
+    virtual std::unique_ptr<OtaDecoder> createDecoder(OtaFormat format, OtaDecoder::WriteCallback write_image) = 0;
+
+    // Called as a session starts, for anything verifySignature can get done ahead of time.
+    virtual void prepareVerifier() {}
+    virtual bool verifySignature(const uint8_t *hash, size_t hash_length, const uint8_t *signature, size_t signature_length) = 0;
+    // Checks the written image is a valid app and boots into it next time.
+    virtual bool activateTarget() = 0;
+};
+
+// The OTA state machine behind Ota. begin / write / end are the producer side, run from the
+// GATT callback, which only copies data into buffers and posts them. handleMessage is the
+// writer side, run with each message in turn, which writes, hashes and checkpoints the image
+// and reports on it. The two only share failed_session.
+class OtaSession {
+public:
+    // Four buffers gives the GATT side three sectors of slack while one is being erased and written.
+    static constexpr size_t BUFFER_COUNT = 4;
+    static constexpr size_t FLASH_SECTOR_SIZE = 4096;
+    // How often a resumable session saves its progress, it costs an NVS write each time.
+    static constexpr size_t CHECKPOINT_INTERVAL = 64 * 1024;
+
+    using StatusCallback = std::function<void(size_t progress, bool complete, bool success, uint16_t credits)>;
+
+    explicit OtaSession(OtaPlatform &platform);
+
+    void setStatusCallback(StatusCallback callback);
+
+    bool begin(OtaFormat format, size_t image_size, size_t chunk_size, const uint8_t *image_id);
+    bool write(const uint8_t *data, size_t length);
+    bool end(const uint8_t *signature, size_t length);
+
+    // Hands the message's buffer back to the pool once it's done with it.
+    void handleMessage(const OtaMessage &message);
+
+private:
+    bool postMessage(OtaMessageType type, uint8_t *buffer, size_t length, bool report_failure = false);
+    uint8_t *takeBuffer();
+    void abortSession(bool report_failure);
+    bool checkWriterFailed();
+    size_t prepareCheckpoint(uint8_t *buffer, const uint8_t *image_id, size_t size);
+
+    uint16_t takeCredits();
+    void reportStatus(size_t progress, bool complete, bool success);
+    void closeSession(bool report_failure);
+    void saveCheckpoint();
+    bool writeImage(const uint8_t *data, size_t length);
+    void writerBegin(const OtaMessage &message);
+    void writerChunk(const OtaMessage &message);
+    void writerFinish(const OtaMessage &message);
+
+    OtaPlatform &platform;
+    StatusCallback status_callback = nullptr;
+
+    // Set by the writer when a session fails, so the GATT side stops feeding it.
+    std::atomic<uint32_t> failed_session = 0;
+
+    // Producer state, only touched from the GATT callback.
+    uint32_t session = 0;
+    bool session_active = false;
+    OtaFormat image_format = OtaFormat::Raw;
+    size_t image_size = 0;
+    size_t chunk_size = 0;
+    size_t bytes_received = 0;
+    uint8_t *fill_buffer = nullptr;
+    size_t fill_length = 0;
+
+    // Writer state, only touched from handleMessage.
+    struct Writer {
+        uint32_t session = 0;
+        bool open = false;
+        OtaPartitionInfo partition = {};
+        OtaFormat format = OtaFormat::Raw;
+        size_t image_size = 0;
+        size_t chunk_size = 0;
+        // Wire format bytes processed, against image_size.
+        size_t bytes_written = 0;
+        // Decoded bytes written to flash.
+        size_t flash_length = 0;
+        size_t last_progress = 0;
+        // Where the client started sending from, non-zero when a session was resumed.
+        size_t window_base = 0;
+        uint32_t credits_granted = 0;
+
+        bool resumable = false;
+        OtaCheckpoint checkpoint;
+
+        // Only set for compressed and delta images.
+        std::unique_ptr<OtaDecoder> decoder;
+    } writer;
+};
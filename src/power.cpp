@@ -0,0 +1,157 @@
+#include "power.h"
+
+#include "ble.h"
+#include "bluetooth.h"
+#include "config.h"
+#include "log.h"
+
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+
+static esp_timer_handle_t idle_timer = nullptr;
+static std::atomic<int64_t> last_activity_time = 0;
+static std::atomic<bool> client_connected = false;
+static std::atomic<bool> shutting_down = false;
+
+static int64_t getIdleTimeout() {
+    return Config::getDisconnectedIdleTimeout() * 1000000ll;
+}
+
+static void armIdleTimer() {
+    esp_timer_stop(idle_timer);
+
+    // Connected clients each have their own idle deadline, kept by Ble.
+    if (client_connected) {
+        return;
+    }
+
+    int64_t idle_time = esp_timer_get_time() - last_activity_time.load(std::memory_order_relaxed);
+    int64_t remaining = getIdleTimeout() - idle_time;
+    esp_timer_start_once(idle_timer, (remaining > 0) ? remaining : 0);
+}
+
+static void onIdleTimer(void *) {
+    // A client may have connected since the timer was armed.
+    if (client_connected) {
+        return;
+    }
+
+    // Activity doesn't touch the timer, so check how long it has actually been quiet.
+    int64_t idle_time = esp_timer_get_time() - last_activity_time.load(std::memory_order_relaxed);
+    int64_t timeout = getIdleTimeout();
+    if (idle_time < timeout) {
+        esp_timer_start_once(idle_timer, timeout - idle_time);
+        return;
+    }
+
+    Log::info<LogCategory::Power>("going to sleep due to idle timeout\n");
+    Power::sleep();
+}
+
+static void gracefulCleanup() {
+    try {
+        Config::commit();
+    } catch (const std::exception &e) {
+        Log::error<LogCategory::Config>("config commit failed: %s\n", e.what());
+    }
+
+    Bluetooth::deinit();
+    Ble::deinit();
+    vTaskDelay((2 * 1000) / portTICK_PERIOD_MS);
+}
+
+static void startShutdownTask(bool restart) {
+    // Only the first request counts, the radios can only be torn down once.
+    if (shutting_down.exchange(true)) {
+        return;
+    }
+
+    esp_timer_stop(idle_timer);
+
+    xTaskCreatePinnedToCore([](void *parameters) {
+        bool restart = parameters != nullptr;
+
+        vTaskDelay((1 * 1000) / portTICK_PERIOD_MS);
+
+        gracefulCleanup();
+
+        Log::info<LogCategory::Power>("cleanup complete, %s\n", restart ? "restarting" : "sleeping");
+        Log::flush(500);
+
+        if (restart) {
+            esp_restart();
+        }
+
+        esp_deep_sleep_start();
+    }, restart ? "restart" : "sleep", CONFIG_ESP_MAIN_TASK_STACK_SIZE, restart ? (void *)1 : nullptr, 1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+}
+
+void Power::init() {
+#if CONFIG_PM_ENABLE
+    // APB stays at 80MHz as long as the CPU does, which the UART and LEDC set up by
+    // Arduino rely on, and it's as low as the BT controller will let us go anyway.
+    esp_pm_config_esp32_t pm_config = {};
+    pm_config.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    pm_config.min_freq_mhz = 80;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    pm_config.light_sleep_enable = true;
+#endif
+
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        Log::warning<LogCategory::Power>("esp_pm_configure failed: %s\n", esp_err_to_name(err));
+    } else {
+        Log::info<LogCategory::Power>("power management enabled, %d-%dMHz, light sleep %s\n",
+            pm_config.min_freq_mhz, pm_config.max_freq_mhz, pm_config.light_sleep_enable ? "on" : "off");
+    }
+
+#if !CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    Log::info<LogCategory::Power>("built without CONFIG_FREERTOS_USE_TICKLESS_IDLE, no automatic light sleep\n");
+#endif
+#else
+    // The prebuilt Arduino core's sdkconfig doesn't have it, so this is the usual case.
+    Log::info<LogCategory::Power>("built without CONFIG_PM_ENABLE, no frequency scaling or light sleep\n");
+#endif
+
+    last_activity_time = esp_timer_get_time();
+
+    esp_timer_create_args_t idle_timer_args = {};
+    idle_timer_args.callback = onIdleTimer;
+    idle_timer_args.dispatch_method = ESP_TIMER_TASK;
+    idle_timer_args.name = "powerIdle";
+    esp_timer_create(&idle_timer_args, &idle_timer);
+
+    armIdleTimer();
+}
+
+void Power::noteActivity() {
+    last_activity_time.store(esp_timer_get_time(), std::memory_order_relaxed);
+}
+
+void Power::setClientConnected(bool connected) {
+    client_connected = connected;
+    noteActivity();
+
+    if (!shutting_down) {
+        armIdleTimer();
+    }
+}
+
+void Power::updateIdleTimeout() {
+    if (!shutting_down) {
+        armIdleTimer();
+    }
+}
+
+void Power::sleep() {
+    startShutdownTask(false);
+}
+
+void Power::restart() {
+    startShutdownTask(true);
+}
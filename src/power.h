@@ -0,0 +1,29 @@
+#pragma once
+
+// Idle handling and the ways we go down. Nothing here polls, the idle timeout is a single
+// esp_timer deadline that's only looked at when it fires.
+//
+// Frequency scaling and automatic light sleep need an sdkconfig with CONFIG_PM_ENABLE and
+// CONFIG_FREERTOS_USE_TICKLESS_IDLE, which the prebuilt Arduino core doesn't have, so they
+// only happen when building against a custom one (e.g. as an ESP-IDF component). Without
+// them init just logs that power management isn't available.
+class Power {
+public:
+    // Configures power management where the sdkconfig allows it, and starts the disconnected
+    // idle deadline. Before Ble::init.
+    static void init();
+
+    // Pushes the idle deadline back, cheap enough to call on every GATT event.
+    static void noteActivity();
+    // The disconnected idle timeout only runs while no client is connected, and starts over
+    // when the last one leaves. Ble keeps the connected idle timeout for each client itself.
+    static void setClientConnected(bool connected);
+    // Re-arms the deadline after the disconnected idle timeout has been changed.
+    static void updateIdleTimeout();
+
+    // Commit config, shut down both radios, then deep sleep or restart. These return
+    // immediately and do the work from their own task after a short delay, so they're
+    // safe to call from BT stack and timer callbacks.
+    static void sleep();
+    static void restart();
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Fixed capacity single producer / single consumer byte ring.
+// The producer only ever advances head and the consumer only ever advances tail,
+// so as long as there is exactly one of each no locking is required.
+template<size_t Capacity>
+class RingBuffer {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "ring buffer capacity must be a power of two");
+
+public:
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+
+    // Consumer side: bytes available to read.
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+    }
+
+    // Producer side: bytes that can be written without overwriting unread data.
+    size_t space() const {
+        return Capacity - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+    }
+
+    // Producer side: copies as much of data as fits, returning the number of bytes written.
+    size_t write(const uint8_t *data, size_t length) {
+        size_t current_head = head.load(std::memory_order_relaxed);
+        length = std::min(length, space());
+
+        copyIn(current_head, data, length);
+
+        head.store(current_head + length, std::memory_order_release);
+        return length;
+    }
+
+    // Consumer side: returns the largest contiguous readable block starting offset bytes in.
+    size_t peek(size_t offset, const uint8_t **data) const {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        size_t available = head.load(std::memory_order_acquire) - current_tail;
+        if (offset >= available) {
+            *data = nullptr;
+            return 0;
+        }
+
+        size_t index = (current_tail + offset) & (Capacity - 1);
+        *data = &buffer[index];
+        return std::min(available - offset, Capacity - index);
+    }
+
+    // Consumer side: copies out length bytes starting offset bytes in, without consuming them.
+    size_t copy(size_t offset, uint8_t *data, size_t length) const {
+        size_t copied = 0;
+        while (copied < length) {
+            const uint8_t *block = nullptr;
+            size_t block_length = peek(offset + copied, &block);
+            if (block_length == 0) {
+                break;
+            }
+
+            block_length = std::min(block_length, length - copied);
+            std::memcpy(data + copied, block, block_length);
+            copied += block_length;
+        }
+
+        return copied;
+    }
+
+    // Consumer side: discards length bytes from the front of the ring.
+    void consume(size_t length) {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        length = std::min(length, head.load(std::memory_order_acquire) - current_tail);
+        tail.store(current_tail + length, std::memory_order_release);
+    }
+
+private:
+    void copyIn(size_t position, const uint8_t *data, size_t length) {
+        size_t index = position & (Capacity - 1);
+        size_t first = std::min(length, Capacity - index);
+        std::memcpy(&buffer[index], data, first);
+        std::memcpy(&buffer[0], data + first, length - first);
+    }
+
+    // These are free-running and only masked on access, so head == tail is empty
+    // and (head - tail) == Capacity is full without needing a spare slot.
+    std::atomic<size_t> head = 0;
+    std::atomic<size_t> tail = 0;
+    uint8_t buffer[Capacity];
+};
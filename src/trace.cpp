@@ -0,0 +1,137 @@
+#include "trace.h"
+#include "log.h"
+
+#include <algorithm>
+
+struct TraceSpanInfo {
+    TraceHop start;
+    TraceHop end;
+    const char *name;
+};
+
+static constexpr TraceSpanInfo span_info[static_cast<size_t>(TraceSpan::Count)] = {
+    { TraceHop::BleWrite, TraceHop::SppWrite, "ble->spp" },
+    { TraceHop::SppWrite, TraceHop::SppData, "spp response" },
+    { TraceHop::SppData, TraceHop::Framed, "framing" },
+    { TraceHop::Framed, TraceHop::Notified, "notify" },
+    { TraceHop::BleWrite, TraceHop::Notified, "round trip" },
+};
+
+static std::atomic<int64_t> hop_times[static_cast<size_t>(TraceHop::Count)] = {};
+
+// The start time each span last used, so a start is only ever paired once.
+static std::atomic<int64_t> span_starts[static_cast<size_t>(TraceSpan::Count)] = {};
+
+static LatencyHistogram histograms[static_cast<size_t>(TraceSpan::Count)];
+
+void LatencyHistogram::add(uint32_t micros) {
+    size_t bucket = 0;
+    while (bucket < (BUCKET_COUNT - 1) && (micros >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t current_max = maximum.load(std::memory_order_relaxed);
+    while (micros > current_max && !maximum.compare_exchange_weak(current_max, micros, std::memory_order_relaxed)) {
+        // Retry with the updated value.
+    }
+
+    // Whoever takes it over the threshold does the decay, a racing add might land either side of it.
+    if (total.fetch_add(1, std::memory_order_relaxed) + 1 >= DECAY_THRESHOLD) {
+        uint32_t remaining = 0;
+        for (auto &count : buckets) {
+            uint32_t halved = count.load(std::memory_order_relaxed) / 2;
+            count.store(halved, std::memory_order_relaxed);
+            remaining += halved;
+        }
+
+        total.store(remaining, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto &count : buckets) {
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    total.store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
+
+uint32_t LatencyHistogram::count() const {
+    return total.load(std::memory_order_relaxed);
+}
+
+uint32_t LatencyHistogram::max() const {
+    return maximum.load(std::memory_order_relaxed);
+}
+
+uint32_t LatencyHistogram::percentile(uint8_t percent) const {
+    uint32_t counts[BUCKET_COUNT];
+    uint32_t sum = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        sum += counts[i];
+    }
+
+    if (sum == 0) {
+        return 0;
+    }
+
+    uint32_t target = ((uint64_t)sum * std::min<uint8_t>(percent, 100) + 99) / 100;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += counts[i];
+        if (seen >= std::max<uint32_t>(target, 1)) {
+            // The top bucket is open ended, the max is the best bound we have for it.
+            return (i == (BUCKET_COUNT - 1)) ? max() : std::min(max(), (uint32_t)((2u << i) - 1));
+        }
+    }
+
+    return max();
+}
+
+void Trace::record(TraceHop hop, int64_t now) {
+    hop_times[static_cast<size_t>(hop)].store(now, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < static_cast<size_t>(TraceSpan::Count); ++i) {
+        if (span_info[i].end != hop) {
+            continue;
+        }
+
+        int64_t start = hop_times[static_cast<size_t>(span_info[i].start)].load(std::memory_order_relaxed);
+        if (start == 0 || start > now) {
+            continue;
+        }
+
+        if (span_starts[i].exchange(start, std::memory_order_relaxed) == start) {
+            continue;
+        }
+
+        histograms[i].add(static_cast<uint32_t>(std::min<int64_t>(now - start, UINT32_MAX)));
+    }
+}
+
+const LatencyHistogram &Trace::getHistogram(TraceSpan span) {
+    return histograms[static_cast<size_t>(span)];
+}
+
+const char *Trace::getSpanName(TraceSpan span) {
+    return span_info[static_cast<size_t>(span)].name;
+}
+
+void Trace::reset() {
+    for (auto &histogram : histograms) {
+        histogram.reset();
+    }
+}
+
+void Trace::dump() {
+    for (size_t i = 0; i < static_cast<size_t>(TraceSpan::Count); ++i) {
+        const auto &histogram = histograms[i];
+
+        Log::info<LogCategory::General>("%-12s n=%u p50=%uus p99=%uus max=%uus\n",
+            span_info[i].name, histogram.count(), histogram.percentile(50), histogram.percentile(99), histogram.max());
+    }
+}
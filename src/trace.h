@@ -0,0 +1,74 @@
+#pragma once
+
+#include "defaults.h"
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Points along the serial path that get timestamped.
+enum class TraceHop : uint8_t {
+    BleWrite = 0, // serial data onWrite entry
+    SppWrite,     // SerialBT.write() returned
+    SppData,      // SPP data callback entry
+    Framed,       // a complete command was split out of the rx stream
+    Notified,     // notify() returned for that command
+
+    Count,
+};
+
+// Intervals between hops that get a histogram each.
+enum class TraceSpan : uint8_t {
+    BleToSpp = 0, // BleWrite -> SppWrite
+    SppResponse,  // SppWrite -> SppData, time for the X1 to answer
+    Framing,      // SppData -> Framed
+    Notify,       // Framed -> Notified
+    RoundTrip,    // BleWrite -> Notified
+
+    Count,
+};
+
+// Power of two bucketed latency histogram. Counts are halved once the total
+// reaches DECAY_THRESHOLD, so the percentiles follow recent behaviour.
+class LatencyHistogram {
+public:
+    // Bucket i holds samples in [2^i, 2^(i+1)) microseconds, the last one everything above.
+    static constexpr size_t BUCKET_COUNT = 24;
+    static constexpr uint32_t DECAY_THRESHOLD = 1024;
+
+    void add(uint32_t micros);
+    void reset();
+
+    uint32_t count() const;
+    uint32_t max() const;
+    // Upper bound of the bucket containing the given percentile, in microseconds.
+    uint32_t percentile(uint8_t percent) const;
+
+private:
+    std::atomic<uint32_t> buckets[BUCKET_COUNT] = {};
+    std::atomic<uint32_t> total = 0;
+    std::atomic<uint32_t> maximum = 0;
+};
+
+// Each span is recorded the first time its end hop is marked after its start hop,
+// which pairs up correctly for the X1's one-command-one-response traffic.
+class Trace {
+public:
+    static void mark(TraceHop hop) {
+        if constexpr (TRACE_ENABLED != 0) {
+            record(hop, esp_timer_get_time());
+        }
+    }
+
+    static const LatencyHistogram &getHistogram(TraceSpan span);
+    static const char *getSpanName(TraceSpan span);
+    static void reset();
+
+    // Writes one line per span to the log.
+    static void dump();
+
+private:
+    static void record(TraceHop hop, int64_t now);
+};
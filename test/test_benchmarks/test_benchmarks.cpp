@@ -0,0 +1,213 @@
+// Throughput of the host testable parts of the data path. These only report, the numbers
+// depend too much on the machine for a hard limit, but they're printed in every CI run so
+// a regression shows up against the previous ones.
+
+#include "envelope.h"
+#include "framer.h"
+#include "log_ring.h"
+#include "ota_patch.h"
+
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+template<typename Callback>
+static double timeSeconds(Callback &&callback) {
+    auto started = std::chrono::steady_clock::now();
+    callback();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    return elapsed.count();
+}
+
+static void report(const char *name, double seconds, size_t count, const char *unit) {
+    char message[128];
+    snprintf(message, sizeof(message), "%s: %.1f M%s/s (%zu %s in %.3fs)", name, (count / seconds) / 1e6, unit, count, unit, seconds);
+    TEST_MESSAGE(message);
+}
+
+// X1 responses are a letter, a value, and a newline, with the occasional longer text line.
+static std::vector<uint8_t> makeSerialStream(size_t length) {
+    static const char text[] = "WARNING: test response\n";
+
+    std::vector<uint8_t> stream;
+    stream.reserve(length + sizeof(text));
+    for (size_t i = 0; stream.size() < length; ++i) {
+        if ((i % 16) == 15) {
+            stream.insert(stream.end(), text, text + sizeof(text) - 1);
+            continue;
+        }
+
+        uint8_t frame[] = { (uint8_t)('a' + (i % 26)), (uint8_t)(i & 0x7F), '\n' };
+        stream.insert(stream.end(), frame, frame + sizeof(frame));
+    }
+
+    return stream;
+}
+
+static void test_framer_throughput() {
+    static LineFramer<1024> framer;
+    auto stream = makeSerialStream(8 * 1024 * 1024);
+
+    // SPP data arrives in chunks of up to the L2CAP MTU.
+    constexpr size_t CHUNK_SIZE = 128;
+
+    size_t framed_bytes = 0;
+    double seconds = timeSeconds([&]() {
+        for (size_t offset = 0; offset < stream.size(); offset += CHUNK_SIZE) {
+            size_t length = std::min(CHUNK_SIZE, stream.size() - offset);
+            TEST_ASSERT_EQUAL(length, framer.push(&stream[offset], length));
+
+            framer.drain([&](const uint8_t *, size_t frame_length) {
+                framed_bytes += frame_length;
+            });
+        }
+    });
+
+    TEST_ASSERT_EQUAL(stream.size(), framed_bytes);
+    report("spp->ble framer", seconds, stream.size(), "B");
+}
+
+static void test_envelope_packing_throughput() {
+    static EnvelopePacker<512> packer;
+    auto stream = makeSerialStream(8 * 1024 * 1024);
+
+    size_t framed_bytes = 0;
+    size_t envelopes = 0;
+    auto on_envelope = [&](const uint8_t *, size_t) {
+        ++envelopes;
+    };
+
+    double seconds = timeSeconds([&]() {
+        const uint8_t *frame = stream.data();
+        const uint8_t *end = stream.data() + stream.size();
+        while (frame < end) {
+            const uint8_t *delimiter = findByte(frame, end - frame, '\n');
+            size_t length = (delimiter ? delimiter + 1 : end) - frame;
+
+            size_t offset = 0;
+            do {
+                offset += packer.append(frame + offset, length - offset);
+                if (offset < length || packer.full()) {
+                    packer.finish(0, 0, 0, 0, on_envelope);
+                }
+            } while (offset < length);
+
+            framed_bytes += length;
+            frame += length;
+        }
+
+        if (!packer.empty()) {
+            packer.finish(0, 0, 0, 0, on_envelope);
+        }
+    });
+
+    TEST_ASSERT_EQUAL(stream.size(), framed_bytes);
+    TEST_ASSERT_GREATER_THAN(0, envelopes);
+    report("envelope packing", seconds, stream.size(), "B");
+}
+
+static void test_log_formatting_cost() {
+    // The same path as Log::print, formatted into a slot sized buffer then queued.
+    static LogRing<64, 128> ring;
+    constexpr size_t MESSAGES = 1000000;
+
+    size_t popped = 0;
+    double seconds = timeSeconds([&]() {
+        for (size_t i = 0; i < MESSAGES; ++i) {
+            char message[128];
+            int length = snprintf(message, sizeof(message), "[%6u][I][ble] ble client mtu updated from %d to %d\n", (unsigned)i, 23, 517);
+            TEST_ASSERT_TRUE(ring.push(message, length));
+
+            ring.pop([&](const char *, size_t) {
+                ++popped;
+            });
+        }
+    });
+
+    TEST_ASSERT_EQUAL(MESSAGES, popped);
+    report("log format + queue", seconds, MESSAGES, "msg");
+}
+
+static void test_ota_chunk_handling() {
+    // A delta image alternating copies from the running image and inserted literals.
+    constexpr size_t IMAGE_SIZE = 1024 * 1024;
+    constexpr size_t BLOCK_SIZE = 4096;
+
+    std::vector<uint8_t> source(IMAGE_SIZE);
+    for (size_t i = 0; i < source.size(); ++i) {
+        source[i] = (i * 31) & 0xFF;
+    }
+
+    auto appendUint32 = [](std::vector<uint8_t> &data, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            data.push_back((value >> (i * 8)) & 0xFF);
+        }
+    };
+
+    std::vector<uint8_t> patch(OtaPatch::MAGIC, OtaPatch::MAGIC + sizeof(OtaPatch::MAGIC));
+    appendUint32(patch, IMAGE_SIZE);
+    patch.insert(patch.end(), 32, 0);
+    appendUint32(patch, IMAGE_SIZE);
+
+    for (size_t offset = 0; offset < IMAGE_SIZE; offset += BLOCK_SIZE) {
+        if ((offset / BLOCK_SIZE) % 2 == 0) {
+            patch.push_back(OtaPatch::OP_COPY);
+            appendUint32(patch, offset);
+            appendUint32(patch, BLOCK_SIZE);
+        } else {
+            patch.push_back(OtaPatch::OP_INSERT);
+            appendUint32(patch, BLOCK_SIZE);
+            patch.insert(patch.end(), &source[offset], &source[offset] + BLOCK_SIZE);
+        }
+    }
+
+    // The size of an OTA write at the largest MTU.
+    constexpr size_t CHUNK_SIZE = 512;
+    constexpr size_t ROUNDS = 32;
+
+    std::vector<uint8_t> target(IMAGE_SIZE);
+    size_t written = 0;
+    size_t completed = 0;
+    double seconds = timeSeconds([&]() {
+        for (size_t round = 0; round < ROUNDS; ++round) {
+            OtaPatch applier(nullptr, [&](size_t offset, uint8_t *data, size_t length) {
+                memcpy(data, &source[offset], length);
+                return true;
+            }, [&](const uint8_t *data, size_t length) {
+                memcpy(&target[written % IMAGE_SIZE], data, length);
+                written += length;
+                return true;
+            });
+
+            for (size_t offset = 0; offset < patch.size(); offset += CHUNK_SIZE) {
+                size_t length = std::min(CHUNK_SIZE, patch.size() - offset);
+                TEST_ASSERT_TRUE(applier.push(&patch[offset], length));
+            }
+
+            completed += applier.isComplete() ? 1 : 0;
+        }
+    });
+
+    TEST_ASSERT_EQUAL(ROUNDS, completed);
+    TEST_ASSERT_EQUAL(ROUNDS * IMAGE_SIZE, written);
+    TEST_ASSERT_EQUAL_MEMORY(source.data(), target.data(), IMAGE_SIZE);
+    report("ota patch chunks", seconds, ROUNDS * patch.size(), "B");
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_framer_throughput);
+    RUN_TEST(test_envelope_packing_throughput);
+    RUN_TEST(test_log_formatting_cost);
+    RUN_TEST(test_ota_chunk_handling);
+    return UNITY_END();
+}
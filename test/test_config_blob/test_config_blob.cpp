@@ -0,0 +1,97 @@
+#include "config_blob.h"
+
+#include <unity.h>
+
+#include <vector>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static std::optional<ConfigBlob> decode(const std::vector<uint8_t> &data) {
+    return ConfigBlob::decode(data.data(), data.size());
+}
+
+static void test_round_trip() {
+    ConfigBlob blob;
+    blob.name = "X1 Bridge";
+    blob.pin_code = 123456;
+    blob.bt_address = std::array<uint8_t, 6> { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+    blob.bt_address_name = "X1";
+    blob.connected_idle_timeout = 90;
+    blob.disconnected_idle_timeout = 1800;
+    blob.auto_connect = true;
+
+    auto decoded = decode(blob.encode());
+    TEST_ASSERT_TRUE(decoded.has_value());
+    TEST_ASSERT_EQUAL_STRING("X1 Bridge", decoded->name->c_str());
+    TEST_ASSERT_EQUAL(123456, *decoded->pin_code);
+    TEST_ASSERT_EQUAL_MEMORY(blob.bt_address->data(), decoded->bt_address->data(), 6);
+    TEST_ASSERT_FALSE(decoded->clear_bt_address);
+    TEST_ASSERT_EQUAL_STRING("X1", decoded->bt_address_name->c_str());
+    TEST_ASSERT_EQUAL(90, *decoded->connected_idle_timeout);
+    TEST_ASSERT_EQUAL(1800, *decoded->disconnected_idle_timeout);
+    TEST_ASSERT_TRUE(*decoded->auto_connect);
+}
+
+static void test_absent_fields_stay_absent() {
+    auto decoded = decode({ ConfigBlob::VERSION });
+    TEST_ASSERT_TRUE(decoded.has_value());
+    TEST_ASSERT_FALSE(decoded->name.has_value());
+    TEST_ASSERT_FALSE(decoded->pin_code.has_value());
+    TEST_ASSERT_FALSE(decoded->bt_address.has_value());
+    TEST_ASSERT_FALSE(decoded->clear_bt_address);
+    TEST_ASSERT_FALSE(decoded->auto_connect.has_value());
+}
+
+static void test_empty_address_clears() {
+    ConfigBlob blob;
+    blob.clear_bt_address = true;
+
+    auto decoded = decode(blob.encode());
+    TEST_ASSERT_TRUE(decoded.has_value());
+    TEST_ASSERT_FALSE(decoded->bt_address.has_value());
+    TEST_ASSERT_TRUE(decoded->clear_bt_address);
+}
+
+static void test_unknown_tags_are_skipped() {
+    auto decoded = decode({ ConfigBlob::VERSION, 0x7F, 2, 0xAA, 0xBB, ConfigBlob::TAG_AUTO_CONNECT, 1, 0 });
+    TEST_ASSERT_TRUE(decoded.has_value());
+    TEST_ASSERT_FALSE(*decoded->auto_connect);
+}
+
+static void test_malformed_blobs_are_rejected() {
+    // Empty, or the wrong version.
+    TEST_ASSERT_FALSE(decode({}).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION + 1 }).has_value());
+
+    // A record header or value cut short.
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_NAME }).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_NAME, 4, 'X', '1' }).has_value());
+
+    // Values of the wrong size or out of range.
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_NAME, 0 }).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_PIN_CODE, 4, 0x40, 0x42, 0x0F, 0x00 }).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_BT_ADDRESS, 3, 1, 2, 3 }).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_CONNECTED_IDLE_TIMEOUT, 2, 90, 0 }).has_value());
+    TEST_ASSERT_FALSE(decode({ ConfigBlob::VERSION, ConfigBlob::TAG_AUTO_CONNECT, 1, 2 }).has_value());
+}
+
+static void test_invalid_record_rejects_whole_blob() {
+    // The valid name before it doesn't get through on its own.
+    auto decoded = decode({ ConfigBlob::VERSION, ConfigBlob::TAG_NAME, 2, 'X', '1', ConfigBlob::TAG_AUTO_CONNECT, 1, 5 });
+    TEST_ASSERT_FALSE(decoded.has_value());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_absent_fields_stay_absent);
+    RUN_TEST(test_empty_address_clears);
+    RUN_TEST(test_unknown_tags_are_skipped);
+    RUN_TEST(test_malformed_blobs_are_rejected);
+    RUN_TEST(test_invalid_record_rejects_whole_blob);
+    return UNITY_END();
+}
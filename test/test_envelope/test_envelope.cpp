@@ -0,0 +1,169 @@
+#include "envelope.h"
+
+#include <unity.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+struct Envelope {
+    EnvelopeHeader header;
+    std::vector<std::string> records;
+};
+
+static Envelope parse(const std::vector<uint8_t> &data) {
+    auto header = EnvelopeHeader::decode(data.data(), data.size());
+    TEST_ASSERT_TRUE(header.has_value());
+
+    Envelope envelope = { *header, {} };
+    size_t offset = EnvelopeHeader::SIZE;
+    while (offset < data.size()) {
+        TEST_ASSERT_TRUE((data.size() - offset) >= 2);
+        size_t length = data[offset] | (data[offset + 1] << 8);
+        offset += 2;
+
+        TEST_ASSERT_TRUE((data.size() - offset) >= length);
+        envelope.records.emplace_back(reinterpret_cast<const char *>(&data[offset]), length);
+        offset += length;
+    }
+
+    return envelope;
+}
+
+template<size_t Capacity>
+static std::vector<uint8_t> finish(EnvelopePacker<Capacity> &packer, uint16_t sequence, uint8_t flags = 0) {
+    std::vector<uint8_t> envelope;
+    packer.finish(sequence, 0x1234, flags, 0xDEADBEEF, [&](const uint8_t *data, size_t length) {
+        envelope.assign(data, data + length);
+    });
+
+    return envelope;
+}
+
+template<size_t Capacity>
+static size_t appendString(EnvelopePacker<Capacity> &packer, const std::string &frame) {
+    return packer.append(reinterpret_cast<const uint8_t *>(frame.data()), frame.size());
+}
+
+static void test_header_round_trip() {
+    EnvelopeHeader header = { 3, 0xBEEF, 0x0102, EnvelopeHeader::FLAG_RX_DROPPED, 0x89ABCDEF };
+
+    uint8_t data[EnvelopeHeader::SIZE + 3] = {};
+    header.encode(data);
+
+    const uint8_t expected[] = { 0x03, 0x00, 0xEF, 0xBE, 0x02, 0x01, 0x02, 0xEF, 0xCD, 0xAB, 0x89 };
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, data, sizeof(expected));
+
+    auto decoded = EnvelopeHeader::decode(data, sizeof(data));
+    TEST_ASSERT_TRUE(decoded.has_value());
+    TEST_ASSERT_EQUAL(3, decoded->length);
+    TEST_ASSERT_EQUAL(0xBEEF, decoded->sequence);
+    TEST_ASSERT_EQUAL(0x0102, decoded->ack);
+    TEST_ASSERT_EQUAL(EnvelopeHeader::FLAG_RX_DROPPED, decoded->flags);
+    TEST_ASSERT_EQUAL(0x89ABCDEF, decoded->timestamp);
+}
+
+static void test_decode_rejects_length_mismatch() {
+    uint8_t data[EnvelopeHeader::SIZE + 4] = {};
+    EnvelopeHeader header = { 3, 0, 0, 0, 0 };
+    header.encode(data);
+
+    TEST_ASSERT_FALSE(EnvelopeHeader::decode(data, EnvelopeHeader::SIZE - 1).has_value());
+    TEST_ASSERT_FALSE(EnvelopeHeader::decode(data, EnvelopeHeader::SIZE + 2).has_value());
+    TEST_ASSERT_FALSE(EnvelopeHeader::decode(data, EnvelopeHeader::SIZE + 4).has_value());
+    TEST_ASSERT_TRUE(EnvelopeHeader::decode(data, EnvelopeHeader::SIZE + 3).has_value());
+}
+
+static void test_frames_are_packed_as_records() {
+    EnvelopePacker<64> packer;
+    TEST_ASSERT_TRUE(packer.empty());
+
+    TEST_ASSERT_EQUAL(3, appendString(packer, "s\x14\n"));
+    TEST_ASSERT_EQUAL(3, appendString(packer, "m\x0E\n"));
+    TEST_ASSERT_FALSE(packer.empty());
+
+    Envelope envelope = parse(finish(packer, 7));
+    TEST_ASSERT_EQUAL(7, envelope.header.sequence);
+    TEST_ASSERT_EQUAL(0x1234, envelope.header.ack);
+    TEST_ASSERT_EQUAL(0xDEADBEEF, envelope.header.timestamp);
+    TEST_ASSERT_EQUAL(0, envelope.header.flags);
+    TEST_ASSERT_EQUAL(2, envelope.records.size());
+    TEST_ASSERT_EQUAL_STRING("s\x14\n", envelope.records[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("m\x0E\n", envelope.records[1].c_str());
+
+    TEST_ASSERT_TRUE(packer.empty());
+}
+
+static void test_long_frame_is_continued() {
+    EnvelopePacker<64> packer;
+    packer.setLimit(EnvelopeHeader::SIZE + 2 + 10);
+
+    std::string frame = "WARNING: test response\n";
+    size_t offset = 0;
+    std::string reassembled;
+    std::vector<Envelope> envelopes;
+    while (offset < frame.size()) {
+        offset += appendString(packer, frame.substr(offset));
+        TEST_ASSERT_TRUE(packer.full() || offset == frame.size());
+
+        envelopes.push_back(parse(finish(packer, envelopes.size())));
+        reassembled += envelopes.back().records[0];
+    }
+
+    TEST_ASSERT_EQUAL(3, envelopes.size());
+    TEST_ASSERT_TRUE((envelopes[0].header.flags & EnvelopeHeader::FLAG_CONTINUED) != 0);
+    TEST_ASSERT_TRUE((envelopes[1].header.flags & EnvelopeHeader::FLAG_CONTINUED) != 0);
+    TEST_ASSERT_TRUE((envelopes[2].header.flags & EnvelopeHeader::FLAG_CONTINUED) == 0);
+    TEST_ASSERT_EQUAL_STRING(frame.c_str(), reassembled.c_str());
+}
+
+static void test_full_packer_takes_nothing() {
+    EnvelopePacker<64> packer;
+    packer.setLimit(EnvelopeHeader::SIZE + 2 + 3);
+
+    TEST_ASSERT_EQUAL(3, appendString(packer, "u0\n"));
+    TEST_ASSERT_TRUE(packer.full());
+    TEST_ASSERT_EQUAL(0, appendString(packer, "m\x0E\n"));
+
+    Envelope envelope = parse(finish(packer, 0));
+    TEST_ASSERT_EQUAL(1, envelope.records.size());
+    TEST_ASSERT_TRUE((envelope.header.flags & EnvelopeHeader::FLAG_CONTINUED) == 0);
+}
+
+static void test_limit_applies_from_next_envelope() {
+    EnvelopePacker<64> packer;
+    TEST_ASSERT_EQUAL(5, appendString(packer, "hello"));
+
+    // Lowered partway through, the envelope being built keeps the limit it started with.
+    packer.setLimit(EnvelopeHeader::SIZE + 2 + 8);
+    TEST_ASSERT_EQUAL(10, appendString(packer, "0123456789"));
+    TEST_ASSERT_EQUAL(EnvelopeHeader::SIZE + 2 + 5 + 2 + 10, finish(packer, 0).size());
+
+    TEST_ASSERT_EQUAL(8, appendString(packer, "0123456789"));
+}
+
+static void test_flags_are_passed_through() {
+    EnvelopePacker<64> packer;
+    appendString(packer, "x\n");
+
+    Envelope envelope = parse(finish(packer, 0, EnvelopeHeader::FLAG_RX_DROPPED | EnvelopeHeader::FLAG_TX_DROPPED));
+    TEST_ASSERT_EQUAL(EnvelopeHeader::FLAG_RX_DROPPED | EnvelopeHeader::FLAG_TX_DROPPED, envelope.header.flags);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_header_round_trip);
+    RUN_TEST(test_decode_rejects_length_mismatch);
+    RUN_TEST(test_frames_are_packed_as_records);
+    RUN_TEST(test_long_frame_is_continued);
+    RUN_TEST(test_full_packer_takes_nothing);
+    RUN_TEST(test_limit_applies_from_next_envelope);
+    RUN_TEST(test_flags_are_passed_through);
+    return UNITY_END();
+}
@@ -0,0 +1,125 @@
+#include "framer.h"
+
+#include <unity.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+static std::vector<std::string> drainAll(LineFramer<64> &framer) {
+    std::vector<std::string> frames;
+    framer.drain([&](const uint8_t *data, size_t length) {
+        frames.emplace_back(reinterpret_cast<const char *>(data), length);
+    });
+
+    return frames;
+}
+
+static size_t pushString(LineFramer<64> &framer, const char *data) {
+    return framer.push(reinterpret_cast<const uint8_t *>(data), strlen(data));
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void test_find_byte_matches_memchr() {
+    uint8_t data[67];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = 'a' + (i % 26);
+    }
+
+    // Every alignment and length, for the first and a missing value.
+    for (size_t start = 0; start < 8; ++start) {
+        for (size_t length = 0; length <= sizeof(data) - start; ++length) {
+            for (uint8_t value : { (uint8_t)'a', (uint8_t)'k', (uint8_t)'\n' }) {
+                const void *expected = memchr(data + start, value, length);
+                TEST_ASSERT_EQUAL_PTR(expected, findByte(data + start, length, value));
+            }
+        }
+    }
+}
+
+static void test_single_frame() {
+    LineFramer<64> framer;
+    pushString(framer, "Gs\n");
+
+    auto frames = drainAll(framer);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("Gs\n", frames[0].c_str());
+    TEST_ASSERT_TRUE(framer.empty());
+}
+
+static void test_multiple_frames_in_one_push() {
+    LineFramer<64> framer;
+    pushString(framer, "s\x14\nm\x0E\nt");
+
+    auto frames = drainAll(framer);
+    TEST_ASSERT_EQUAL(2, frames.size());
+    TEST_ASSERT_EQUAL_STRING("s\x14\n", frames[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("m\x0E\n", frames[1].c_str());
+
+    // The partial frame stays buffered until its delimiter arrives.
+    TEST_ASSERT_FALSE(framer.empty());
+
+    pushString(framer, "\n");
+
+    frames = drainAll(framer);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("t\n", frames[0].c_str());
+}
+
+static void test_frame_split_across_pushes() {
+    LineFramer<64> framer;
+    pushString(framer, "WARNING: ");
+    TEST_ASSERT_EQUAL(0, drainAll(framer).size());
+
+    pushString(framer, "test response");
+    TEST_ASSERT_EQUAL(0, drainAll(framer).size());
+
+    pushString(framer, "\n");
+    auto frames = drainAll(framer);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("WARNING: test response\n", frames[0].c_str());
+}
+
+static void test_frames_wrapping_the_ring() {
+    LineFramer<64> framer;
+
+    // 7 byte frames don't divide the ring, so they end up straddling the end of it.
+    for (int i = 0; i < 100; ++i) {
+        char frame[8];
+        snprintf(frame, sizeof(frame), "f%04d\r\n", i);
+        TEST_ASSERT_EQUAL(7, pushString(framer, frame));
+
+        auto frames = drainAll(framer);
+        TEST_ASSERT_EQUAL(1, frames.size());
+        TEST_ASSERT_EQUAL_STRING(frame, frames[0].c_str());
+    }
+}
+
+static void test_full_ring_without_delimiter_is_emitted() {
+    LineFramer<64> framer;
+
+    std::string data(80, 'x');
+    TEST_ASSERT_EQUAL(64, pushString(framer, data.c_str()));
+    TEST_ASSERT_EQUAL(0, framer.space());
+
+    auto frames = drainAll(framer);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL(64, frames[0].size());
+    TEST_ASSERT_TRUE(framer.empty());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_find_byte_matches_memchr);
+    RUN_TEST(test_single_frame);
+    RUN_TEST(test_multiple_frames_in_one_push);
+    RUN_TEST(test_frame_split_across_pushes);
+    RUN_TEST(test_frames_wrapping_the_ring);
+    RUN_TEST(test_full_ring_without_delimiter_is_emitted);
+    return UNITY_END();
+}
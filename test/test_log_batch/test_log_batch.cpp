@@ -0,0 +1,96 @@
+#include "log_batch.h"
+
+#include <unity.h>
+
+#include <string>
+#include <vector>
+
+static std::vector<std::string> sent;
+
+static void collect(const char *data, size_t length) {
+    sent.emplace_back(data, length);
+}
+
+static std::string joined() {
+    std::string all;
+    for (const std::string &chunk : sent) {
+        all += chunk;
+    }
+    return all;
+}
+
+void setUp() {
+    sent.clear();
+}
+
+void tearDown() {
+}
+
+static void test_lines_are_packed_up_to_limit() {
+    LogBatch<64> batch;
+    batch.write("one\n", 4, 20, collect);
+    batch.write("two\n", 4, 20, collect);
+    batch.write("three\n", 6, 20, collect);
+    TEST_ASSERT_EQUAL(0, sent.size());
+
+    batch.send(20, true, collect);
+    TEST_ASSERT_EQUAL(1, sent.size());
+    TEST_ASSERT_EQUAL_STRING("one\ntwo\nthree\n", sent[0].c_str());
+    TEST_ASSERT_EQUAL(0, batch.length());
+}
+
+static void test_partial_line_is_held() {
+    LogBatch<64> batch;
+    batch.write("done\npart", 9, 20, collect);
+    batch.send(20, true, collect);
+
+    TEST_ASSERT_EQUAL(1, sent.size());
+    TEST_ASSERT_EQUAL_STRING("done\n", sent[0].c_str());
+    TEST_ASSERT_EQUAL(4, batch.length());
+}
+
+static void test_long_line_goes_out_in_pieces() {
+    LogBatch<64> batch;
+    std::string line(50, 'x');
+    line += '\n';
+    batch.write(line.data(), line.size(), 20, collect);
+    batch.send(20, true, collect);
+
+    for (const std::string &chunk : sent) {
+        TEST_ASSERT_TRUE(chunk.size() <= 20);
+    }
+    TEST_ASSERT_EQUAL_STRING(line.c_str(), joined().c_str());
+}
+
+static void test_lower_limit_while_full() {
+    LogBatch<64> batch;
+
+    // Fill the batch right up at a large limit, no newline so nothing can go yet.
+    std::string first(64, 'a');
+    batch.write(first.data(), first.size(), 64, collect);
+    TEST_ASSERT_EQUAL(0, sent.size());
+    TEST_ASSERT_EQUAL(64, batch.length());
+
+    // Then a client with a small MTU arrives.
+    std::string second(40, 'b');
+    second += '\n';
+    batch.write(second.data(), second.size(), 8, collect);
+
+    TEST_ASSERT_TRUE(batch.length() < 8);
+    batch.send(8, true, collect);
+
+    for (const std::string &chunk : sent) {
+        TEST_ASSERT_TRUE(chunk.size() <= 8);
+    }
+    TEST_ASSERT_EQUAL_STRING((first + second).c_str(), joined().c_str());
+    TEST_ASSERT_EQUAL(0, batch.length());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_lines_are_packed_up_to_limit);
+    RUN_TEST(test_partial_line_is_held);
+    RUN_TEST(test_long_line_goes_out_in_pieces);
+    RUN_TEST(test_lower_limit_while_full);
+    return UNITY_END();
+}
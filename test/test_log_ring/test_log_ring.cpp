@@ -0,0 +1,226 @@
+#include "log_ring.h"
+
+#include <unity.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static bool pushString(LogRing<4, 16> &ring, const std::string &message) {
+    return ring.push(message.data(), message.size());
+}
+
+static std::string popString(LogRing<4, 16> &ring) {
+    std::string message;
+    TEST_ASSERT_TRUE(ring.pop([&](const char *data, size_t length) {
+        message.assign(data, length);
+    }));
+
+    return message;
+}
+
+static void test_messages_come_out_in_order() {
+    LogRing<4, 16> ring;
+    TEST_ASSERT_TRUE(ring.empty());
+
+    TEST_ASSERT_TRUE(pushString(ring, "one\n"));
+    TEST_ASSERT_TRUE(pushString(ring, "two\n"));
+    TEST_ASSERT_FALSE(ring.empty());
+
+    TEST_ASSERT_EQUAL_STRING("one\n", popString(ring).c_str());
+    TEST_ASSERT_EQUAL_STRING("two\n", popString(ring).c_str());
+    TEST_ASSERT_TRUE(ring.empty());
+}
+
+static void test_pop_on_empty_ring() {
+    LogRing<4, 16> ring;
+
+    bool called = false;
+    TEST_ASSERT_FALSE(ring.pop([&](const char *, size_t) {
+        called = true;
+    }));
+    TEST_ASSERT_FALSE(called);
+}
+
+static void test_full_ring_rejects_push() {
+    LogRing<4, 16> ring;
+    for (int i = 0; i < 4; ++i) {
+        TEST_ASSERT_TRUE(pushString(ring, std::to_string(i)));
+    }
+
+    TEST_ASSERT_FALSE(pushString(ring, "dropped"));
+
+    // Room again once the consumer has caught up.
+    TEST_ASSERT_EQUAL_STRING("0", popString(ring).c_str());
+    TEST_ASSERT_TRUE(pushString(ring, "4"));
+
+    for (int i = 1; i <= 4; ++i) {
+        TEST_ASSERT_EQUAL_STRING(std::to_string(i).c_str(), popString(ring).c_str());
+    }
+}
+
+static void test_long_messages_are_truncated() {
+    LogRing<4, 16> ring;
+    TEST_ASSERT_TRUE(pushString(ring, "this message is longer than a slot\n"));
+    TEST_ASSERT_EQUAL_STRING("this message is ", popString(ring).c_str());
+}
+
+static void test_whole_messages_span_slots() {
+    LogRing<4, 16> ring;
+    TEST_ASSERT_TRUE(ring.pushWhole("this message is longer than a slot\n", 35));
+
+    TEST_ASSERT_EQUAL_STRING("this message is ", popString(ring).c_str());
+    TEST_ASSERT_EQUAL_STRING("longer than a sl", popString(ring).c_str());
+    TEST_ASSERT_EQUAL_STRING("ot\n", popString(ring).c_str());
+    TEST_ASSERT_TRUE(ring.empty());
+}
+
+static void test_whole_message_without_room_is_dropped() {
+    LogRing<4, 16> ring;
+    TEST_ASSERT_TRUE(pushString(ring, "0"));
+    TEST_ASSERT_TRUE(pushString(ring, "1"));
+
+    // Needs three slots with only two free, none of it goes in.
+    TEST_ASSERT_FALSE(ring.pushWhole("this message is longer than a slot\n", 35));
+    TEST_ASSERT_TRUE(pushString(ring, "2"));
+
+    TEST_ASSERT_EQUAL_STRING("0", popString(ring).c_str());
+    TEST_ASSERT_EQUAL_STRING("1", popString(ring).c_str());
+    TEST_ASSERT_EQUAL_STRING("2", popString(ring).c_str());
+    TEST_ASSERT_TRUE(ring.empty());
+
+    // More slots than the ring has can never fit.
+    TEST_ASSERT_FALSE(ring.pushWhole(std::string(65, 'x').c_str(), 65));
+}
+
+static void test_sequences_survive_wrapping() {
+    LogRing<4, 16> ring;
+    for (int i = 0; i < 1000; ++i) {
+        TEST_ASSERT_TRUE(pushString(ring, std::to_string(i)));
+        TEST_ASSERT_EQUAL_STRING(std::to_string(i).c_str(), popString(ring).c_str());
+    }
+}
+
+static void test_concurrent_producers() {
+    static LogRing<64, 16> ring;
+    constexpr int PRODUCERS = 4;
+    constexpr int MESSAGES = 10000;
+
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < PRODUCERS; ++producer) {
+        producers.emplace_back([producer]() {
+            for (int i = 0; i < MESSAGES; ++i) {
+                std::string message = std::to_string(producer) + ":" + std::to_string(i);
+                while (!ring.push(message.data(), message.size())) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // Each producer's messages must arrive complete and in the order they were pushed.
+    std::vector<int> next(PRODUCERS, 0);
+    int received = 0;
+    bool ordered = true;
+    while (received < PRODUCERS * MESSAGES) {
+        bool popped = ring.pop([&](const char *data, size_t length) {
+            std::string message(data, length);
+            size_t separator = message.find(':');
+            int producer = std::stoi(message.substr(0, separator));
+            int i = std::stoi(message.substr(separator + 1));
+
+            ordered = ordered && (i == next[producer]);
+            next[producer] = i + 1;
+        });
+
+        if (popped) {
+            ++received;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    for (auto &producer : producers) {
+        producer.join();
+    }
+
+    TEST_ASSERT_TRUE(ordered);
+    TEST_ASSERT_TRUE(ring.empty());
+}
+
+static void test_concurrent_whole_messages() {
+    static LogRing<64, 16> ring;
+    constexpr int PRODUCERS = 4;
+    constexpr int MESSAGES = 5000;
+
+    // Every message is three slots long, and has to come out with its pieces back to back.
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < PRODUCERS; ++producer) {
+        producers.emplace_back([producer]() {
+            for (int i = 0; i < MESSAGES; ++i) {
+                std::string message = std::to_string(producer) + ":" + std::to_string(i) + ":";
+                message.resize(40, 'a' + producer);
+                message += '\n';
+                while (!ring.pushWhole(message.data(), message.size())) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<int> next(PRODUCERS, 0);
+    std::string pending;
+    int received = 0;
+    bool intact = true;
+    while (received < PRODUCERS * MESSAGES) {
+        bool popped = ring.pop([&](const char *data, size_t length) {
+            pending.append(data, length);
+        });
+
+        if (!popped) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (pending.back() != '\n') {
+            continue;
+        }
+
+        int producer = std::stoi(pending.substr(0, pending.find(':')));
+        std::string expected = std::to_string(producer) + ":" + std::to_string(next[producer]) + ":";
+        expected.resize(40, 'a' + producer);
+        expected += '\n';
+
+        intact = intact && (pending == expected);
+        ++next[producer];
+        ++received;
+        pending.clear();
+    }
+
+    for (auto &producer : producers) {
+        producer.join();
+    }
+
+    TEST_ASSERT_TRUE(intact);
+    TEST_ASSERT_TRUE(ring.empty());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_messages_come_out_in_order);
+    RUN_TEST(test_pop_on_empty_ring);
+    RUN_TEST(test_full_ring_rejects_push);
+    RUN_TEST(test_long_messages_are_truncated);
+    RUN_TEST(test_whole_messages_span_slots);
+    RUN_TEST(test_whole_message_without_room_is_dropped);
+    RUN_TEST(test_sequences_survive_wrapping);
+    RUN_TEST(test_concurrent_producers);
+    RUN_TEST(test_concurrent_whole_messages);
+    return UNITY_END();
+}
@@ -0,0 +1,183 @@
+#include "ota_patch.h"
+
+#include <unity.h>
+
+#include <cstring>
+#include <vector>
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void appendUint32(std::vector<uint8_t> &data, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        data.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+static std::vector<uint8_t> makeHeader(uint32_t source_size, uint32_t target_size) {
+    std::vector<uint8_t> patch(OtaPatch::MAGIC, OtaPatch::MAGIC + sizeof(OtaPatch::MAGIC));
+    appendUint32(patch, source_size);
+    patch.insert(patch.end(), 32, 0xAB);
+    appendUint32(patch, target_size);
+    return patch;
+}
+
+static void appendCopy(std::vector<uint8_t> &patch, uint32_t offset, uint32_t length) {
+    patch.push_back(OtaPatch::OP_COPY);
+    appendUint32(patch, offset);
+    appendUint32(patch, length);
+}
+
+static void appendInsert(std::vector<uint8_t> &patch, const std::vector<uint8_t> &data) {
+    patch.push_back(OtaPatch::OP_INSERT);
+    appendUint32(patch, data.size());
+    patch.insert(patch.end(), data.begin(), data.end());
+}
+
+struct PatchFixture {
+    std::vector<uint8_t> source;
+    std::vector<uint8_t> target;
+    bool accept_header = true;
+
+    OtaPatch patch {
+        [this](const OtaPatch::Header &header) {
+            return accept_header && header.source_size == source.size();
+        },
+        [this](size_t offset, uint8_t *data, size_t length) {
+            if (offset + length > source.size()) {
+                return false;
+            }
+
+            memcpy(data, &source[offset], length);
+            return true;
+        },
+        [this](const uint8_t *data, size_t length) {
+            target.insert(target.end(), data, data + length);
+            return true;
+        },
+    };
+
+    PatchFixture() {
+        for (size_t i = 0; i < 1000; ++i) {
+            source.push_back(i & 0xFF);
+        }
+    }
+};
+
+static std::vector<uint8_t> makePatch() {
+    // 600 bytes copied from the middle of the source, so more than one copy buffer, then 3 new ones.
+    auto patch = makeHeader(1000, 603);
+    appendCopy(patch, 100, 600);
+    appendInsert(patch, { 0x01, 0x02, 0x03 });
+    return patch;
+}
+
+static void checkTarget(const PatchFixture &fixture) {
+    TEST_ASSERT_EQUAL(603, fixture.target.size());
+    TEST_ASSERT_EQUAL_MEMORY(&fixture.source[100], fixture.target.data(), 600);
+    TEST_ASSERT_EQUAL(0x01, fixture.target[600]);
+    TEST_ASSERT_EQUAL(0x03, fixture.target[602]);
+}
+
+static void test_applies_in_one_push() {
+    PatchFixture fixture;
+    auto patch = makePatch();
+
+    TEST_ASSERT_TRUE(fixture.patch.push(patch.data(), patch.size()));
+    TEST_ASSERT_TRUE(fixture.patch.isComplete());
+    checkTarget(fixture);
+}
+
+static void test_applies_a_byte_at_a_time() {
+    PatchFixture fixture;
+    auto patch = makePatch();
+
+    for (size_t i = 0; i < patch.size(); ++i) {
+        TEST_ASSERT_FALSE(fixture.patch.isComplete());
+        TEST_ASSERT_TRUE(fixture.patch.push(&patch[i], 1));
+    }
+
+    TEST_ASSERT_TRUE(fixture.patch.isComplete());
+    checkTarget(fixture);
+}
+
+static void test_rejects_bad_magic() {
+    PatchFixture fixture;
+    auto patch = makePatch();
+    patch[0] = 'Y';
+
+    TEST_ASSERT_FALSE(fixture.patch.push(patch.data(), patch.size()));
+    TEST_ASSERT_FALSE(fixture.patch.isComplete());
+}
+
+static void test_header_callback_can_refuse() {
+    PatchFixture fixture;
+    fixture.accept_header = false;
+    auto patch = makePatch();
+
+    TEST_ASSERT_FALSE(fixture.patch.push(patch.data(), patch.size()));
+    TEST_ASSERT_TRUE(fixture.target.empty());
+}
+
+static void test_rejects_copy_outside_source() {
+    PatchFixture fixture;
+    auto patch = makeHeader(1000, 100);
+    appendCopy(patch, 950, 100);
+
+    TEST_ASSERT_FALSE(fixture.patch.push(patch.data(), patch.size()));
+    TEST_ASSERT_TRUE(fixture.target.empty());
+}
+
+static void test_rejects_writing_past_target() {
+    PatchFixture fixture;
+    auto patch = makeHeader(1000, 2);
+    appendInsert(patch, { 0x01, 0x02, 0x03 });
+
+    TEST_ASSERT_FALSE(fixture.patch.push(patch.data(), patch.size()));
+}
+
+static void test_rejects_unknown_op() {
+    PatchFixture fixture;
+    auto patch = makeHeader(1000, 10);
+    patch.push_back(0x03);
+
+    TEST_ASSERT_FALSE(fixture.patch.push(patch.data(), patch.size()));
+}
+
+static void test_stays_failed() {
+    PatchFixture fixture;
+    auto bad = makeHeader(1000, 10);
+    bad.push_back(0x03);
+    TEST_ASSERT_FALSE(fixture.patch.push(bad.data(), bad.size()));
+
+    std::vector<uint8_t> insert;
+    appendInsert(insert, { 0x01 });
+    TEST_ASSERT_FALSE(fixture.patch.push(insert.data(), insert.size()));
+    TEST_ASSERT_TRUE(fixture.target.empty());
+}
+
+static void test_incomplete_until_target_written() {
+    PatchFixture fixture;
+    auto patch = makeHeader(1000, 10);
+    appendCopy(patch, 0, 5);
+
+    TEST_ASSERT_TRUE(fixture.patch.push(patch.data(), patch.size()));
+    TEST_ASSERT_FALSE(fixture.patch.isComplete());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_applies_in_one_push);
+    RUN_TEST(test_applies_a_byte_at_a_time);
+    RUN_TEST(test_rejects_bad_magic);
+    RUN_TEST(test_header_callback_can_refuse);
+    RUN_TEST(test_rejects_copy_outside_source);
+    RUN_TEST(test_rejects_writing_past_target);
+    RUN_TEST(test_rejects_unknown_op);
+    RUN_TEST(test_stays_failed);
+    RUN_TEST(test_incomplete_until_target_written);
+    return UNITY_END();
+}
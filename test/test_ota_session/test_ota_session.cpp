@@ -0,0 +1,392 @@
+#include "ota_session.h"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <vector>
+
+static constexpr size_t PARTITION_SIZE = 256 * 1024;
+static const uint8_t SIGNATURE[] = { 0x30, 0x44, 0x02, 0x20 };
+
+// Flash that only clears bits, so writing a sector that wasn't erased first shows up in the
+// image. The hash is FNV-1a, which is all a test of save and restore needs.
+class FakePlatform : public OtaPlatform {
+public:
+    FakePlatform() : pool(OtaSession::BUFFER_COUNT * Ota::BUFFER_SIZE), flash(PARTITION_SIZE, 0x00) {
+        for (size_t i = 0; i < OtaSession::BUFFER_COUNT; ++i) {
+            free_buffers.push_back(&pool[i * Ota::BUFFER_SIZE]);
+        }
+    }
+
+    // Runs count queued messages through the writer, or all of them.
+    void pump(OtaSession &session, size_t count = SIZE_MAX) {
+        while (count-- > 0 && !messages.empty()) {
+            OtaMessage message = messages.front();
+            messages.pop_front();
+            session.handleMessage(message);
+        }
+    }
+
+    // Space the producer can still fill without waiting on the writer.
+    size_t freeSpace(size_t unposted) const {
+        size_t queued = std::count_if(messages.begin(), messages.end(), [](const OtaMessage &message) {
+            return message.buffer != nullptr;
+        });
+        size_t filling = OtaSession::BUFFER_COUNT - free_buffers.size() - queued;
+        return (free_buffers.size() * Ota::BUFFER_SIZE) + (filling * (Ota::BUFFER_SIZE - unposted));
+    }
+
+    uint8_t *takeBuffer() override {
+        if (free_buffers.empty()) {
+            ++buffer_waits;
+            return nullptr;
+        }
+
+        uint8_t *buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    void returnBuffer(uint8_t *buffer) override {
+        TEST_ASSERT_TRUE(free_buffers.size() < OtaSession::BUFFER_COUNT);
+        free_buffers.push_back(buffer);
+    }
+
+    bool postMessage(const OtaMessage &message) override {
+        if (message.type == OtaMessageType::Chunk) {
+            posted_bytes += message.length;
+        }
+
+        messages.push_back(message);
+        return true;
+    }
+
+    bool loadCheckpoint(OtaCheckpoint &checkpoint) override {
+        if (!nvs) {
+            return false;
+        }
+
+        checkpoint = *nvs;
+        return true;
+    }
+
+    bool saveCheckpoint(const OtaCheckpoint &checkpoint) override {
+        nvs = checkpoint;
+        ++checkpoints_saved;
+        return true;
+    }
+
+    void clearCheckpoint() override {
+        nvs.reset();
+    }
+
+    void getAppId(uint8_t *app_id) override {
+        memset(app_id, 0xA5, 32);
+    }
+
+    bool getTarget(OtaPartitionInfo &info) override {
+        info = { 0x110000, PARTITION_SIZE, "ota_1" };
+        return true;
+    }
+
+    bool eraseTarget(size_t offset, size_t length) override {
+        TEST_ASSERT_EQUAL(0, offset % OtaSession::FLASH_SECTOR_SIZE);
+        TEST_ASSERT_TRUE((offset + length) <= flash.size());
+        std::fill(flash.begin() + offset, flash.begin() + offset + length, 0xFF);
+        return true;
+    }
+
+    bool writeTarget(size_t offset, const uint8_t *data, size_t length) override {
+        TEST_ASSERT_TRUE((offset + length) <= flash.size());
+        for (size_t i = 0; i < length; ++i) {
+            flash[offset + i] &= data[i];
+        }
+        return true;
+    }
+
+    void startHash(const uint8_t *state) override {
+        TEST_ASSERT_FALSE(hashing);
+        hashing = true;
+        hash = FNV_OFFSET;
+        if (state) {
+            memcpy(&hash, state, sizeof(hash));
+        }
+    }
+
+    void updateHash(const uint8_t *data, size_t length) override {
+        TEST_ASSERT_TRUE(hashing);
+        hash = fnv(hash, data, length);
+    }
+
+    void saveHash(uint8_t *state) override {
+        memcpy(state, &hash, sizeof(hash));
+    }
+
+    void finishHash(uint8_t *result) override {
+        TEST_ASSERT_TRUE(hashing);
+        hashing = false;
+        if (result) {
+            memset(result, 0, 32);
+            memcpy(result, &hash, sizeof(hash));
+        }
+    }
+
+    std::unique_ptr<OtaDecoder> createDecoder(OtaFormat, OtaDecoder::WriteCallback) override {
+        return nullptr;
+    }
+
+    bool verifySignature(const uint8_t *result, size_t result_length, const uint8_t *signature, size_t signature_length) override {
+        TEST_ASSERT_EQUAL(32, result_length);
+        memcpy(&verified_hash, result, sizeof(verified_hash));
+        return signature_length == sizeof(SIGNATURE) && memcmp(signature, SIGNATURE, sizeof(SIGNATURE)) == 0;
+    }
+
+    bool activateTarget() override {
+        activated = true;
+        return true;
+    }
+
+    static constexpr uint64_t FNV_OFFSET = 0xCBF29CE484222325ULL;
+
+    static uint64_t fnv(uint64_t hash, const uint8_t *data, size_t length) {
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ data[i]) * 0x100000001B3ULL;
+        }
+        return hash;
+    }
+
+    std::vector<uint8_t> pool;
+    std::vector<uint8_t *> free_buffers;
+    std::deque<OtaMessage> messages;
+    size_t posted_bytes = 0;
+    size_t buffer_waits = 0;
+
+    std::optional<OtaCheckpoint> nvs;
+    size_t checkpoints_saved = 0;
+    std::vector<uint8_t> flash;
+
+    bool hashing = false;
+    uint64_t hash = 0;
+    uint64_t verified_hash = 0;
+    bool activated = false;
+};
+
+struct Status {
+    size_t progress;
+    bool complete;
+    bool success;
+    uint16_t credits;
+};
+
+static std::vector<Status> statuses;
+
+static void recordStatus(OtaSession &session) {
+    statuses.clear();
+    session.setStatusCallback([](size_t progress, bool complete, bool success, uint16_t credits) {
+        statuses.push_back({ progress, complete, success, credits });
+    });
+}
+
+static std::vector<uint8_t> makeImage(size_t size, uint8_t seed) {
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size; ++i) {
+        image[i] = static_cast<uint8_t>((i * 31) + (i >> 8) + seed);
+    }
+    return image;
+}
+
+// Writes image[offset, end) in pieces of length, running the writer alongside.
+static void sendImage(FakePlatform &platform, OtaSession &session, const std::vector<uint8_t> &image, size_t offset, size_t end, size_t length) {
+    for (; offset < end; offset += length) {
+        TEST_ASSERT_TRUE(session.write(&image[offset], std::min(length, end - offset)));
+        platform.pump(session);
+    }
+}
+
+static void finishImage(FakePlatform &platform, OtaSession &session) {
+    TEST_ASSERT_TRUE(session.end(SIGNATURE, sizeof(SIGNATURE)));
+    platform.pump(session);
+}
+
+static void assertFlashHolds(const FakePlatform &platform, const std::vector<uint8_t> &image) {
+    TEST_ASSERT_EQUAL_MEMORY(image.data(), platform.flash.data(), image.size());
+}
+
+static void assertCompleted(const FakePlatform &platform) {
+    TEST_ASSERT_FALSE(statuses.empty());
+    TEST_ASSERT_TRUE(statuses.back().complete);
+    TEST_ASSERT_TRUE(statuses.back().success);
+    TEST_ASSERT_TRUE(platform.activated);
+    TEST_ASSERT_FALSE(platform.hashing);
+    TEST_ASSERT_EQUAL(OtaSession::BUFFER_COUNT, platform.free_buffers.size());
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void test_restart_mid_stream() {
+    FakePlatform platform;
+    OtaSession session(platform);
+    recordStatus(session);
+
+    std::vector<uint8_t> first = makeImage(40000, 1);
+    std::vector<uint8_t> second = makeImage(30000, 2);
+
+    TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, first.size(), 0, nullptr));
+    platform.pump(session);
+    sendImage(platform, session, first, 0, 10000, 500);
+
+    // A buffer of the first image still queued and one partly filled when the client starts over.
+    TEST_ASSERT_TRUE(session.write(&first[10000], Ota::BUFFER_SIZE));
+    TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, second.size(), 0, nullptr));
+    TEST_ASSERT_EQUAL(OtaSession::BUFFER_COUNT - 1, platform.free_buffers.size());
+
+    platform.pump(session);
+    sendImage(platform, session, second, 0, second.size(), 500);
+    finishImage(platform, session);
+
+    assertCompleted(platform);
+    assertFlashHolds(platform, second);
+    TEST_ASSERT_EQUAL_UINT64(FakePlatform::fnv(FakePlatform::FNV_OFFSET, second.data(), second.size()), platform.verified_hash);
+
+    // The first image was dropped without being reported as failed.
+    for (const Status &status : statuses) {
+        TEST_ASSERT_FALSE(status.complete && !status.success);
+    }
+}
+
+static void test_credits_never_exceed_free_buffers() {
+    FakePlatform platform;
+    OtaSession session(platform);
+    recordStatus(session);
+
+    static constexpr size_t CHUNK_SIZE = 500;
+    std::vector<uint8_t> image = makeImage(100000, 3);
+
+    TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, image.size(), CHUNK_SIZE, nullptr));
+
+    size_t credits = 0;
+    size_t seen = 0;
+    size_t sent = 0;
+    auto collect = [&]() {
+        for (; seen < statuses.size(); ++seen) {
+            credits += statuses[seen].credits;
+        }
+        TEST_ASSERT_TRUE(credits * CHUNK_SIZE <= platform.freeSpace(sent - platform.posted_bytes));
+    };
+
+    platform.pump(session);
+    collect();
+    TEST_ASSERT_TRUE(credits > 0);
+
+    // Write as much as granted before letting the writer run, one message at a time.
+    while (sent < image.size()) {
+        if (credits == 0) {
+            TEST_ASSERT_FALSE(platform.messages.empty());
+            platform.pump(session, 1);
+            collect();
+            continue;
+        }
+
+        size_t length = std::min(CHUNK_SIZE, image.size() - sent);
+        TEST_ASSERT_TRUE(session.write(&image[sent], length));
+        sent += length;
+        --credits;
+    }
+
+    platform.pump(session);
+    finishImage(platform, session);
+
+    TEST_ASSERT_EQUAL(0, platform.buffer_waits);
+    assertCompleted(platform);
+    assertFlashHolds(platform, image);
+}
+
+static void test_chunk_larger_than_chunk_size_is_rejected() {
+    FakePlatform platform;
+    OtaSession session(platform);
+    recordStatus(session);
+
+    std::vector<uint8_t> image = makeImage(10000, 4);
+
+    TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, image.size(), 500, nullptr));
+    platform.pump(session);
+    TEST_ASSERT_TRUE(session.write(&image[0], 500));
+    TEST_ASSERT_FALSE(session.write(&image[500], 501));
+    platform.pump(session);
+
+    TEST_ASSERT_TRUE(statuses.back().complete);
+    TEST_ASSERT_FALSE(statuses.back().success);
+    TEST_ASSERT_FALSE(platform.hashing);
+    TEST_ASSERT_EQUAL(OtaSession::BUFFER_COUNT, platform.free_buffers.size());
+
+    // The session is over, nothing more goes to the writer.
+    TEST_ASSERT_FALSE(session.write(&image[500], 500));
+    TEST_ASSERT_FALSE(session.end(SIGNATURE, sizeof(SIGNATURE)));
+    TEST_ASSERT_FALSE(platform.activated);
+}
+
+static void test_resume_from_checkpoint_matches_uninterrupted_hash() {
+    std::vector<uint8_t> image = makeImage(200000, 5);
+    uint8_t image_id[32];
+    memset(image_id, 0x42, sizeof(image_id));
+
+    FakePlatform reference;
+    {
+        OtaSession session(reference);
+        recordStatus(session);
+        TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, image.size(), 0, image_id));
+        reference.pump(session);
+        sendImage(reference, session, image, 0, image.size(), 512);
+        finishImage(reference, session);
+        assertCompleted(reference);
+    }
+
+    FakePlatform interrupted;
+    {
+        OtaSession session(interrupted);
+        recordStatus(session);
+        TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, image.size(), 0, image_id));
+        interrupted.pump(session);
+        sendImage(interrupted, session, image, 0, 150000, 512);
+    }
+    TEST_ASSERT_EQUAL(2, interrupted.checkpoints_saved);
+    TEST_ASSERT_TRUE(interrupted.nvs.has_value());
+
+    // After a restart only the flash and NVS are left.
+    FakePlatform resumed;
+    resumed.flash = interrupted.flash;
+    resumed.nvs = interrupted.nvs;
+
+    OtaSession session(resumed);
+    recordStatus(session);
+    TEST_ASSERT_TRUE(session.begin(OtaFormat::Raw, image.size(), 0, image_id));
+    resumed.pump(session);
+
+    size_t offset = statuses.front().progress;
+    TEST_ASSERT_EQUAL(2 * OtaSession::CHECKPOINT_INTERVAL, offset);
+
+    sendImage(resumed, session, image, offset, image.size(), 512);
+    finishImage(resumed, session);
+
+    assertCompleted(resumed);
+    assertFlashHolds(resumed, image);
+    TEST_ASSERT_EQUAL_UINT64(reference.verified_hash, resumed.verified_hash);
+    TEST_ASSERT_FALSE(resumed.nvs.has_value());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_restart_mid_stream);
+    RUN_TEST(test_credits_never_exceed_free_buffers);
+    RUN_TEST(test_chunk_larger_than_chunk_size_is_rejected);
+    RUN_TEST(test_resume_from_checkpoint_matches_uninterrupted_hash);
+    return UNITY_END();
+}